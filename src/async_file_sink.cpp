@@ -0,0 +1,424 @@
+#include "async_file_sink.hpp"
+
+#include <algorithm>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define BELOG_HAS_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
+
+namespace belog {
+
+#if defined(_WIN32)
+
+struct async_file_sink::io_context {
+    HANDLE file = INVALID_HANDLE_VALUE;
+    std::vector<OVERLAPPED> requests;
+
+    io_context(const char* path, u32 region_count, u64& file_offset) :
+        requests(region_count)
+    {
+        file = CreateFileA(
+            path, GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, nullptr
+        );
+        if (file == INVALID_HANDLE_VALUE)
+            return;
+
+        LARGE_INTEGER size;
+        if (GetFileSizeEx(file, &size)) {
+            file_offset = u64(size.QuadPart);
+        }
+
+        for (auto& request : requests) {
+            request = OVERLAPPED{};
+            request.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        }
+    }
+
+    ~io_context() {
+        for (auto& request : requests) {
+            if (request.hEvent != nullptr) {
+                CloseHandle(request.hEvent);
+            }
+        }
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+        }
+    }
+
+    bool is_open() const {
+        return file != INVALID_HANDLE_VALUE;
+    }
+
+    bool is_async() const {
+        return true;
+    }
+
+    bool submit(u32 idx, const char* data, size_t length, u64 offset) {
+        auto& request = requests[idx];
+        request.Offset = DWORD(offset);
+        request.OffsetHigh = DWORD(offset >> 32);
+        ResetEvent(request.hEvent);
+
+        if (WriteFile(file, data, DWORD(length), nullptr, &request))
+            return true;
+
+        return GetLastError() == ERROR_IO_PENDING;
+    }
+
+    // returns the number of bytes written, or -1 on failure
+    i64 wait_for(u32 idx) {
+        DWORD written = 0;
+        if (GetOverlappedResult(file, &requests[idx], &written, TRUE) == FALSE)
+            return -1;
+
+        return i64(written);
+    }
+
+    bool write_sync(const char* data, size_t length, u64 offset) {
+        OVERLAPPED request{};
+        request.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        if (request.hEvent == nullptr)
+            return false;
+
+        bool result = true;
+        while (result && length > 0) {
+            request.Offset = DWORD(offset);
+            request.OffsetHigh = DWORD(offset >> 32);
+            ResetEvent(request.hEvent);
+
+            DWORD written = 0;
+            result = (WriteFile(file, data, DWORD(length), nullptr, &request) || GetLastError() == ERROR_IO_PENDING)
+                && GetOverlappedResult(file, &request, &written, TRUE);
+
+            data += written;
+            offset += written;
+            length -= written;
+        }
+
+        CloseHandle(request.hEvent);
+        return result;
+    }
+};
+
+#else
+
+struct async_file_sink::io_context {
+    int fd = -1;
+
+#if defined(BELOG_HAS_IO_URING)
+    int ring_fd = -1;
+
+    void* sq_ring = MAP_FAILED;
+    size_t sq_ring_size = 0;
+    void* cq_ring = MAP_FAILED;
+    size_t cq_ring_size = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqes_size = 0;
+
+    u32* sq_tail = nullptr;
+    u32* sq_mask = nullptr;
+    u32* sq_array = nullptr;
+    u32* cq_head = nullptr;
+    u32* cq_tail = nullptr;
+    u32* cq_mask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+
+    std::vector<iovec> vectors;
+    std::vector<i32> results;
+    std::vector<bool> completed;
+#endif
+
+    io_context(const char* path, u32 region_count, u64& file_offset) {
+        fd = ::open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return;
+
+        auto end = ::lseek(fd, 0, SEEK_END);
+        file_offset = (end > 0) ? u64(end) : 0;
+
+#if defined(BELOG_HAS_IO_URING)
+        setup_ring(region_count);
+#else
+        (void)region_count;
+#endif
+    }
+
+    ~io_context() {
+#if defined(BELOG_HAS_IO_URING)
+        teardown_ring();
+#endif
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    bool is_open() const {
+        return fd >= 0;
+    }
+
+#if defined(BELOG_HAS_IO_URING)
+    bool is_async() const {
+        return ring_fd >= 0;
+    }
+
+    void setup_ring(u32 region_count) {
+        io_uring_params params{};
+        ring_fd = int(syscall(__NR_io_uring_setup, region_count, &params));
+        if (ring_fd < 0)
+            return;
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        sqes = static_cast<io_uring_sqe*>(
+            mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES)
+        );
+        if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+            teardown_ring();
+            return;
+        }
+
+        auto sq = static_cast<char*>(sq_ring);
+        sq_tail = reinterpret_cast<u32*>(sq + params.sq_off.tail);
+        sq_mask = reinterpret_cast<u32*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<u32*>(sq + params.sq_off.array);
+
+        auto cq = static_cast<char*>(cq_ring);
+        cq_head = reinterpret_cast<u32*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<u32*>(cq + params.cq_off.tail);
+        cq_mask = reinterpret_cast<u32*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        vectors.resize(region_count);
+        results.resize(region_count);
+        completed.resize(region_count, true);
+    }
+
+    void teardown_ring() {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_size);
+            sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+        }
+        if (cq_ring != MAP_FAILED) {
+            munmap(cq_ring, cq_ring_size);
+            cq_ring = MAP_FAILED;
+        }
+        if (sq_ring != MAP_FAILED) {
+            munmap(sq_ring, sq_ring_size);
+            sq_ring = MAP_FAILED;
+        }
+        if (ring_fd >= 0) {
+            ::close(ring_fd);
+            ring_fd = -1;
+        }
+    }
+
+    bool submit(u32 idx, const char* data, size_t length, u64 offset) {
+        // Only the consumer thread submits, so the tail needs no atomic RMW,
+        // but the kernel must see the SQE before the new tail.
+        u32 tail = *sq_tail;
+        u32 slot = tail & *sq_mask;
+
+        vectors[idx].iov_base = const_cast<char*>(data);
+        vectors[idx].iov_len = length;
+        completed[idx] = false;
+
+        io_uring_sqe& sqe = sqes[slot];
+        sqe = io_uring_sqe{};
+        sqe.opcode = IORING_OP_WRITEV;
+        sqe.fd = fd;
+        sqe.off = offset;
+        sqe.addr = u64(uptr(&vectors[idx]));
+        sqe.len = 1;
+        sqe.user_data = idx;
+
+        sq_array[slot] = slot;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        for (;;) {
+            auto submitted = syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, nullptr, 0);
+            if (submitted > 0)
+                return true;
+            if (submitted == 0 || (errno != EINTR && errno != EAGAIN))
+                break;
+        }
+
+        // Without SQPOLL the kernel only takes entries from the ring inside
+        // io_uring_enter, so the one it did not take can be withdrawn. Left
+        // queued, it would be written along with the next request.
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+        completed[idx] = true;
+        return false;
+    }
+
+    void reap() {
+        u32 head = *cq_head;
+        u32 tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            const io_uring_cqe& cqe = cqes[head & *cq_mask];
+            results[cqe.user_data] = cqe.res;
+            completed[cqe.user_data] = true;
+            head += 1;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // returns the number of bytes written, or -1 on failure
+    i64 wait_for(u32 idx) {
+        reap();
+        while (completed[idx] == false) {
+            auto result = syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (result < 0 && errno != EINTR)
+                return -1;
+            reap();
+        }
+
+        return (results[idx] >= 0) ? i64(results[idx]) : -1;
+    }
+#else
+    bool is_async() const {
+        return false;
+    }
+
+    bool submit(u32, const char*, size_t, u64) {
+        return false;
+    }
+
+    i64 wait_for(u32) {
+        return -1;
+    }
+#endif
+
+    bool write_sync(const char* data, size_t length, u64 offset) {
+        while (length > 0) {
+            auto written = ::pwrite(fd, data, length, off_t(offset));
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            data += written;
+            offset += u64(written);
+            length -= size_t(written);
+        }
+        return true;
+    }
+};
+
+#endif
+
+async_file_sink::async_file_sink(const char* path, size_t region_size, u32 region_count, bool allow_async) :
+    _regions(std::max(region_count, u32(1))),
+    _region_size(region_size)
+{
+    _io = std::make_unique<io_context>(path, u32(_regions.size()), _file_offset);
+    _async = allow_async && _io->is_async();
+
+    for (auto& region : _regions) {
+        region.memory.reset(static_cast<char*>(aligned_alloc(64, region_size)));
+        if (region.memory == nullptr) {
+            _failed = true;
+        }
+    }
+}
+
+async_file_sink::~async_file_sink() {
+    flush();
+}
+
+bool async_file_sink::is_open() const {
+    return _io->is_open() && _failed == false;
+}
+
+bool async_file_sink::is_async() const {
+    return _async;
+}
+
+char* async_file_sink::acquire(size_t min_capacity, size_t& capacity) {
+    if (is_open() == false || min_capacity > _region_size)
+        return nullptr;
+
+    // Reusing a region means waiting for the kernel to be done with it.
+    auto idx = _next_region;
+    if (wait_for(idx) == false) {
+        _failed = true;
+    }
+
+    capacity = _region_size;
+    return _regions[idx].memory.get();
+}
+
+bool async_file_sink::commit(char* region, size_t length) {
+    auto idx = _next_region;
+    if (region != _regions[idx].memory.get())
+        return false;
+
+    _next_region = (idx + 1) % u32(_regions.size());
+    if (length == 0)
+        return true;
+
+    _regions[idx].length = length;
+    return submit(idx);
+}
+
+bool async_file_sink::flush() {
+    bool result = true;
+    for (u32 idx = 0; idx < u32(_regions.size()); idx += 1) {
+        result = wait_for(idx) && result;
+    }
+    return result;
+}
+
+bool async_file_sink::submit(u32 idx) {
+    auto& region = _regions[idx];
+    region.offset = _file_offset;
+    _file_offset += region.length;
+
+    if (_async) {
+        if (_io->submit(idx, region.memory.get(), region.length, region.offset)) {
+            region.in_flight = true;
+            return true;
+        }
+
+        // The request was taken back, don't try again for every region.
+        _async = false;
+    }
+
+    // no asynchronous I/O available, fall back to a blocking write
+    return _io->write_sync(region.memory.get(), region.length, region.offset);
+}
+
+bool async_file_sink::wait_for(u32 idx) {
+    auto& region = _regions[idx];
+    if (region.in_flight == false)
+        return true;
+
+    region.in_flight = false;
+    auto written = _io->wait_for(idx);
+    if (written < 0)
+        return false;
+
+    // finish short writes synchronously, they are rare enough for regular files
+    if (size_t(written) < region.length)
+        return _io->write_sync(region.memory.get() + written, region.length - size_t(written), region.offset + u64(written));
+
+    return true;
+}
+
+} // namespace belog
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "aligned_alloc.hpp"
+#include "log_sink.hpp"
+#include "types.hpp"
+
+namespace belog {
+
+// Appends to a file without blocking the logging thread on the disk. Output
+// is formatted into one of region_count regions, committed regions are
+// written asynchronously (io_uring on Linux, overlapped I/O on Windows) while
+// the consumer moves on to the next region. The consumer only waits when it
+// wraps around to a region that is still being written, which bounds the
+// memory in flight to region_count * region_size bytes.
+//
+// If asynchronous I/O is not available, not allowed, or fails to accept a
+// request, the sink falls back to write(), see is_async().
+struct async_file_sink : log_sink {
+    static constexpr size_t DEFAULT_REGION_SIZE = size_t(1) << 18;
+    static constexpr u32 DEFAULT_REGION_COUNT = 4;
+
+    explicit async_file_sink(
+        const char* path,
+        size_t region_size = DEFAULT_REGION_SIZE,
+        u32 region_count = DEFAULT_REGION_COUNT,
+        bool allow_async = true
+    );
+    ~async_file_sink() override;
+
+    async_file_sink(const async_file_sink&) = delete;
+    async_file_sink& operator=(const async_file_sink&) = delete;
+
+    bool is_open() const;
+    bool is_async() const;
+
+    char* acquire(size_t min_capacity, size_t& capacity) override;
+    bool commit(char* region, size_t length) override;
+    bool flush() override;
+
+    struct io_context;
+
+private:
+    struct region {
+        std::unique_ptr<char, aligned_free_deleter> memory;
+        size_t length = 0;
+        u64 offset = 0;
+        bool in_flight = false;
+    };
+
+    bool submit(u32 idx);
+    bool wait_for(u32 idx);
+
+    std::unique_ptr<io_context> _io;
+    std::vector<region> _regions;
+    size_t _region_size;
+    u64 _file_offset = 0;
+    u32 _next_region = 0;
+    bool _async = false;
+    bool _failed = false;
+};
+
+} // namespace belog
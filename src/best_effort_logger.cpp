@@ -1,384 +1,1749 @@
 #include "best_effort_logger.hpp"
 
-#include <array>
+#include <algorithm>
 #include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
 #include <cstdlib>
-#include <iostream>
-#include <iomanip>
-#include <sstream>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+#include <string>
 #include <thread>
+#include <vector>
 #include "aligned_alloc.hpp"
-#include "bitmanip.hpp"
+#include "binary_log_writer.hpp"
+#include "log_format.hpp"
+#include "log_sink.hpp"
+#include "scope_guard.hpp"
 #include "threads.hpp"
+#include "wall_clock.hpp"
+
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#elif defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 namespace belog {
 
-static std::array<std::atomic<thread_buffer_t*>, 256> thread_buffer;
+// Buffers belong to the registry rather than to the threads writing to them,
+// so lines of a thread that exited can still be drained.
+struct thread_buffer_node {
+    // The buffer the logging thread drains. The thread may have moved on to
+    // its successors already, the logging thread follows once it drained it.
+    thread_buffer_t* buffer = nullptr;
+    // changes under recorder_mutex when another thread takes the node over
+    u32 thread_id = 0;
+    // set when the thread exited, it will not write to buffer anymore
+    std::atomic_bool retired = false;
+    thread_buffer_node* next = nullptr;
+    // shard whose logging thread drains buffer, changes when the node is
+    // handed to another shard
+    u32 shard = 0;
+    // lines taken from buffer per pass of the logging thread, only used by
+    // the logging thread
+    size_t quota;
+
+    // Lines the thread could not fit into buffer, with the times of the first
+    // and the last of them. Only written by the thread when it drops a line,
+    // so the logging thread reading them does not cost the thread anything
+    // as long as its lines fit.
+    alignas(64) std::atomic<u64> dropped = 0;
+    std::atomic<u64> first_drop = 0;
+    std::atomic<u64> last_drop = 0;
+    // only written by the thread as well, see _count_left_out()
+    std::atomic<u64> strings_left_out = 0;
+
+    // Written by the logging thread after reporting drops. The thread only
+    // reads it when it drops a line, to tell whether a new run of drops
+    // started.
+    alignas(64) std::atomic<u64> reported = 0;
+    // time of the last drop reported, only used by the logging thread
+    u64 reported_until = 0;
+
+    // The buffer as last seen by the logging thread, and since when it has
+    // been empty. Only used by the logging thread.
+    const thread_buffer_t* idle_buffer = nullptr;
+    u64 idle_since = 0;
+
+    // Lines the thread recorded rather than logged, allocated on the first
+    // one. Stays with the node, the next thread to take it over starts with
+    // an empty recorder.
+    std::atomic<recorder_t*> recorder = nullptr;
+    // position in recorder of the last dump, guarded by recorder_mutex
+    size_t recorder_dumped_until = 0;
+
+    // Nodes are never freed, crash_dump() walks all of them while threads
+    // come and go. Once the logging thread drained the buffer of a retired
+    // thread, in_use is cleared and the next thread calling enable_logging()
+    // takes the node over.
+    thread_buffer_node* next_allocated = nullptr;
+    std::atomic_bool in_use = true;
+};
+
+// node of the calling thread, set by enable_logging()
+static thread_local thread_buffer_node* thread_node = nullptr;
+
+static constexpr size_t MIN_BUFFER_SIZE = size_t(1) << BELOG_MIN_BUFFER_SIZE_LOG2;
+static constexpr size_t MAX_BUFFER_SIZE = size_t(1) << BELOG_BUFFER_SIZE_LOG2;
+
+// A buffer larger than the minimum is sealed once the logging thread found it
+// empty for this long, the thread starts over with a buffer of the minimum
+// size on its next line.
+static constexpr u64 SHRINK_IDLE_SECONDS = 1;
+
+// Buffers are drained in batches of up to their quota per pass. The quota
+// grows while a buffer has a backlog and shrinks once it keeps up, but stays
+// small enough that a busy thread cannot starve the others.
+static constexpr size_t MIN_BATCH_QUOTA = 8;
+static constexpr size_t MAX_BATCH_QUOTA = 512;
+
+// Every logging thread drains the buffers of a shard of its own, see
+// set_shard_count().
+static constexpr u32 MAX_SHARDS = 64;
+
+static constexpr u64 STOPPED_BACKLOG = ~u64(0);
+
+struct alignas(64) shard_state {
+    // Buffers registered with the shard since its logging thread last looked.
+    // Nodes are taken out all at once, by exchanging the list with nullptr,
+    // so every node goes to exactly one thread even if several take nodes
+    // out. Usually that is the logging thread of the shard. Once the shard
+    // has stopped, rebalance in do_logging_shard() takes over a buffer it
+    // handed to the shard too late, and the logging thread of shard 0 moves
+    // buffers of shards beyond the shard count, see
+    // rehome_orphaned_buffers().
+    std::atomic<thread_buffer_node*> registered = nullptr;
+    // Bytes waiting in the buffers of the shard, as of the last flush of its
+    // logging thread. STOPPED_BACKLOG while the shard has no logging thread,
+    // so buffers are only handed to shards that are drained.
+    std::atomic<u64> backlog = STOPPED_BACKLOG;
+    std::atomic<log_sink*> sink = nullptr;
+    std::atomic<log_sink*> index_sink = nullptr;
+    // set while a logging thread runs do_logging_shard() for the shard
+    std::atomic_bool running = false;
+};
+
+static shard_state shards[MAX_SHARDS];
+static std::atomic<u32> shard_count = 1;
+
+// shard of the calling thread if it is a logging thread, for crash_dump()
+static constexpr u32 NO_SHARD = ~u32(0);
+static thread_local u32 own_shard = NO_SHARD;
+
+// A logging thread hands a buffer to the shard with the least backlog once
+// its own backlog is larger by this many bytes. Backlogs are published once
+// per flush interval, so buffers move at most that often.
+static constexpr u64 REBALANCE_THRESHOLD = MAX_BUFFER_SIZE / 4;
+
+// every node ever allocated, newest first
+static std::atomic<thread_buffer_node*> allocated_buffers = nullptr;
+
 static constexpr u64 SHUTDOWN_SENTINEL_VALUE = ~u64(0);
 static std::atomic_bool emergency_shutdown_requested = false;
+// logging threads currently running, crash_dump() waits for them to stop
+static std::atomic<u32> consumers_running = 0;
+// Shutdown requests seen by logging threads since the last of them stopped.
+// Once one of them sees a request, the others stop as soon as their buffers
+// are empty.
+static std::atomic<u64> shutdowns_seen = 0;
+static std::atomic<output_format> format = output_format::text;
+static std::atomic<output_order> order = output_order::arrival;
+static std::atomic<u32> reorder_window_us = 1000;
+static std::atomic<time_format> timestamps = time_format::wall_clock;
+static std::atomic<u32> spin_budget = 2000;
+static std::atomic<u32> formatter_threads = 0;
+
+// The logging thread checks its map of tsc() to the system clock this often.
+static constexpr u64 CALIBRATIONS_PER_SECOND = 1;
+
+// Only written by logging threads.
+static std::atomic<u64> total_dropped = 0;
+static std::atomic<u64> drop_reports = 0;
+static std::atomic<u64> largest_drop_report = 0;
+
+// A parked logging thread wakes up on its own after this long, in case a
+// producer missed that it parked, see park().
+static constexpr u32 PARK_TIMEOUT_MS = 100;
+
+// logging threads in park(), the last one to leave clears _consumer_parked
+static std::atomic<u32> parked_consumers = 0;
+
+// Lines at or above this level wait for room in a full buffer, see
+// set_blocking_level().
+static std::atomic<u8> blocking_threshold = u8(level::off);
+static std::atomic<u32> blocking_timeout_us = 10000;
+
+// Non-zero while producers wait for room in their buffer. Logging threads
+// check it without a full barrier after taking lines out of buffers, a
+// producer that misses its wakeup looks again after this long.
+static std::atomic<u32> producers_waiting = 0;
+static constexpr u32 BLOCKING_PARK_TIMEOUT_MS = 1;
+// times a waiting producer looks at its buffer before it parks
+static constexpr u32 BLOCKING_SPINS = 1000;
+
+std::atomic<u8> global_threshold = u8(level::debug);
+std::atomic<u8> recorder_threshold = u8(level::off);
+
+// Lines at or above this level make the logging thread dump the recorders
+// first, see set_recorder_trigger().
+static std::atomic<u8> recorder_trigger = u8(level::error);
+static std::atomic_bool recorder_dump_requested = false;
+// held by the logging thread dumping the recorders, and by threads taking
+// over the node, and with it the recorder, of a thread that exited
+static std::mutex recorder_mutex;
+
+// Modules register themselves during static initialization, so the registry
+// has to be usable before any constructor in this file ran.
+static module* modules = nullptr;
+static std::mutex& module_mutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+// Formatted output is handed to the sink whenever the consumer runs out of
+// lines, but at least this often while lines keep coming in.
+static constexpr u64 FLUSH_INTERVALS_PER_SECOND = 100;
+
+#if defined(_WIN32)
+
+static void wait_while_parked(std::atomic<u32>& word, u32 timeout_ms) {
+    u32 parked = 1;
+    WaitOnAddress(&word, &parked, sizeof(parked), timeout_ms);
+}
+
+static void wake_parked(std::atomic<u32>& word) {
+    WakeByAddressAll(&word);
+}
+
+#elif defined(__linux__)
+
+static void wait_while_parked(std::atomic<u32>& word, u32 timeout_ms) {
+    timespec timeout{ time_t(timeout_ms / 1000), long(timeout_ms % 1000) * 1000000 };
+    syscall(SYS_futex, &word, FUTEX_WAIT_PRIVATE, 1, &timeout, nullptr, 0);
+}
+
+static void wake_parked(std::atomic<u32>& word) {
+    syscall(SYS_futex, &word, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+
+#else
+
+static void wait_while_parked(std::atomic<u32>&, u32 timeout_ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+}
+
+static void wake_parked(std::atomic<u32>&) {
+}
+
+#endif
 
 namespace detail {
 
-thread_buffer_t* _buffer_for_thread(u32 tid) {
-    return thread_buffer[tid].load(std::memory_order_relaxed);
+// Only the first producer to see logging threads parked pays for the system
+// call, which wakes all of them.
+void _wake_consumer() {
+    if (_consumer_parked.exchange(0, std::memory_order_relaxed) != 0) {
+        wake_parked(_consumer_parked);
+    }
 }
 
+// Lines larger than the buffer get a buffer large enough for them, if there
+// is one. Buffers are only allocated here, when a line did not fit, so memory
+// follows the number of lines logged rather than the number of threads.
+thread_buffer_t* _switch_buffer(thread_buffer_t* buffer, size_t length) {
+    size_t rounded_length = ctu::round_up_bits(length + sizeof(thread_buffer_t::difference_type), thread_buffer_t::content_align_log2);
+
+    size_t size = buffer->is_sealed() ? MIN_BUFFER_SIZE : buffer->size() * 2;
+    while (size < rounded_length) {
+        size *= 2;
+    }
+    if (size > MAX_BUFFER_SIZE)
+        return nullptr;
+
+    thread_buffer_t* next = thread_buffer_t::create(size);
+    if (next == nullptr)
+        return nullptr;
+
+    buffer->link(next);
+    _thread_buffer = next;
+    return next;
 }
 
-static auto& DIGITS =
-    "0001020304050607080910111213141516171819"
-    "2021222324252627282930313233343536373839"
-    "4041424344454647484950515253545556575859"
-    "6061626364656667686970717273747576777879"
-    "8081828384858687888990919293949596979899";
+void _count_drop() {
+    thread_buffer_node* node = thread_node;
+    u64 timepoint = tsc();
 
-template<typename stream, typename type>
-void log_integral_value(stream& out, integer_attributes attrs, type val) {
-    if (attrs.is_hex) {
-        const char* base = attrs.is_uppercase ? "0123456789ABCDEF" : "0123456789abcdef";
-        char buffer[attrs.max_padded_length()];
-        int digits = (bitmanip::find_last_set(val) / 4) + 1;
+    u64 dropped = node->dropped.load(std::memory_order_relaxed);
+    if (dropped == node->reported.load(std::memory_order_relaxed)) {
+        node->first_drop.store(timepoint, std::memory_order_relaxed);
+    }
+    node->last_drop.store(timepoint, std::memory_order_relaxed);
+    node->dropped.store(dropped + 1, std::memory_order_release);
+}
 
-        size_t idx = 0;
-        if (attrs.is_left_aligned == false && attrs.padded_length() > digits) {
-            while (idx < attrs.padded_length() - digits) {
-                buffer[idx] = char(attrs.padding_codepoint);
-                idx += 1;
-            }
-        }
+// Lines below the blocking level, and lines that were kept waiting for long
+// enough, get nullptr and are dropped. Others get the buffer to try again
+// with once there may be room in it.
+thread_buffer_t* _wait_for_space(level severity, size_t length, u64& deadline) {
+    if (u8(severity) < blocking_threshold.load(std::memory_order_relaxed)
+        || consumers_running.load(std::memory_order_relaxed) == 0)
+        return nullptr;
 
-        do {
-            digits -= 1;
-            buffer[idx] = base[(val >> (digits * 4)) & 0xF];
-            idx += 1;
-        } while (digits > 0);
+    thread_buffer_t* buffer = _thread_buffer;
+    size_t rounded_length = ctu::round_up_bits(length + sizeof(thread_buffer_t::difference_type), thread_buffer_t::content_align_log2);
+    // _switch_buffer() could not find a buffer large enough
+    if (rounded_length > buffer->size())
+        return nullptr;
 
-        if (attrs.is_left_aligned) {
-            while (idx < attrs.padded_length()) {
-                buffer[idx] = char(attrs.padding_codepoint);
-                idx += 1;
-            }
-        }
+    u64 now = tsc();
+    if (deadline == 0) {
+        deadline = now + tsc_frequency() / 1000000 * blocking_timeout_us.load(std::memory_order_relaxed);
+    } else if (now >= deadline) {
+        return nullptr;
+    }
 
-        out.write(buffer, idx);
-    } else {
-        char buffer[2 * attrs.max_padded_length()];
-        memset(buffer, int(attrs.padding_codepoint), sizeof(buffer));
+    // The logging thread sealed the buffer while the line waited.
+    if (buffer->is_sealed())
+        return _switch_buffer(buffer, length);
 
-        using unsigned_type = std::make_unsigned_t<type>;
+    _wake_consumer();
 
-        unsigned_type abs_val;
-        if constexpr (std::is_same_v<type, unsigned_type>) {
-            abs_val = val;
-        } else if (val < 0) {
-            abs_val = unsigned_type(~val + 1);
-        } else {
-            abs_val = unsigned_type(val);
+    // The ring can waste up to a line at its end, a line surely fits once
+    // twice its length is free.
+    auto has_room = [buffer, rounded_length] {
+        return buffer->used() == 0 || buffer->size() - buffer->used() >= 2 * rounded_length;
+    };
+    for (u32 spin = 0; spin < BLOCKING_SPINS; spin += 1) {
+        if (has_room())
+            return buffer;
+    }
+
+    producers_waiting.store(1, std::memory_order_seq_cst);
+    if (has_room() == false) {
+        wait_while_parked(producers_waiting, BLOCKING_PARK_TIMEOUT_MS);
+    }
+    return buffer;
+}
+
+// Only runs on the first call of each log statement.
+void _segment_builder::add(const callsite_segment& segment) {
+    if (segment.is_literal() && count > 0 && segments[count - 1].is_literal()) {
+        callsite_segment& previous = segments[count - 1];
+        if (merging == false) {
+            memcpy(merged_text, previous.literal, previous.literal_length);
+            previous.literal = merged_text;
+            merged_text += previous.literal_length;
+            merging = true;
         }
 
-        // start in the middle of the buffer, in order to take padding into account
-        auto ptr = buffer + attrs.max_padded_length();
+        memcpy(merged_text, segment.literal, segment.literal_length);
+        merged_text += segment.literal_length;
+        previous.literal_length += segment.literal_length;
+        return;
+    }
 
-        // convert two digits at the same time
-        while (abs_val >= 100) {
-            size_t idx = (abs_val % 100) * 2;
-            *(ptr--) = DIGITS[idx + 1];
-            *(ptr--) = DIGITS[idx];
-            abs_val /= 100;
+    segments[count] = segment;
+    count += 1;
+    merging = false;
+}
+
+recorder_t* _attach_recorder() {
+    thread_buffer_node* node = thread_node;
+    if (node == nullptr)
+        return nullptr;
+
+    recorder_t* recorder = node->recorder.load(std::memory_order_relaxed);
+    if (recorder == nullptr) {
+        void* space = aligned_alloc(recorder_t::align, sizeof(recorder_t));
+        if (space == nullptr)
+            return nullptr;
+
+        recorder = new(space) recorder_t();
+        node->recorder.store(recorder, std::memory_order_release);
+    }
+
+    _recorder = recorder;
+    return recorder;
+}
+
+void _count_left_out() {
+    thread_buffer_node* node = thread_node;
+    node->strings_left_out.store(node->strings_left_out.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+} // namespace detail
+
+// Appends buffers registered with shard since the last call to buffers, in
+// the order they were registered in.
+static void adopt_registered_buffers(u32 shard, std::vector<thread_buffer_node*>& buffers) {
+    thread_buffer_node* node = shards[shard].registered.exchange(nullptr, std::memory_order_acquire);
+
+    size_t first = buffers.size();
+    for (; node != nullptr; node = node->next) {
+        buffers.push_back(node);
+    }
+    std::reverse(buffers.begin() + first, buffers.end());
+}
+
+// Hands node to the logging thread of its shard.
+static void register_buffer(thread_buffer_node* node) {
+    std::atomic<thread_buffer_node*>& registered = shards[node->shard].registered;
+    node->next = registered.load(std::memory_order_relaxed);
+    while (registered.compare_exchange_weak(node->next, node, std::memory_order_seq_cst, std::memory_order_relaxed) == false) {
+    }
+}
+
+// Marks shard as having no logging thread, so no more buffers are handed to
+// it. Returns false if a buffer was handed to it in the meantime, see
+// rebalance in do_logging_shard().
+static bool leave_shard(u32 shard) {
+    shards[shard].backlog.store(STOPPED_BACKLOG, std::memory_order_seq_cst);
+    return shards[shard].registered.load(std::memory_order_seq_cst) == nullptr;
+}
+
+// Moves buffers registered with shards beyond the shard count, which have no
+// logging thread, to the shards their threads are assigned to now.
+static void rehome_orphaned_buffers() {
+    u32 count = shard_count.load(std::memory_order_relaxed);
+    for (u32 shard = count; shard < MAX_SHARDS; shard += 1) {
+        thread_buffer_node* node = shards[shard].registered.exchange(nullptr, std::memory_order_acquire);
+        while (node != nullptr) {
+            thread_buffer_node* next = node->next;
+            node->shard = node->thread_id % count;
+            register_buffer(node);
+            node = next;
         }
-        // take care of the last two digits
-        *(ptr--) = DIGITS[abs_val * 2 + 1];
-        if (abs_val >= 10) {
-            *(ptr--) = DIGITS[abs_val * 2];
+    }
+}
+
+// The buffer of node the logging thread drains next. Buffers the thread
+// moved on from are freed once they are drained.
+static thread_buffer_t& current_buffer(thread_buffer_node* node) {
+    while (thread_buffer_t* next = node->buffer->successor()) {
+        // the thread does not write to a buffer after it moved on
+        node->buffer->unseal();
+        if (node->buffer->is_empty() == false)
+            break;
+
+        thread_buffer_t::destroy(node->buffer);
+        node->buffer = next;
+    }
+    return *node->buffer;
+}
+
+// Seals the buffer of node once it was found empty for idle_timeout, unless
+// it is the smallest size already.
+static void shrink_idle_buffer(thread_buffer_node* node, u64 now, u64 idle_timeout) {
+    thread_buffer_t& buffer = current_buffer(node);
+    if (&buffer != node->idle_buffer || buffer.is_empty() == false) {
+        node->idle_buffer = &buffer;
+        node->idle_since = now;
+        return;
+    }
+
+    if (buffer.size() > MIN_BUFFER_SIZE && now - node->idle_since >= idle_timeout) {
+        buffer.seal();
+    }
+}
+
+// The buffer of node is empty and its thread exited. The next thread to take
+// the node over starts with a buffer of the minimum size.
+static void release_buffer(thread_buffer_node* node) {
+    if (node->buffer->size() > MIN_BUFFER_SIZE) {
+        if (thread_buffer_t* smaller = thread_buffer_t::create(MIN_BUFFER_SIZE)) {
+            thread_buffer_t::destroy(node->buffer);
+            node->buffer = smaller;
         }
+    }
+    node->buffer->unseal();
+    node->in_use.store(false, std::memory_order_release);
+}
 
-        if (val < 0) {
-            *(ptr--) = '-';
-        } else if (attrs.show_sign) {
-            *(ptr--) = '+';
+// Takes over the node of a thread that exited, if there is one. Its buffers
+// are empty and stay where they are. Lines left in its recorder are dropped,
+// a logging thread dumping the recorders sees either all of them under the
+// old thread id or none.
+static thread_buffer_node* reuse_buffer(u32 thread_id) {
+    thread_buffer_node* node = allocated_buffers.load(std::memory_order_acquire);
+    for (; node != nullptr; node = node->next_allocated) {
+        bool in_use = false;
+        if (node->in_use.load(std::memory_order_relaxed) == false
+            && node->in_use.compare_exchange_strong(in_use, true, std::memory_order_acquire)) {
+            break;
         }
+    }
+
+    if (node == nullptr)
+        return nullptr;
+
+    node->retired.store(false, std::memory_order_relaxed);
+    node->next = nullptr;
+    node->dropped.store(0, std::memory_order_relaxed);
+    node->first_drop.store(0, std::memory_order_relaxed);
+    node->last_drop.store(0, std::memory_order_relaxed);
+    node->reported.store(0, std::memory_order_relaxed);
+    node->reported_until = 0;
 
-        size_t write_len = std::max(size_t(attrs.padded_length()), size_t((buffer + attrs.max_padded_length()) - ptr));
-        
-        if (attrs.is_left_aligned) {
-            out.write(ptr + 1, write_len);
+    std::lock_guard<std::mutex> lock(recorder_mutex);
+    if (recorder_t* recorder = node->recorder.load(std::memory_order_relaxed)) {
+        recorder->clear();
+    }
+    node->recorder_dumped_until = 0;
+    node->thread_id = thread_id;
+    return node;
+}
+
+static thread_buffer_node* allocate_buffer(u32 thread_id) {
+    thread_buffer_t* buffer = thread_buffer_t::create(MIN_BUFFER_SIZE);
+    if (buffer == nullptr)
+        return nullptr;
+
+    void* space = aligned_alloc(alignof(thread_buffer_node), sizeof(thread_buffer_node));
+    if (space == nullptr) {
+        thread_buffer_t::destroy(buffer);
+        return nullptr;
+    }
+
+    auto node = new(space) thread_buffer_node();
+    node->buffer = buffer;
+    node->thread_id = thread_id;
+    node->next_allocated = allocated_buffers.load(std::memory_order_relaxed);
+    while (allocated_buffers.compare_exchange_weak(node->next_allocated, node, std::memory_order_release, std::memory_order_relaxed) == false) {
+    }
+    return node;
+}
+
+static void log_segments(output_buffer& out, const line_start_data* line, const char* elem) {
+    const callsite* site = line->site;
+    for (size_t idx = 0; idx < site->segment_count; idx += 1) {
+        const callsite_segment& segment = site->segments[idx];
+        if (segment.is_literal()) {
+            out.write(segment.literal, segment.literal_length);
         } else {
-            out.write(buffer + attrs.max_padded_length() - write_len + 1, write_len);
+            elem += segment.log_func(elem, out);
         }
     }
 }
 
-template<typename stream, typename type>
-void log_float_value(stream& out, float_attributes attrs, type val) {
-    attrs;
-    size_t idx = 0;
-    char format[16];
-    format[idx++] = '%';
+static constexpr u32 MAX_FORMATTER_THREADS = 64;
+
+// The logging thread hands lines to the formatter threads once this many
+// bytes are waiting, or when it would flush the output.
+static constexpr size_t BATCH_SIZE = size_t(1) << 16;
+
+// Batches in flight per formatter thread, the logging thread waits for the
+// oldest one to be written once all of them are taken.
+static constexpr size_t BATCHES_PER_FORMATTER = 4;
 
-    if (attrs.sign_handling == FLOAT_SIGN_SHOW_ALWAYS) {
-        format[idx++] = '+';
-    } else if (attrs.sign_handling == FLOAT_SIGN_PAD_IF_POSITIVE) {
-        format[idx++] = ' ';
+// Lines copied out of the thread buffers, and the text they are formatted
+// into.
+struct line_batch {
+    struct entry {
+        size_t offset;
+        u32 thread_id;
+        // nanoseconds since 1970 for wall clock time, seconds since the
+        // logging thread started otherwise
+        i64 wall_clock;
+        f64 seconds;
+    };
+
+    std::vector<u64> lines;
+    std::vector<entry> entries;
+    memory_sink text;
+
+    size_t size() const {
+        return lines.size() * sizeof(u64);
     }
 
-    if (attrs.always_show_decimal_point) {
-        format[idx++] = '#';
+    void clear() {
+        lines.clear();
+        entries.clear();
+        text.clear();
     }
+};
 
-    if (attrs.precision != attrs.precision.mask) {
-        format[idx++] = '.';
-        if (attrs.precision >= 10) {
-            format[idx++] = DIGITS[attrs.precision * 2];
+static void copy_line(line_batch& batch, const line_batch::entry& entry, const line_start_data* line) {
+    const callsite* site = line->site;
+    const char* begin = reinterpret_cast<const char*>(line);
+    const char* pos = begin + sizeof(line_start_data);
+    for (size_t idx = 0; idx < site->segment_count; idx += 1) {
+        switch (site->segments[idx].kind) {
+            case segment_kind::literal:
+                break;
+            case segment_kind::string_pointer:
+                pos += sizeof(string_literal_data);
+                break;
+            case segment_kind::inline_string:
+                pos += reinterpret_cast<const inline_string_data*>(pos)->size();
+                break;
+            case segment_kind::user_type:
+                pos += reinterpret_cast<const user_type_header*>(pos)->size;
+                break;
+            case segment_kind::integer:
+                pos += sizeof(integer_data);
+                break;
+            case segment_kind::floating_point:
+                pos += sizeof(float_data);
+                break;
         }
-        format[idx++] = DIGITS[attrs.precision * 2 + 1];
     }
 
-    static auto& display_map = "fFeEaAgG";
-    format[idx++] = display_map[attrs.display_style * 2 + attrs.is_uppercase];
+    size_t length = size_t(pos - begin);
+    size_t offset = batch.lines.size();
+    batch.lines.resize(offset + (length + sizeof(u64) - 1) / sizeof(u64));
+    memcpy(batch.lines.data() + offset, begin, length);
+
+    batch.entries.push_back(entry);
+    batch.entries.back().offset = offset;
+}
 
-    format[idx] = 0;
-    char buffer[128];
-    size_t len = snprintf(buffer, sizeof(buffer), format, val);
-    if (len > 0) {
-        out.write(buffer, len);
+static void format_batch(line_batch& batch, bool wall_clock_time, timestamp_cache& cached_timestamp) {
+    output_buffer out(batch.text);
+    for (const line_batch::entry& entry : batch.entries) {
+        auto line = reinterpret_cast<const line_start_data*>(batch.lines.data() + entry.offset);
+        const callsite* site = line->site;
+        if (wall_clock_time) {
+            format_line_header(out, cached_timestamp, entry.thread_id, entry.wall_clock, site->severity, site->file, site->line);
+        } else {
+            format_line_header(out, entry.thread_id, entry.seconds, site->severity, site->file, site->line);
+        }
+        log_segments(out, line, reinterpret_cast<const char*>(line) + sizeof(line_start_data));
     }
 }
 
-size_t log_integer(const integer_data* msg) {
-    switch (msg->attributes.length_log2) {
-#if CHAR_MAX < SHRT_MAX
-        case ctu::log2(sizeof(char)):
-            if (msg->attributes.is_unsigned) {
-                unsigned char val;
-                memcpy(&val, msg->msg, sizeof(val));
-                log_integral_value(std::cout, msg->attributes, val);
-            } else {
-                signed char val;
-                memcpy(&val, msg->msg, sizeof(val));
-                log_integral_value(std::cout, msg->attributes, val);
-            }
-            break;
-#endif
+// Formats the batches the logging thread submits on a pool of threads, and
+// writes them to out on a thread of its own, in the order they were
+// submitted. Only the logging thread calls batch() and submit().
+struct formatting_pipeline {
+    formatting_pipeline(output_buffer& out, u32 thread_count, bool wall_clock_time) :
+        _out(out),
+        _wall_clock_time(wall_clock_time),
+        _batches(thread_count * BATCHES_PER_FORMATTER),
+        _formatted(_batches.size())
+    {
+        for (auto& batch : _batches) {
+            batch = std::make_unique<line_batch>();
+        }
+        for (u32 idx = 0; idx < thread_count; idx += 1) {
+            _formatters.emplace_back([this] { format_batches(); });
+        }
+        _emitter = std::thread([this] { emit_batches(); });
+    }
 
-#if SHRT_MAX < INT_MAX
-        case ctu::log2(sizeof(short)):
-            if (msg->attributes.is_unsigned) {
-                unsigned short val;
-                memcpy(&val, msg->msg, sizeof(val));
-                log_integral_value(std::cout, msg->attributes, val);
-            } else {
-                signed short val;
-                memcpy(&val, msg->msg, sizeof(val));
-                log_integral_value(std::cout, msg->attributes, val);
-            }
-            break;
-#endif
+    ~formatting_pipeline() {
+        stop(emergency_shutdown_requested.load(std::memory_order_relaxed) == false);
+    }
 
-#if INT_MAX < LONG_MAX
-        case ctu::log2(sizeof(int)):
-            if (msg->attributes.is_unsigned) {
-                unsigned int val;
-                memcpy(&val, msg->msg, sizeof(val));
-                log_integral_value(std::cout, msg->attributes, val);
-            } else {
-                signed int val;
-                memcpy(&val, msg->msg, sizeof(val));
-                log_integral_value(std::cout, msg->attributes, val);
-            }
-            break;
-#endif
+    formatting_pipeline(const formatting_pipeline&) = delete;
+    formatting_pipeline& operator=(const formatting_pipeline&) = delete;
 
-#if LONG_MAX < LLONG_MAX
-        case ctu::log2(sizeof(long)):
-            if (msg->attributes.is_unsigned) {
-                unsigned long val;
-                memcpy(&val, msg->msg, sizeof(val));
-                log_integral_value(std::cout, msg->attributes, val);
-            } else {
-                signed long val;
-                memcpy(&val, msg->msg, sizeof(val));
-                log_integral_value(std::cout, msg->attributes, val);
+    // The batch lines are copied into until the next submit().
+    line_batch& batch() {
+        return *_batches[_submitted % _batches.size()];
+    }
+
+    // Waits while every batch is in flight, the sink is too slow for the
+    // rate lines come in at.
+    void submit() {
+        if (batch().entries.empty())
+            return;
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _submitted += 1;
+        _submitted_changed.notify_one();
+        _emitted_changed.wait(lock, [this] {
+            return _submitted < _emitted + _batches.size();
+        });
+    }
+
+    // Writes everything submitted before returning, or drops what was not
+    // written yet if drain is false.
+    void stop(bool drain) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_stopping)
+                return;
+
+            if (drain && batch().entries.empty() == false) {
+                _submitted += 1;
             }
-            break;
-#endif
+            _stopping = true;
+            _drain = drain;
+        }
+        _submitted_changed.notify_all();
+        _formatted_changed.notify_all();
 
-        case ctu::log2(sizeof(long long)):
-            if (msg->attributes.is_unsigned) {
-                unsigned long long val;
-                memcpy(&val, msg->msg, sizeof(val));
-                log_integral_value(std::cout, msg->attributes, val);
-            } else {
-                signed long long val;
-                memcpy(&val, msg->msg, sizeof(val));
-                log_integral_value(std::cout, msg->attributes, val);
+        for (auto& thread : _formatters) {
+            thread.join();
+        }
+        _emitter.join();
+    }
+
+private:
+    void format_batches() {
+        timestamp_cache cached_timestamp;
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (;;) {
+            _submitted_changed.wait(lock, [this] {
+                return _next_task < _submitted || _stopping;
+            });
+            if (_next_task == _submitted || _drain == false)
+                return;
+
+            size_t slot = _next_task % _batches.size();
+            _next_task += 1;
+
+            lock.unlock();
+            format_batch(*_batches[slot], _wall_clock_time, cached_timestamp);
+            lock.lock();
+
+            _formatted[slot] = 1;
+            _formatted_changed.notify_all();
+        }
+    }
+
+    void emit_batches() {
+        bool written = false;
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (;;) {
+            size_t slot = _emitted % _batches.size();
+            if (_formatted[slot] == 0) {
+                // caught up with the formatter threads
+                if (written) {
+                    lock.unlock();
+                    _out.flush();
+                    lock.lock();
+                    written = false;
+                }
+
+                _formatted_changed.wait(lock, [this, slot] {
+                    return _formatted[slot] != 0 || (_stopping && (_emitted == _submitted || _drain == false));
+                });
+                if (_formatted[slot] == 0 || _drain == false)
+                    return;
             }
-            break;
+
+            lock.unlock();
+            line_batch& batch = *_batches[slot];
+            _out.write(batch.text.data(), batch.text.size());
+            batch.clear();
+            written = true;
+            lock.lock();
+
+            _formatted[slot] = 0;
+            _emitted += 1;
+            _emitted_changed.notify_one();
+        }
     }
 
-    msg->~integer_data();
-    return sizeof(integer_data);
+    output_buffer& _out;
+    bool _wall_clock_time;
+
+    std::mutex _mutex;
+    std::condition_variable _submitted_changed;
+    std::condition_variable _formatted_changed;
+    std::condition_variable _emitted_changed;
+
+    // ring of batches, indexed by the number of batches submitted before
+    std::vector<std::unique_ptr<line_batch>> _batches;
+    std::vector<u8> _formatted;
+    size_t _submitted = 0;
+    size_t _next_task = 0;
+    size_t _emitted = 0;
+    bool _stopping = false;
+    bool _drain = true;
+
+    std::vector<std::thread> _formatters;
+    std::thread _emitter;
+};
+
+template<size_t length>
+static callsite_segment literal_segment(const char (&text)[length]) {
+    return callsite_segment(text, length - 1);
 }
 
-size_t log_float(const float_data* msg) {
-    switch (msg->attributes.length_log2) {
-#if FLT_MANT_DIG < DBL_MANT_DIG
-        case ctu::log2(sizeof(float)):
-        {
-            float val;
-            memcpy(&val, msg->msg, sizeof(val));
-            log_float_value(std::cout, msg->attributes, val);
+// Written by the logging thread on behalf of a thread that dropped lines.
+// Goes through the same formatting as every other line, so it shows up in
+// binary output as well.
+static const callsite_segment DROP_REPORT_SEGMENTS[] = {
+    callsite_segment(segment_kind::integer, log_integer),
+    literal_segment(" lines dropped from thread "),
+    callsite_segment(segment_kind::integer, log_integer),
+    literal_segment(" between "),
+    callsite_segment(segment_kind::floating_point, log_float),
+    literal_segment(" and "),
+    callsite_segment(segment_kind::floating_point, log_float)
+};
+
+static const callsite DROP_REPORT_SITE{
+    level::warning,
+    u32(__LINE__),
+    __FILE__,
+    DROP_REPORT_SEGMENTS,
+    std::size(DROP_REPORT_SEGMENTS)
+};
+
+// Frame the lines of a recorder dump. The dump is written by the logging
+// thread as well, so it shows up in binary output just the same.
+static const callsite_segment RECORDER_DUMP_START_SEGMENTS[] = {
+    literal_segment("flight recorder: "),
+    callsite_segment(segment_kind::integer, log_integer),
+    literal_segment(" lines recorded since the last dump follow")
+};
+
+static const callsite RECORDER_DUMP_START_SITE{
+    level::info,
+    u32(__LINE__),
+    __FILE__,
+    RECORDER_DUMP_START_SEGMENTS,
+    std::size(RECORDER_DUMP_START_SEGMENTS)
+};
+
+static const callsite_segment RECORDER_DUMP_END_SEGMENTS[] = {
+    literal_segment("flight recorder: end of dump")
+};
+
+static const callsite RECORDER_DUMP_END_SITE{
+    level::info,
+    u32(__LINE__),
+    __FILE__,
+    RECORDER_DUMP_END_SEGMENTS,
+    std::size(RECORDER_DUMP_END_SEGMENTS)
+};
+
+// storage for a line of RECORDER_DUMP_START_SITE
+struct recorder_dump_line {
+    line_start_data start;
+    integer_data count;
+};
+
+// storage for a line of DROP_REPORT_SITE
+struct drop_report_line {
+    line_start_data start;
+    integer_data count;
+    integer_data thread_id;
+    float_data first;
+    float_data last;
+};
+
+// segments are read back to back, like from a thread buffer
+static_assert(sizeof(drop_report_line) == sizeof(line_start_data) + 2 * sizeof(integer_data) + 2 * sizeof(float_data));
+
+module::module(const char* name) :
+    threshold(u8(level::debug)),
+    name(name)
+{
+    std::lock_guard<std::mutex> lock(module_mutex());
+    threshold.store(global_threshold.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    next = modules;
+    modules = this;
+}
+
+module::~module() {
+    std::lock_guard<std::mutex> lock(module_mutex());
+    for (module** link = &modules; *link != nullptr; link = &(*link)->next) {
+        if (*link == this) {
+            *link = next;
             break;
         }
-#endif
+    }
+}
 
-#if DBL_MANT_DIG < LDBL_MANT_DIG
-        case ctu::log2(sizeof(double)):
-        {
-            double val;
-            memcpy(&val, msg->msg, sizeof(val));
-            log_float_value(std::cout, msg->attributes, val);
-            break;
+void set_level(level threshold) {
+    std::lock_guard<std::mutex> lock(module_mutex());
+    global_threshold.store(u8(threshold), std::memory_order_relaxed);
+    for (module* mod = modules; mod != nullptr; mod = mod->next) {
+        if (mod->follows_global) {
+            mod->threshold.store(u8(threshold), std::memory_order_relaxed);
         }
-#endif
+    }
+}
 
-        case ctu::log2(sizeof(long double)):
-        {
-            long double val;
-            memcpy(&val, msg->msg, sizeof(val));
-            log_float_value(std::cout, msg->attributes, val);
-            break;
+level get_level() {
+    return level(global_threshold.load(std::memory_order_relaxed));
+}
+
+// Applies to every translation unit that declared the module, returns false
+// if there is none.
+bool set_module_level(const char* name, level threshold) {
+    std::lock_guard<std::mutex> lock(module_mutex());
+    bool found = false;
+    for (module* mod = modules; mod != nullptr; mod = mod->next) {
+        if (strcmp(mod->name, name) == 0) {
+            mod->follows_global = false;
+            mod->threshold.store(u8(threshold), std::memory_order_relaxed);
+            found = true;
         }
     }
+    return found;
+}
 
-    msg->~float_data();
-    return sizeof(float_data);
+// Makes the module follow the global level again.
+bool reset_module_level(const char* name) {
+    std::lock_guard<std::mutex> lock(module_mutex());
+    bool found = false;
+    for (module* mod = modules; mod != nullptr; mod = mod->next) {
+        if (strcmp(mod->name, name) == 0) {
+            mod->follows_global = true;
+            mod->threshold.store(global_threshold.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            found = true;
+        }
+    }
+    return found;
+}
+
+// Turns the flight recorder on. Lines below the level of their module but at
+// or above threshold are recorded into a ring per thread, unformatted, and
+// only written when the recorders are dumped. level::off turns it off again.
+// Log statements below BELOG_MIN_LEVEL are not compiled in and can't be
+// recorded, which includes debug lines in release builds unless they define
+// BELOG_MIN_LEVEL=0.
+void set_recorder_level(level threshold) {
+    recorder_threshold.store(u8(threshold), std::memory_order_relaxed);
 }
 
-size_t log_std_string(const std_string_data* msg) {
-    std::cout << msg->string;
-    msg->~std_string_data();
-    return sizeof(std_string_data);
+// Makes lines at or above threshold wait up to timeout_us for the logging
+// thread when the buffer of their thread is full, rather than being dropped
+// right away. They spin for a bit and then park until the logging thread
+// took lines out of buffers. Lines only start to wait once they did not fit,
+// so lines that fit cost the same as before. Strings are part of the line,
+// they wait along with it. Only strings longer than BELOG_STRING_MAX are
+// still left out. level::off, the default, never waits.
+void set_blocking_level(level threshold, u32 timeout_us) {
+    blocking_timeout_us.store(timeout_us, std::memory_order_relaxed);
+    blocking_threshold.store(u8(threshold), std::memory_order_relaxed);
 }
 
-size_t log_string_literal(const string_literal_data* msg) {
-    if (msg->length == msg->UNKNOWN_LENGTH) {
-        std::cout.write(msg->address, std::strlen(msg->address));
-    } else {
-        std::cout.write(msg->address, msg->length - 1);
+// Lines at or above threshold dump the recorders right before they are
+// written, level::off only dumps on request. Only read when the logging
+// thread starts.
+void set_recorder_trigger(level threshold) {
+    recorder_trigger.store(u8(threshold), std::memory_order_relaxed);
+}
+
+// Makes the logging thread dump the recorders. Only touches atomics and
+// wakes the logging thread, so it can be called from a signal handler.
+void request_recorder_dump() {
+    recorder_dump_requested.store(true, std::memory_order_seq_cst);
+    detail::_wake_consumer();
+}
+
+// Waits until a producer publishes a line. The logging thread sets
+// _consumer_parked and then looks at the buffers. A producer whose line went
+// into an empty buffer publishes it and then looks at _consumer_parked. Both
+// have a full fence in between, so at least one of them sees what the other
+// did. Producers whose buffer still held lines skip the fence. The logging
+// thread has to take those lines out first and find the buffer empty for a
+// whole spin budget before it parks, and it wakes up after PARK_TIMEOUT_MS
+// should it still miss the new line. Producers wake every parked logging
+// thread, not just the one draining their buffer.
+static void park(u32 shard, const std::vector<thread_buffer_node*>& buffers) {
+    parked_consumers.fetch_add(1, std::memory_order_relaxed);
+    detail::_consumer_parked.store(1, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    bool idle = shards[shard].registered.load(std::memory_order_seq_cst) == nullptr
+        && shutdowns_seen.load(std::memory_order_seq_cst) == 0
+        && recorder_dump_requested.load(std::memory_order_seq_cst) == false
+        && emergency_shutdown_requested.load(std::memory_order_seq_cst) == false;
+    for (thread_buffer_node* node : buffers) {
+        idle = idle && current_buffer(node).is_empty();
+    }
+
+    if (idle) {
+        wait_while_parked(detail::_consumer_parked, PARK_TIMEOUT_MS);
     }
-    msg->~string_literal_data();
-    return sizeof(string_literal_data);
+
+    if (parked_consumers.fetch_sub(1, std::memory_order_relaxed) == 1) {
+        detail::_consumer_parked.store(0, std::memory_order_relaxed);
+    }
+}
+
+void set_sink(log_sink* sink) {
+    shards[0].sink.store(sink, std::memory_order_release);
+}
+
+// Binary output has to go to a sink of its own, readers expect the file to
+// start with the file header.
+void set_format(output_format fmt) {
+    format.store(fmt, std::memory_order_release);
 }
 
-size_t log_segment(const void* data) {
-    const segment_data* s = static_cast<const segment_data*>(data);
-    return s->log_func(s);
+// Only used for binary output. Receives the time index of the log file.
+void set_index_sink(log_sink* sink) {
+    shards[0].index_sink.store(sink, std::memory_order_release);
+}
+
+// Spreads the buffers of threads over count shards, each drained by a logging
+// thread running do_logging_shard() and written to a sink of its own, see
+// set_shard_sink(). Threads are assigned to shards by thread id, and a logging
+// thread that falls behind hands buffers to the shard with the least backlog.
+// Lines are only in order within a shard. Read when threads enable logging
+// and when the logging thread of shard 0 starts, which takes over buffers of
+// shards beyond count.
+void set_shard_count(u32 count) {
+    shard_count.store(std::clamp(count, u32(1), MAX_SHARDS), std::memory_order_relaxed);
+}
+
+// Shard 0 uses the sinks given to set_sink() and set_index_sink(). Shards
+// without a sink write to stdout, where lines of different shards can end up
+// interleaved. Like the sink, only read when the logging thread starts.
+bool set_shard_sink(u32 shard, log_sink* sink, log_sink* index_sink) {
+    if (shard >= MAX_SHARDS)
+        return false;
+
+    shards[shard].sink.store(sink, std::memory_order_release);
+    shards[shard].index_sink.store(index_sink, std::memory_order_release);
+    return true;
+}
+
+// Number of passes over all buffers the logging thread makes without finding
+// a line before it parks until a producer wakes it up. Only read when the
+// logging thread starts.
+void set_spin_budget(u32 passes) {
+    spin_budget.store(passes, std::memory_order_relaxed);
+}
+
+// Like the sink, only read when the logging thread starts.
+void set_output_order(output_order ord, u32 window_us) {
+    reorder_window_us.store(window_us, std::memory_order_relaxed);
+    order.store(ord, std::memory_order_release);
+}
+
+// Like the sink, only read when the logging thread starts.
+void set_time_format(time_format fmt) {
+    timestamps.store(fmt, std::memory_order_release);
+}
+
+// Formats text output on count threads per logging thread, which then only
+// copies lines out of the thread buffers. Another thread writes the formatted
+// lines to the sink, in the order the logging thread took them. formatter<>
+// specializations can be called on several threads at once. 0 formats on
+// the logging thread, binary output is always written there. Like the sink,
+// only read when the logging thread starts.
+void set_formatter_threads(u32 count) {
+    formatter_threads.store(std::min(count, MAX_FORMATTER_THREADS), std::memory_order_relaxed);
 }
 
 void do_logging() {
+    do_logging_shard(0);
+}
+
+// Drains the buffers of shard until shutdown() is called by any thread, or
+// emergency_shutdown(). Logging threads of the other shards have to be
+// running by the time shutdown() is called.
+void do_logging_shard(u32 shard) {
+    if (shard >= MAX_SHARDS)
+        return;
+
     threads::current::assign_id();
 
+    consumers_running.fetch_add(1, std::memory_order_relaxed);
+    shards[shard].running.store(true, std::memory_order_relaxed);
+    own_shard = shard;
+    scope_guard stopped([shard] {
+        own_shard = NO_SHARD;
+        shards[shard].running.store(false, std::memory_order_release);
+        if (consumers_running.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            shutdowns_seen.store(0, std::memory_order_relaxed);
+        }
+    });
+
+    if (shard == 0) {
+        rehome_orphaned_buffers();
+    }
+    // from now on other logging threads may hand buffers to this one
+    shards[shard].backlog.store(0, std::memory_order_relaxed);
+
+    // stdout is only looked up now, the application may have redirected it
+    // after static initialization.
+    std::unique_ptr<fd_sink> stdout_sink;
+    log_sink* sink = shards[shard].sink.load(std::memory_order_acquire);
+    if (sink == nullptr) {
+        stdout_sink = std::make_unique<fd_sink>(stdout_fd());
+        sink = stdout_sink.get();
+    }
+    output_buffer out(*sink);
+
+    // Buffers outlive the logging thread, they are handed back to the
+    // registry for the next call to do_logging() to pick them up.
+    std::vector<thread_buffer_node*> buffers;
+    scope_guard return_buffers([&buffers] {
+        for (thread_buffer_node* node : buffers) {
+            register_buffer(node);
+        }
+    });
+
     f64 tsc_freq_inverse = 1.0 / f64(tsc_frequency());
     auto start_time = tsc();
 
+    bool wall_clock_time = timestamps.load(std::memory_order_acquire) == time_format::wall_clock;
+    tsc_wall_clock clock;
+    timestamp_cache cached_timestamp;
+    auto calibration_interval = tsc_frequency() / CALIBRATIONS_PER_SECOND;
+    auto last_calibration = start_time;
+
+    // declared after out, so the writer hands its last block to out before
+    // out is destroyed
+    std::unique_ptr<output_buffer> index_out;
+    std::unique_ptr<binary_log_writer> binary;
+    if (format.load(std::memory_order_acquire) == output_format::binary) {
+        if (log_sink* idx = shards[shard].index_sink.load(std::memory_order_acquire)) {
+            index_out = std::make_unique<output_buffer>(*idx);
+        }
+        binary = std::make_unique<binary_log_writer>(out, index_out.get(), start_time);
+        binary->write_clock(clock);
+    }
+
+    // declared after out as well, its threads are done with out once it is
+    // destroyed
+    std::unique_ptr<formatting_pipeline> pipeline;
+    if (u32 count = formatter_threads.load(std::memory_order_relaxed); count > 0 && binary == nullptr) {
+        pipeline = std::make_unique<formatting_pipeline>(out, count, wall_clock_time);
+    }
+    auto flush_interval = tsc_frequency() / FLUSH_INTERVALS_PER_SECOND;
+    auto last_flush = start_time;
+    auto shrink_timeout = tsc_frequency() * SHRINK_IDLE_SECONDS;
+
     bool shutdown_requested = false;
 
+    auto write_line = [&](u32 id, const line_start_data* line) {
+        const char* segments = reinterpret_cast<const char*>(line) + sizeof(line_start_data);
+        if (binary) {
+            binary->write_line(id, line, segments);
+        } else if (pipeline) {
+            line_batch::entry entry{};
+            entry.thread_id = id;
+            if (wall_clock_time) {
+                entry.wall_clock = clock.nanoseconds(line->timepoint);
+            } else {
+                entry.seconds = f64(i64(line->timepoint - start_time)) * tsc_freq_inverse;
+            }
+
+            line_batch& batch = pipeline->batch();
+            copy_line(batch, entry, line);
+            if (batch.size() >= BATCH_SIZE) {
+                pipeline->submit();
+            }
+        } else {
+            const callsite* site = line->site;
+            if (wall_clock_time) {
+                format_line_header(out, cached_timestamp, id, clock.nanoseconds(line->timepoint), site->severity, site->file, site->line);
+            } else {
+                f64 seconds = f64(i64(line->timepoint - start_time)) * tsc_freq_inverse;
+                format_line_header(out, id, seconds, site->severity, site->file, site->line);
+            }
+            log_segments(out, line, segments);
+        }
+        line->~line_start_data();
+    };
+
+    // Writes the lines all threads recorded since the last dump, oldest
+    // first. Logging threads of other shards share the positions of the
+    // last dump, only one of them dumps at a time.
+    auto dump_recorders = [&] {
+        std::lock_guard<std::mutex> lock(recorder_mutex);
+
+        struct recorded_line {
+            u64 timepoint;
+            u32 thread_id;
+            const line_start_data* line;
+        };
+        std::vector<recorded_line> lines;
+        std::vector<std::unique_ptr<std::byte[]>> snapshots;
+
+        thread_buffer_node* node = allocated_buffers.load(std::memory_order_acquire);
+        for (; node != nullptr; node = node->next_allocated) {
+            const recorder_t* recorder = node->recorder.load(std::memory_order_acquire);
+            if (recorder == nullptr)
+                continue;
+
+            u32 id = node->thread_id;
+            snapshots.push_back(std::make_unique<std::byte[]>(recorder_t::size));
+            node->recorder_dumped_until = recorder->snapshot(snapshots.back().get(), node->recorder_dumped_until, [&](const void* storage, ptrdiff_t /*length*/) {
+                auto line = static_cast<const line_start_data*>(storage);
+                lines.push_back(recorded_line{ line->timepoint, id, line });
+            });
+        }
+
+        if (lines.empty())
+            return;
+
+        std::stable_sort(lines.begin(), lines.end(), [](const recorded_line& a, const recorded_line& b) {
+            return a.timepoint < b.timepoint;
+        });
+
+        u32 own_id = threads::current::id();
+        recorder_dump_line start{
+            line_start_data(tsc(), &RECORDER_DUMP_START_SITE),
+            integer_data(u64(lines.size()))
+        };
+        write_line(own_id, &start.start);
+        for (const recorded_line& recorded : lines) {
+            write_line(recorded.thread_id, recorded.line);
+        }
+        line_start_data end(tsc(), &RECORDER_DUMP_END_SITE);
+        write_line(own_id, &end);
+    };
+
+    u8 trigger = recorder_trigger.load(std::memory_order_relaxed);
+
+    auto handle_line = [&](u32 id, const void* storage) {
+        const line_start_data* line = static_cast<const line_start_data*>(storage);
+
+        if (line->timepoint == SHUTDOWN_SENTINEL_VALUE) {
+            shutdown_requested = true;
+            shutdowns_seen.fetch_add(1, std::memory_order_seq_cst);
+            detail::_wake_consumer();
+            line->~line_start_data();
+            return true;
+        }
+
+        if (u8(line->site->severity) >= trigger && recorder_threshold.load(std::memory_order_relaxed) != u8(level::off)) {
+            dump_recorders();
+        }
+        write_line(id, line);
+        return true;
+    };
+
+    // Writes a line for drops the thread of node made since the last report.
+    // Drops are reported in between lines of other threads, in ordered mode
+    // the report can precede lines that are older than its last drop.
+    auto report_drops = [&](thread_buffer_node* node) {
+        u64 dropped = node->dropped.load(std::memory_order_acquire);
+        u64 reported = node->reported.load(std::memory_order_relaxed);
+        if (dropped == reported)
+            return;
+
+        // A run of drops starting while the last report was written may
+        // still carry the time of the run before.
+        u64 first = std::max(node->first_drop.load(std::memory_order_relaxed), node->reported_until);
+        u64 last = std::max(node->last_drop.load(std::memory_order_relaxed), first);
+
+        // in the time format of the line headers, seconds since 1970 for
+        // wall clock time
+        auto report_time = [&](u64 timepoint) {
+            if (wall_clock_time)
+                return f64(clock.nanoseconds(timepoint)) * 1e-9;
+
+            return f64(i64(timepoint - start_time)) * tsc_freq_inverse;
+        };
+        float_data first_seconds(report_time(first));
+        float_data last_seconds(report_time(last));
+        first_seconds.attributes.precision = 6;
+        last_seconds.attributes.precision = 6;
+
+        drop_report_line report{
+            line_start_data(last, &DROP_REPORT_SITE),
+            integer_data(dropped - reported),
+            integer_data(node->thread_id),
+            first_seconds,
+            last_seconds
+        };
+        handle_line(node->thread_id, &report);
+
+        node->reported.store(dropped, std::memory_order_relaxed);
+        node->reported_until = last;
+
+        u64 count = dropped - reported;
+        total_dropped.fetch_add(count, std::memory_order_relaxed);
+        drop_reports.fetch_add(1, std::memory_order_relaxed);
+        u64 largest = largest_drop_report.load(std::memory_order_relaxed);
+        while (count > largest && largest_drop_report.compare_exchange_weak(largest, count, std::memory_order_relaxed) == false) {
+        }
+    };
+
+    // Publishes the backlog of this shard, and hands a buffer to the shard
+    // with the least backlog if this one is too far behind. The buffer moved
+    // is the largest one that leaves this shard with no less backlog than the
+    // other one.
+    auto rebalance = [&] {
+        u64 backlog = 0;
+        for (thread_buffer_node* node : buffers) {
+            backlog += current_buffer(node).used();
+        }
+        shards[shard].backlog.store(backlog, std::memory_order_relaxed);
+
+        u32 count = shard_count.load(std::memory_order_relaxed);
+        if (buffers.size() < 2 || count < 2 || shard >= count)
+            return;
+
+        u32 lightest = shard;
+        u64 lightest_backlog = backlog;
+        for (u32 other = 0; other < count; other += 1) {
+            u64 other_backlog = shards[other].backlog.load(std::memory_order_relaxed);
+            if (other_backlog < lightest_backlog) {
+                lightest = other;
+                lightest_backlog = other_backlog;
+            }
+        }
+        if (backlog - lightest_backlog < REBALANCE_THRESHOLD)
+            return;
+
+        size_t moved = buffers.size();
+        u64 moved_backlog = 0;
+        for (size_t idx = 0; idx < buffers.size(); idx += 1) {
+            u64 used = current_buffer(buffers[idx]).used();
+            if (used > moved_backlog && used <= (backlog - lightest_backlog) / 2) {
+                moved = idx;
+                moved_backlog = used;
+            }
+        }
+        if (moved == buffers.size())
+            return;
+
+        thread_buffer_node* node = buffers[moved];
+        buffers.erase(buffers.begin() + moved);
+        node->shard = lightest;
+        register_buffer(node);
+        detail::_wake_consumer();
+
+        // The logging thread of lightest may have stopped before it could
+        // see the buffer, this thread takes over what it left behind.
+        if (shards[lightest].backlog.load(std::memory_order_seq_cst) == STOPPED_BACKLOG) {
+            size_t first = buffers.size();
+            adopt_registered_buffers(lightest, buffers);
+            for (size_t idx = first; idx < buffers.size(); idx += 1) {
+                buffers[idx]->shard = shard;
+            }
+        }
+    };
+
+    u32 spin_counter = 0;
+    u32 spin_counter_max = spin_budget.load(std::memory_order_relaxed);
+
+    bool ordered = order.load(std::memory_order_acquire) == output_order::timestamp;
+    u64 reorder_window = tsc_frequency() / 1000000 * reorder_window_us.load(std::memory_order_relaxed);
+
+    // oldest line of every buffer, min-heap by timepoint
+    struct buffer_head {
+        u64 timepoint;
+        size_t idx;
+
+        bool operator<(const buffer_head& other) const {
+            return timepoint > other.timepoint;
+        }
+    };
+    std::vector<buffer_head> heads;
+
+    // Looks at the oldest line of a buffer. Shutdown requests are handled
+    // right away, they do not have a meaningful timestamp.
+    auto peek = [&](thread_buffer_node* node, u64& timepoint) {
+        for (;;) {
+            bool found = current_buffer(node).peek([&](const void* storage, size_t /*length*/) {
+                timepoint = static_cast<const line_start_data*>(storage)->timepoint;
+            });
+            if (found == false)
+                return false;
+            if (timepoint != SHUTDOWN_SENTINEL_VALUE)
+                return true;
+
+            current_buffer(node).consume([&](const void* storage, size_t /*length*/) {
+                return handle_line(node->thread_id, storage);
+            });
+        }
+    };
+
     for (;;) {
         bool all_threads_empty = true;
 
-        u32 max_id = threads::max_assigned_id();
-        for (u32 id = 0; id < max_id; id += 1) {
-            if (emergency_shutdown_requested.load(std::memory_order_relaxed))
-                return;
-            
-            auto tbuf = thread_buffer[id].load(std::memory_order_relaxed);
-            if (tbuf == nullptr)
-                continue;
+        adopt_registered_buffers(shard, buffers);
+        if (shutdowns_seen.load(std::memory_order_relaxed) != 0) {
+            shutdown_requested = true;
+        }
+        if (recorder_dump_requested.load(std::memory_order_relaxed)
+            && recorder_dump_requested.exchange(false, std::memory_order_acquire)) {
+            dump_recorders();
+        }
+
+        if (ordered) {
+            // Lines stamped before the horizon are assumed to be visible by
+            // now, newer ones wait for the next pass.
+            u64 now = tsc();
+            u64 horizon = now > reorder_window ? now - reorder_window : 0;
+            if (shutdown_requested) {
+                horizon = ~u64(0);
+            }
+
+            heads.clear();
+            for (size_t idx = 0; idx < buffers.size();) {
+                if (emergency_shutdown_requested.load(std::memory_order_relaxed))
+                    return;
+
+                thread_buffer_node* node = buffers[idx];
+                bool retired = node->retired.load(std::memory_order_acquire);
+
+                u64 timepoint;
+                if (peek(node, timepoint)) {
+                    all_threads_empty = false;
+                    heads.push_back(buffer_head{ timepoint, idx });
+                } else if (retired) {
+                    report_drops(node);
+                    buffers.erase(buffers.begin() + idx);
+                    release_buffer(node);
+                    continue;
+                }
+
+                idx += 1;
+            }
+
+            std::make_heap(heads.begin(), heads.end());
+            while (heads.empty() == false && heads.front().timepoint <= horizon) {
+                if (emergency_shutdown_requested.load(std::memory_order_relaxed))
+                    return;
+
+                std::pop_heap(heads.begin(), heads.end());
+                buffer_head& head = heads.back();
+                thread_buffer_node* node = buffers[head.idx];
 
-            auto consumed = tbuf->consume([&](const void* storage, size_t length) {
-                const line_start_data* line = static_cast<const line_start_data*>(storage);
+                current_buffer(node).consume([&](const void* storage, size_t /*length*/) {
+                    return handle_line(node->thread_id, storage);
+                });
 
-                if (line->timepoint == SHUTDOWN_SENTINEL_VALUE) {
-                    shutdown_requested = true;
-                    line->~line_start_data();
+                if (peek(node, head.timepoint)) {
+                    std::push_heap(heads.begin(), heads.end());
                 } else {
-                    size_t line_length = length - sizeof(line_start_data);
-                    //std::cout << "\n[" << id << "] " << ((line->timepoint - start_time) * tsc_freq_inverse) << ": ";
-                    printf("\n[%u] %13.6f: ", id, ((line->timepoint - start_time) * tsc_freq_inverse));
+                    heads.pop_back();
+                }
+            }
+        } else {
+            for (size_t idx = 0; idx < buffers.size();) {
+                if (emergency_shutdown_requested.load(std::memory_order_relaxed))
+                    return;
+
+                thread_buffer_node* node = buffers[idx];
+                u32 id = node->thread_id;
 
-                    line->~line_start_data();
+                // Everything the thread wrote before it exited is visible once
+                // retired is, so a retired buffer found empty stays empty.
+                bool retired = node->retired.load(std::memory_order_acquire);
 
-                    const char* elem = static_cast<const char*>(storage) + sizeof(line_start_data);
-                    size_t offset = 0;
-                    while (offset < line_length) {
-                        offset += log_segment(elem + offset);
-                    }
+                size_t consumed = current_buffer(node).consume_n(node->quota, [&](const void* storage, size_t /*length*/) {
+                    return handle_line(id, storage);
+                });
+
+                if (consumed == node->quota) {
+                    node->quota = std::min(node->quota * 2, MAX_BATCH_QUOTA);
+                } else if (consumed < node->quota / 4) {
+                    node->quota = std::max(node->quota / 2, MIN_BATCH_QUOTA);
                 }
 
-                return true;
-            });
+                if (consumed > 0) {
+                    all_threads_empty = false;
+                } else if (retired) {
+                    report_drops(node);
+                    buffers.erase(buffers.begin() + idx);
+                    release_buffer(node);
+                    continue;
+                }
 
-            if (consumed) {
-                all_threads_empty = false;
+                idx += 1;
             }
         }
 
-        enum class back_off_state {
-            spin,
-            sleep
-        };
+        if (all_threads_empty == false && producers_waiting.load(std::memory_order_relaxed) != 0
+            && producers_waiting.exchange(0, std::memory_order_relaxed) != 0) {
+            wake_parked(producers_waiting);
+        }
 
-        static back_off_state state = back_off_state::spin;
-        static i32 spin_counter = 0;
-        static constexpr i32 spin_counter_max = 2000;
+        u64 now = tsc();
+        if (all_threads_empty || now - last_flush >= flush_interval) {
+            for (thread_buffer_node* node : buffers) {
+                report_drops(node);
+                shrink_idle_buffer(node, now, shrink_timeout);
+            }
+            if (binary) {
+                binary->flush();
+            }
+            if (index_out) {
+                index_out->flush();
+            }
+            if (pipeline) {
+                pipeline->submit();
+            } else {
+                out.flush();
+            }
+            rebalance();
+            last_flush = tsc();
+
+            if (last_flush - last_calibration >= calibration_interval) {
+                clock.calibrate();
+                last_calibration = last_flush;
+                if (binary) {
+                    binary->write_clock(clock);
+                }
+            }
+        }
 
         if (all_threads_empty) {
-            if (shutdown_requested)
+            if (shutdown_requested && leave_shard(shard))
                 break;
 
-            using namespace std::chrono_literals;
-            switch (state) {
-                case back_off_state::spin:
-                    spin_counter += 1;
-                    if (spin_counter >= spin_counter_max) {
-                        state = back_off_state::sleep;
-                    }
-                    break;
-
-                case back_off_state::sleep:
-                    std::this_thread::sleep_for(100ms);
-                    break;
+            spin_counter += 1;
+            if (spin_counter >= spin_counter_max) {
+                park(shard, buffers);
+                spin_counter = 0;
             }
         } else {
             spin_counter = 0;
-            state = back_off_state::spin;
         }
     }
 }
 
 bool shutdown() {
-    auto tbuf = thread_buffer[threads::current::id()].load(std::memory_order_relaxed);
+    auto tbuf = detail::_thread_buffer;
+    if (tbuf == nullptr)
+        return false;
 
-    return tbuf->produce(sizeof(line_start_data), [](void* storage) {
-        new(storage) line_start_data(SHUTDOWN_SENTINEL_VALUE);
+    auto write = [](void* storage) {
+        new(storage) line_start_data(SHUTDOWN_SENTINEL_VALUE, nullptr);
         return true;
-    });
+    };
+
+    bool result = tbuf->produce(sizeof(line_start_data), write);
+    if (result == false) {
+        tbuf = detail::_switch_buffer(tbuf, sizeof(line_start_data));
+        result = tbuf != nullptr && tbuf->produce(sizeof(line_start_data), write);
+    }
+
+    detail::_wake_consumer();
+    return result;
 }
 
 void emergency_shutdown() {
     emergency_shutdown_requested = true;
+    detail::_wake_consumer();
+}
+
+// crash_dump() formats into this, a crashed process cannot allocate
+alignas(64) static char crash_text[size_t(1) << 16];
+
+struct crash_sink : log_sink {
+    int fd;
+
+    explicit crash_sink(int fd) :
+        fd(fd) {}
+
+    char* acquire(size_t min_capacity, size_t& capacity) override {
+        if (min_capacity > sizeof(crash_text))
+            return nullptr;
+
+        capacity = sizeof(crash_text);
+        return crash_text;
+    }
+
+    bool commit(char* region, size_t length) override {
+        return write_fully(fd, region, length);
+    }
+};
+
+// Logging threads are given this long to stop before crash_dump() takes the
+// buffers over anyway, one of them may be the thread that crashed.
+static constexpr u64 CRASH_STOP_TIMEOUTS_PER_SECOND = 10;
+
+// Stops the logging threads and writes the lines still waiting in the buffers
+// of all threads to fd, as text. Buffers of logging threads that do not stop
+// in time are left out, unless the crash happened on that logging thread.
+// Allocates nothing and only uses write(2),
+// so it can be called from a signal handler. Floats with a precision or of
+// type long double go through snprintf, and formatters of user-defined types
+// are called as usual. Only the first call does anything.
+void crash_dump(int fd) {
+    static std::atomic_flag dumping = ATOMIC_FLAG_INIT;
+    if (dumping.test_and_set(std::memory_order_acquire))
+        return;
+
+    emergency_shutdown();
+    u64 start = tsc();
+    u64 timeout = tsc_frequency() / CRASH_STOP_TIMEOUTS_PER_SECOND;
+    while (consumers_running.load(std::memory_order_acquire) != 0 && tsc() - start < timeout) {
+    }
+
+    // Logging threads that did not stop in time may still be taking lines out
+    // of their buffers, and free the buffers they drained. Their shards are
+    // left alone. The shard of the thread that crashed is not, its logging
+    // thread is not going to continue.
+    auto still_owned = [crashed_shard = own_shard](const thread_buffer_node* node) {
+        u32 shard = node->shard;
+        return shard != crashed_shard && shard < MAX_SHARDS && shards[shard].running.load(std::memory_order_acquire);
+    };
+    bool left_out = false;
+
+    crash_sink sink(fd);
+    output_buffer out(sink);
+    static constexpr char banner[] = "\n--- lines not written before the crash ---";
+    out.write(banner, sizeof(banner) - 1);
+
+    // Only the nominal tsc frequency is known here, lines are off by
+    // however much it is off.
+    tsc_wall_clock clock;
+    timestamp_cache cached_timestamp;
+
+    thread_buffer_node* node = allocated_buffers.load(std::memory_order_acquire);
+    for (; node != nullptr; node = node->next_allocated) {
+        if (node->in_use.load(std::memory_order_acquire) == false)
+            continue;
+
+        if (still_owned(node)) {
+            left_out = true;
+            continue;
+        }
+
+        u32 id = node->thread_id;
+        for (thread_buffer_t* buffer = node->buffer; buffer != nullptr; buffer = buffer->successor()) {
+            while (buffer->consume([&](const void* storage, size_t /*length*/) {
+                auto line = static_cast<const line_start_data*>(storage);
+                if (line->timepoint != SHUTDOWN_SENTINEL_VALUE) {
+                    const callsite* site = line->site;
+                    format_line_header(out, cached_timestamp, id, clock.nanoseconds(line->timepoint), site->severity, site->file, site->line);
+                    log_segments(out, line, static_cast<const char*>(storage) + sizeof(line_start_data));
+                }
+                return true;
+            })) {
+            }
+        }
+    }
+
+    if (left_out) {
+        static constexpr char note[] = "\n--- lines of threads whose logging thread did not stop are left out ---";
+        out.write(note, sizeof(note) - 1);
+    }
+    out.put('\n');
+    out.flush();
 }
 
+// install_crash_handler() makes a crash call crash_dump() with fd. fd has to
+// be opened up front, nothing can be opened safely once the process crashed.
+static std::atomic<int> crash_fd = -1;
+
+#if defined(_WIN32)
+
+static LONG WINAPI crash_filter(EXCEPTION_POINTERS*) {
+    crash_dump(crash_fd.load(std::memory_order_relaxed));
+    return EXCEPTION_CONTINUE_SEARCH;
+}
+
+bool install_crash_handler(int fd) {
+    crash_fd.store(fd, std::memory_order_relaxed);
+    SetUnhandledExceptionFilter(crash_filter);
+    return true;
+}
+
+// There are no signals to send to a process on Windows.
+bool install_recorder_signal(int) {
+    return false;
+}
+
+#else
+
+static constexpr int CRASH_SIGNALS[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+
+// Dumps the buffers, then lets the signal kill the process as it would have
+// without the handler.
+static void crash_signal_handler(int signal) {
+    crash_dump(crash_fd.load(std::memory_order_relaxed));
+
+    struct sigaction action {};
+    action.sa_handler = SIG_DFL;
+    sigemptyset(&action.sa_mask);
+    sigaction(signal, &action, nullptr);
+    raise(signal);
+}
+
+bool install_crash_handler(int fd) {
+    crash_fd.store(fd, std::memory_order_relaxed);
+
+    struct sigaction action {};
+    action.sa_handler = crash_signal_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_ONSTACK;
+
+    bool result = true;
+    for (int signal : CRASH_SIGNALS) {
+        result = sigaction(signal, &action, nullptr) == 0 && result;
+    }
+    return result;
+}
+
+static void recorder_signal_handler(int) {
+    request_recorder_dump();
+}
+
+// Makes signal dump the recorders, like SIGUSR1 sent with kill(1).
+bool install_recorder_signal(int signal) {
+    struct sigaction action {};
+    action.sa_handler = recorder_signal_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    return sigaction(signal, &action, nullptr) == 0;
+}
+
+#endif
+
+drop_statistics get_drop_statistics() {
+    u64 strings_left_out = 0;
+    thread_buffer_node* node = allocated_buffers.load(std::memory_order_acquire);
+    for (; node != nullptr; node = node->next_allocated) {
+        strings_left_out += node->strings_left_out.load(std::memory_order_relaxed);
+    }
+
+    return drop_statistics{
+        total_dropped.load(std::memory_order_relaxed),
+        drop_reports.load(std::memory_order_relaxed),
+        largest_drop_report.load(std::memory_order_relaxed),
+        strings_left_out
+    };
+}
+
+// Retires the buffer of a thread when the thread exits.
+struct buffer_retirement {
+    thread_buffer_node* node = nullptr;
+
+    ~buffer_retirement() {
+        if (node == nullptr)
+            return;
+
+        detail::_thread_buffer = nullptr;
+        detail::_recorder = nullptr;
+        thread_node = nullptr;
+        node->retired.store(true, std::memory_order_release);
+    }
+};
+
 bool enable_logging() {
     threads::current::assign_id();
-    auto tid = threads::current::id();
-    if (thread_buffer[tid].load(std::memory_order_relaxed) == nullptr) {
-        void* space = aligned_alloc(thread_buffer_t::align, sizeof(thread_buffer_t));
-        if (space == nullptr) {
-            return false;
-        }
-        thread_buffer[tid].store(new(space) thread_buffer_t(), std::memory_order_relaxed);
+    if (detail::_thread_buffer != nullptr)
+        return true;
+
+    u32 id = threads::current::id();
+    thread_buffer_node* node = reuse_buffer(id);
+    if (node == nullptr) {
+        node = allocate_buffer(id);
+    }
+    if (node == nullptr) {
+        return false;
     }
+
+    node->shard = node->thread_id % shard_count.load(std::memory_order_relaxed);
+    node->quota = MIN_BATCH_QUOTA;
+
+    static thread_local buffer_retirement retirement;
+    retirement.node = node;
+
+    register_buffer(node);
+
+    detail::_thread_buffer = node->buffer;
+    thread_node = node;
     return true;
 }
 
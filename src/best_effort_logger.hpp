@@ -1,14 +1,25 @@
 #pragma once
+#include "types.hpp"
 
 // SYNOPSIS
 
 namespace belog {
-template<typename type> struct segment;
+template<typename type, typename = void> struct segment;
+template<typename type> struct formatter;
+struct log_sink;
+struct output_buffer;
+
+enum class level : u8;
+struct callsite_info;
+struct callsite;
+struct module;
 
 bool enable_logging();
 
-template<typename... types>
-static bool log(types&&... msgs);
+template<typename site_type, typename... types>
+static bool log(site_type site, types&&... msgs);
+template<typename site_type, typename... types>
+static bool record(site_type site, types&&... msgs);
 
 struct hex;
 struct padding;
@@ -19,60 +30,298 @@ template<typename msg_type, typename... fmt_types>
 static typename segment<msg_type&&>::container_type
 fmt(msg_type&& msg, fmt_types&&... fmt_attrs);
 
+enum class output_format : u8;
+enum class output_order : u8;
+enum class time_format : u8;
+struct drop_statistics;
+
+void set_level(level threshold);
+level get_level();
+bool set_module_level(const char* name, level threshold);
+bool reset_module_level(const char* name);
+void set_recorder_level(level threshold);
+void set_recorder_trigger(level threshold);
+void set_blocking_level(level threshold, u32 timeout_us = 10000);
+void request_recorder_dump();
+bool install_recorder_signal(int signal);
+
+void set_sink(log_sink* sink);
+void set_format(output_format format);
+void set_index_sink(log_sink* sink);
+void set_output_order(output_order order, u32 reorder_window_us = 1000);
+void set_time_format(time_format format);
+void set_formatter_threads(u32 count);
+void set_spin_budget(u32 passes);
+void set_shard_count(u32 count);
+bool set_shard_sink(u32 shard, log_sink* sink, log_sink* index_sink = nullptr);
 void do_logging();
+void do_logging_shard(u32 shard);
 bool shutdown();
 void emergency_shutdown();
+void crash_dump(int fd);
+bool install_crash_handler(int fd);
+drop_statistics get_drop_statistics();
 
 } // namespace belog
 
 #include <algorithm>
 #include <atomic>
+#include <cstdint>
+#include <cstring>
 #include <string>
+#include <string_view>
+#include <utility>
 
 #include "bitfield.hpp"
 #include "compile_time_utilities.hpp"
 #include "cpuid.hpp"
+#include "overwriting_ring_buffer.hpp"
 #include "spsc_ring_buffer.hpp"
+#include "threads.hpp"
 
 namespace belog {
 
+// Buffers of threads start out at the minimum size and double whenever a
+// line does not fit, up to the maximum. Once a thread stops logging for a
+// while, the logging thread makes it start over at the minimum.
+#ifndef BELOG_MIN_BUFFER_SIZE_LOG2
+#define BELOG_MIN_BUFFER_SIZE_LOG2 14
+#endif
+
 #ifndef BELOG_BUFFER_SIZE_LOG2
 #define BELOG_BUFFER_SIZE_LOG2 20
 #endif
 
-using thread_buffer_t = spsc_ring_buffer<BELOG_BUFFER_SIZE_LOG2>;
+static_assert(BELOG_MIN_BUFFER_SIZE_LOG2 <= BELOG_BUFFER_SIZE_LOG2);
+
+using thread_buffer_t = dynamic_spsc_ring_buffer<>;
+
+// Strings are copied into the line itself. The text of longer ones is left
+// out and only its length is logged, so a line always fits into a buffer of
+// the maximum size.
+#ifndef BELOG_STRING_MAX
+#define BELOG_STRING_MAX (size_t(1) << (BELOG_BUFFER_SIZE_LOG2 - 2))
+#endif
+
+// The same for lines going to the flight recorder, which is a lot smaller.
+#ifndef BELOG_RECORDED_STRING_MAX
+#define BELOG_RECORDED_STRING_MAX 256
+#endif
+
+static_assert(BELOG_RECORDED_STRING_MAX <= BELOG_STRING_MAX);
+
+// Lines below the level of their module that are still recorded, see
+// set_recorder_level(), go to a ring of this size per thread. The ring keeps
+// the most recent lines, it is only allocated once a thread records a line.
+#ifndef BELOG_RECORDER_SIZE_LOG2
+#define BELOG_RECORDER_SIZE_LOG2 16
+#endif
+
+using recorder_t = overwriting_ring_buffer<BELOG_RECORDER_SIZE_LOG2>;
 
 namespace detail {
-thread_buffer_t* _buffer_for_thread(u32 tid);
+// Set by enable_logging() and cleared when the thread exits, log() uses it
+// instead of looking up the buffer by thread id. Moves on to a new buffer
+// when the buffer grows or shrinks.
+inline thread_local thread_buffer_t* _thread_buffer = nullptr;
+inline thread_local recorder_t* _recorder = nullptr;
+// BELOG_RECORDED_STRING_MAX while record() stores a line
+inline thread_local size_t _string_max = BELOG_STRING_MAX;
+
+// Non-zero while logging threads wait for lines. Producers only look at it,
+// it is written when logging threads park and when they are woken up, so it
+// gets a cache line of its own.
+alignas(64) inline std::atomic<u32> _consumer_parked = 0;
+
+void _wake_consumer();
+
+// Replaces the buffer of the thread when it is full or the logging thread
+// sealed it, returns the new buffer or nullptr if there is none for a line of
+// length bytes. Kept out of line, it is only called once a line did not fit.
+thread_buffer_t* _switch_buffer(thread_buffer_t* buffer, size_t length);
+
+// Counts a line that did not make it into the buffer of the thread. Kept out
+// of line as well.
+void _count_drop();
+
+// Waits for the logging thread to make room for a line of length bytes if
+// severity is at or above the blocking level, see set_blocking_level().
+// Returns the buffer to try again with, or nullptr if the line is dropped.
+// deadline starts out as 0 and is kept between calls for the same line.
+thread_buffer_t* _wait_for_space(level severity, size_t length, u64& deadline);
+
+// Counts a string whose text was left out of its line, see
+// get_drop_statistics(). Kept out of line as well.
+void _count_left_out();
+
+// Sets up the recorder of the thread on the first line it records, returns
+// nullptr if the thread did not enable logging.
+recorder_t* _attach_recorder();
 }
 
-template<typename... types>
-constexpr const auto line_size = ctu::size_of<typename segment<types>::container_type...>;
+enum class level : u8 {
+    debug = 0,
+    info,
+    warning,
+    error,
+    // only used as a threshold, disables all lines
+    off
+};
 
-struct line_start_data {
-    u64 timepoint;
+// Lines below this level are dropped by the LOG_* macros before any of their
+// arguments are evaluated. Modules without a level of their own follow it.
+extern std::atomic<u8> global_threshold;
+
+// Lines below the level of their module but at or above this one are
+// recorded instead of logged, see record(). level::off unless the flight
+// recorder is used.
+extern std::atomic<u8> recorder_threshold;
+
+// A group of log statements with a runtime level of their own, see
+// BELOG_MODULE in log_utils.hpp. threshold always holds the level in effect
+// for the module, so checking it costs a single load no matter whether the
+// module overrides the global level or not.
+struct module {
+    std::atomic<u8> threshold;
+    const char* name;
+    // the following are guarded by the module registry
+    bool follows_global = true;
+    module* next = nullptr;
+
+    explicit module(const char* name);
+    ~module();
+
+    module(const module&) = delete;
+    module& operator=(const module&) = delete;
+};
+
+enum class output_format : u8 {
+    // human readable lines
+    text = 0,
+    // the format described in binary_log.hpp, turned into text by BelogDecode
+    binary
+};
+
+enum class output_order : u8 {
+    // Lines of different threads come out in whatever order the logging
+    // thread finds them in. Lines of the same thread are always in order.
+    arrival = 0,
+    // Lines of all threads are merged by timestamp. Lines are held back for
+    // the reorder window, lines showing up later than that are written as
+    // soon as they are found, out of order.
+    timestamp
+};
+
+// How text output shows the time of a line. Binary output always stores the
+// tsc() value, BelogDecode has an option of its own.
+enum class time_format : u8 {
+    // ISO-8601 in UTC with nanoseconds, from a map of tsc() to the system
+    // clock that the logging thread recalibrates about once a second
+    wall_clock = 0,
+    // seconds since the logging thread started
+    seconds
+};
+
+// Lines lost because the buffer of their thread was full. Each thread counts
+// its own, the logging thread picks the counts up whenever it flushes and
+// writes a line reporting them, so lines dropped since then are not included
+// yet.
+struct drop_statistics {
+    u64 lines;
+    // number of lines reporting drops written so far
+    u64 reports;
+    // most lines covered by a single report, a lower bound for how much
+    // larger the buffer of that thread would have to be
+    u64 largest_report;
+    // Strings whose text was left out of their line for being longer than
+    // BELOG_STRING_MAX, or BELOG_RECORDED_STRING_MAX for recorded lines.
+    // Counted right away, across all threads that ever logged.
+    u64 strings_left_out;
+};
 
-    explicit line_start_data(u64 timepoint) :
-        timepoint(timepoint) {}
+// Everything about a log statement that is known at compile time. Produced
+// by the lambda that BELOG_CALLSITE expands to, which also gives every
+// call site its own instantiation of log().
+struct callsite_info {
+    level severity;
+    const char* file;
+    u32 line;
+    // the arguments as written in the log statement, see _literal_arguments()
+    const char* arguments = nullptr;
 };
 
-struct segment_data {
-    using log_func_signature = size_t(const segment_data*);
-    log_func_signature* log_func;
+// arguments is the text of the arguments passed to log(), stringized by the
+// macro the log statement expands to.
+#define BELOG_CALLSITE(severity, arguments) \
+    [] { return ::belog::callsite_info{ (severity), __FILE__, u32(__LINE__), (arguments) }; }
+
+// Describes how the bytes of a segment are laid out, independent of the
+// function that formats them.
+enum class segment_kind : u8 {
+    literal = 0,
+    string_pointer,
+    inline_string,
+    integer,
+    floating_point,
+    // a user-defined type, formatted by its formatter
+    user_type
+};
+
+struct callsite_segment {
+    using log_func_signature = size_t(const void*, output_buffer&);
+    log_func_signature* log_func = nullptr;
+    const char* literal = nullptr;
+    size_t literal_length = 0;
+    segment_kind kind = segment_kind::literal;
+
+    callsite_segment() = default;
+
+    // constant segment, contents live in the descriptor and never enter the ring
+    explicit callsite_segment(const char* literal, size_t literal_length) :
+        log_func(nullptr),
+        literal(literal),
+        literal_length(literal_length),
+        kind(segment_kind::literal) {}
 
+    // dynamic segment, contents are stored in the ring by segment<type>::log
     template<typename R, typename A1>
-    explicit segment_data(
-        R(*log_func)(const A1*),
-        std::enable_if_t<
-            std::is_same_v<size_t, R> && std::is_base_of_v<segment_data, A1>
-        >* = nullptr
-    )
-    : log_func(reinterpret_cast<log_func_signature*>(log_func)) {}
+    explicit callsite_segment(
+        segment_kind kind,
+        R(*log_func)(const A1*, output_buffer&),
+        std::enable_if_t<std::is_same_v<size_t, R>>* = nullptr
+    ) :
+        log_func(reinterpret_cast<log_func_signature*>(log_func)),
+        literal(nullptr),
+        literal_length(0),
+        kind(kind) {}
+
+    bool is_literal() const {
+        return log_func == nullptr;
+    }
+};
+
+// One of these exists per log statement. Lines only carry a pointer to it,
+// followed by the dynamic segments in the order they appear in segments.
+struct callsite {
+    level severity;
+    u32 line;
+    const char* file;
+    const callsite_segment* segments;
+    size_t segment_count;
+};
+
+struct line_start_data {
+    u64 timepoint;
+    const callsite* site;
+
+    explicit line_start_data(u64 timepoint, const callsite* site) :
+        timepoint(timepoint),
+        site(site) {}
 };
 
 // This is the general segment template, instantiation of it should always
 // result in a static assertion error during compilation.
-template<typename type> struct segment {
+template<typename type, typename> struct segment {
     static_assert(std::is_same_v<type, void>, "unknown type for logging");
     using container_type = void;
     bool log(type, void*) {
@@ -81,6 +330,132 @@ template<typename type> struct segment {
     }
 };
 
+namespace detail {
+
+// Segments whose container_type is void are constant, they are described
+// once by the callsite and occupy no space in the ring.
+template<typename type>
+constexpr bool is_constant_segment = std::is_void_v<typename segment<type>::container_type>;
+
+// Segments whose container has a size() member take up a different amount of
+// space in every line, on top of sizeof(container_type).
+template<typename type, typename = void>
+constexpr bool is_variable_segment = false;
+
+template<typename type>
+constexpr bool is_variable_segment<type, std::void_t<decltype(&segment<type>::container_type::size)>> = true;
+
+template<typename type>
+constexpr size_t _segment_size() {
+    if constexpr (is_constant_segment<type>) {
+        return 0;
+    } else {
+        return sizeof(typename segment<type>::container_type);
+    }
+}
+
+template<typename type, typename arg_type>
+size_t _variable_size(const arg_type& msg) {
+    if constexpr (is_variable_segment<type>) {
+        return segment<type>::variable_size(msg);
+    } else {
+        return 0;
+    }
+}
+
+template<typename type, typename arg_type>
+callsite_segment _describe_segment(arg_type&& msg) {
+    if constexpr (is_constant_segment<type>) {
+        return segment<type>::describe(static_cast<arg_type&&>(msg));
+    } else {
+        using container_type = typename segment<type>::container_type;
+        return callsite_segment(container_type::kind, container_type::log_func);
+    }
+}
+
+// Adjacent constant segments are merged into one, so the logging thread
+// writes them with a single call.
+struct _callsite_layout {
+    size_t segment_count;
+    // text of all merged segments together
+    size_t merged_length;
+};
+
+template<typename type>
+constexpr size_t _literal_length() {
+    if constexpr (is_constant_segment<type>) {
+        return segment<type>::literal_length;
+    } else {
+        return 0;
+    }
+}
+
+template<typename... types>
+constexpr _callsite_layout _layout_segments() {
+    constexpr bool constant[] = { is_constant_segment<types>... };
+    constexpr size_t length[] = { _literal_length<types>()... };
+
+    _callsite_layout result{ 0, 0 };
+    for (size_t idx = 0; idx < sizeof...(types); idx += 1) {
+        if (idx == 0 || constant[idx] == false || constant[idx - 1] == false) {
+            result.segment_count += 1;
+            continue;
+        }
+
+        // the first segment of a run is copied once the second one shows up
+        if (idx == 1 || constant[idx - 2] == false) {
+            result.merged_length += length[idx - 1];
+        }
+        result.merged_length += length[idx];
+    }
+    return result;
+}
+
+// Collects the segments of a callsite in the order they are added, appending
+// the text of constant segments that follow another one to it.
+struct _segment_builder {
+    callsite_segment* segments;
+    char* merged_text;
+    size_t count = 0;
+    bool merging = false;
+
+    void add(const callsite_segment& segment);
+};
+
+template<size_t segment_count, size_t merged_length>
+struct _callsite_segments {
+    callsite_segment segments[segment_count];
+    char merged_text[merged_length + 1] = {};
+
+    template<typename... types>
+    explicit _callsite_segments(types&&... msgs) {
+        _segment_builder builder{ segments, merged_text };
+        (builder.add(_describe_segment<types&&>(static_cast<types&&>(msgs))), ...);
+    }
+};
+
+template<typename type, typename arg_type>
+bool _store_segment(arg_type&& msg, char*& buffer) {
+    if constexpr (is_constant_segment<type>) {
+        return true;
+    } else {
+        using container_type = typename segment<type>::container_type;
+        void* storage = buffer;
+        bool result = segment<type>{}.log(static_cast<arg_type&&>(msg), storage);
+        if constexpr (is_variable_segment<type>) {
+            buffer += static_cast<const container_type*>(storage)->size();
+        } else {
+            buffer += sizeof(container_type);
+        }
+        return result;
+    }
+}
+
+} // namespace detail
+
+template<typename... types>
+constexpr const auto line_size = (size_t(0) + ... + detail::_segment_size<types>());
+
 template<typename msg_type, typename... fmt_types>
 static typename segment<msg_type&&>::container_type
 fmt(msg_type&& msg, fmt_types&&... fmt_attrs) {
@@ -92,36 +467,244 @@ fmt(msg_type&& msg, fmt_types&&... fmt_attrs) {
     return container;
 }
 
+// A string literal the log statement passes, see _literal_arguments().
+template<size_t length>
+struct string_literal {
+    const char (&text)[length];
+};
+
+namespace detail {
+
+constexpr bool _is_identifier_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+constexpr bool _has_bit(u64 mask, size_t idx) {
+    return idx < 64 && ((mask >> idx) & 1) != 0;
+}
+
+// Tells which arguments of a log statement are nothing but string literals,
+// going by the text of its arguments: bit idx is set for argument idx. An
+// array of const char may as well be a member that changes from call to
+// call, only literals can be captured once per callsite.
+// The text is split at commas outside of brackets and quotes. Commas between
+// template arguments make for more parts than there are arguments, then
+// nothing counts as a literal. So do raw strings, which may hold anything.
+constexpr u64 _literal_arguments(const char* text, size_t count) {
+    if (text == nullptr)
+        return 0;
+
+    u64 result = 0;
+    size_t idx = 0;
+    size_t depth = 0;
+    // what the current argument is made of so far
+    bool literals = false;
+    bool others = false;
+    for (const char* pos = text;;) {
+        char c = *pos;
+        if (c == '\0' || (c == ',' && depth == 0)) {
+            if (literals && others == false && idx < 64) {
+                result |= u64(1) << idx;
+            }
+            idx += 1;
+            literals = false;
+            others = false;
+            if (c == '\0')
+                break;
+
+            pos += 1;
+        } else if (c == '"' || c == '\'') {
+            for (pos += 1; *pos != c; pos += 1) {
+                if (*pos == '\0')
+                    return 0;
+
+                if (*pos == '\\' && pos[1] != '\0') {
+                    pos += 1;
+                }
+            }
+            pos += 1;
+            literals = literals || c == '"';
+            others = others || c == '\'';
+        } else if (_is_identifier_char(c)) {
+            // numbers may contain digit separators, which are no quotes
+            const bool number = c >= '0' && c <= '9';
+            bool raw = c == 'R';
+            for (pos += 1; _is_identifier_char(*pos)
+                || (number && (*pos == '.' || (*pos == '\'' && _is_identifier_char(pos[1])))); pos += 1) {
+                raw = raw || *pos == 'R';
+            }
+            if (number == false && raw && *pos == '"')
+                return 0;
+
+            // also covers prefixes and suffixes of literals
+            others = true;
+        } else {
+            if (c == '(' || c == '[' || c == '{') {
+                depth += 1;
+            } else if ((c == ')' || c == ']' || c == '}') && depth > 0) {
+                depth -= 1;
+            }
+            others = others || c != ' ';
+            pos += 1;
+        }
+    }
+    return idx == count ? result : 0;
+}
+
+template<typename type>
+constexpr bool _is_const_char_array = std::is_array_v<std::remove_reference_t<type>>
+    && std::is_same_v<std::remove_extent_t<std::remove_reference_t<type>>, const char>;
+
+// The arguments of a log statement that are string literals, and as such
+// passed as arrays of const char.
+template<typename... types>
+constexpr u64 _literal_mask(const char* arguments) {
+    u64 arrays = 0;
+    size_t idx = 0;
+    ((arrays |= (idx < 64 && _is_const_char_array<types>) ? u64(1) << idx : 0, idx += 1), ...);
+    return _literal_arguments(arguments, sizeof...(types)) & arrays;
+}
+
+template<u64 literals, size_t idx, typename type>
+decltype(auto) _mark_literal(type&& msg) {
+    if constexpr (_has_bit(literals, idx)) {
+        return string_literal<std::extent_v<std::remove_reference_t<type>>>{ msg };
+    } else {
+        return static_cast<type&&>(msg);
+    }
+}
+
+// Calls log() or record() again with the string literals of the log
+// statement passed as string_literal.
+template<bool recorded, u64 literals, typename site_type, size_t... idx, typename... types>
+bool _pass_literals(site_type site, std::index_sequence<idx...>, types&&... msgs) {
+    if constexpr (recorded) {
+        return ::belog::record(site, _mark_literal<literals, idx>(static_cast<types&&>(msgs))...);
+    } else {
+        return ::belog::log(site, _mark_literal<literals, idx>(static_cast<types&&>(msgs))...);
+    }
+}
+
+template<typename site_type, typename... types>
+const callsite& _describe_callsite(site_type site, types&&... msgs) {
+    static constexpr callsite_info info = site();
+
+    // String literals have static storage duration, so their addresses can
+    // be captured once on the first call and reused for every later line.
+    // Literals passed next to each other are copied into a single segment.
+    static constexpr _callsite_layout layout = _layout_segments<types&&...>();
+    static const _callsite_segments<layout.segment_count, layout.merged_length> segments{
+        static_cast<types&&>(msgs)...
+    };
+    static constexpr callsite site_descriptor{
+        info.severity,
+        info.line,
+        info.file,
+        segments.segments,
+        layout.segment_count
+    };
+
+    return site_descriptor;
+}
+
 template<typename... types>
-static bool log(types&&... msgs) {
-    static_assert(
-        (std::is_base_of_v<segment_data, typename segment<types&&>::container_type> && ...),
-        "container types must be derived from struct ::belog::segment_data"
-    );
-
-    constexpr const auto length = line_size<types...>;
-    auto tbuf = detail::_buffer_for_thread(threads::current::id());
-
-    return tbuf->produce(
-        sizeof(line_start_data) + length,
-        [&msgs...](void* storage) {
-            u64 timepoint = tsc();
-
-            new(storage) line_start_data(timepoint);
-            char* buffer = static_cast<char*>(storage) + sizeof(line_start_data);
-
-            // This unpacks msgs and calls the log() member function of the appropriate specialization of
-            // segment for all arguments passed to this function.
-            // Use fold expression in order to avoid recursion which would blow compile time sky high.
-            return (segment<types&&>{}.log(
-                // forward type as accurately as possible, std::forward does not work for string literals
-                static_cast<types&&>(msgs),
-                // buffer needs to increase as we unpack, but we need the value of buffer from before it
-                // was increased for the current element.
-                static_cast<void*>((buffer += sizeof(segment<types&&>::container_type)) - sizeof(segment<types&&>::container_type))
-            ) && ...);
+bool _store_line(void* storage, const callsite* site, types&&... msgs) {
+    u64 timepoint = tsc();
+
+    new(storage) line_start_data(timepoint, site);
+    char* buffer = static_cast<char*>(storage) + sizeof(line_start_data);
+
+    // This unpacks msgs and calls the log() member function of the appropriate specialization of
+    // segment for all dynamic arguments passed to this function, constant ones are skipped.
+    // Use fold expression in order to avoid recursion which would blow compile time sky high.
+    // forward type as accurately as possible, std::forward does not work for string literals
+    return (_store_segment<types&&>(static_cast<types&&>(msgs), buffer) && ...);
+}
+
+} // namespace detail
+
+template<typename site_type, typename... types>
+static bool log(site_type site, types&&... msgs) {
+    // string literals of the statement come back wrapped, see _pass_literals()
+    constexpr u64 literals = detail::_literal_mask<types&&...>(site().arguments);
+    if constexpr (literals != 0) {
+        return detail::_pass_literals<false, literals>(site, std::index_sequence_for<types...>{}, static_cast<types&&>(msgs)...);
+    } else {
+        const callsite& site_descriptor = detail::_describe_callsite<site_type, types...>(site, static_cast<types&&>(msgs)...);
+
+        auto tbuf = detail::_thread_buffer;
+        if (tbuf == nullptr)
+            return false;
+
+        // Only strings add to the fixed size, for all other lines this folds
+        // into a constant.
+        const size_t length = line_size<types&&...> + (size_t(0) + ... + detail::_variable_size<types&&>(msgs));
+
+        auto write = [&site_descriptor, &msgs...](void* storage) {
+            return detail::_store_line<types...>(storage, &site_descriptor, static_cast<types&&>(msgs)...);
+        };
+
+        bool was_empty = false;
+        bool result = tbuf->produce(sizeof(line_start_data) + length, write, &was_empty);
+
+        if (result == false) {
+            tbuf = detail::_switch_buffer(tbuf, sizeof(line_start_data) + length);
+            result = tbuf != nullptr && tbuf->produce(sizeof(line_start_data) + length, write, &was_empty);
+        }
+
+        for (u64 deadline = 0; result == false;) {
+            tbuf = detail::_wait_for_space(site_descriptor.severity, sizeof(line_start_data) + length, deadline);
+            if (tbuf == nullptr)
+                break;
+
+            result = tbuf->produce(sizeof(line_start_data) + length, write, &was_empty);
+        }
+
+        if (result == false) {
+            detail::_count_drop();
+            return false;
         }
-    );
+
+        // Without the fence, the load could be done before the line is visible
+        // to a logging thread that is about to park, see park().
+        if (was_empty) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+        if (detail::_consumer_parked.load(std::memory_order_relaxed) != 0) {
+            detail::_wake_consumer();
+        }
+        return true;
+    }
+}
+
+// Like log(), but puts the line into the flight recorder of the thread, where
+// it stays unformatted until the recorder is dumped or newer lines take its
+// place. Never wakes the logging thread. Strings longer than
+// BELOG_RECORDED_STRING_MAX are left out.
+template<typename site_type, typename... types>
+static bool record(site_type site, types&&... msgs) {
+    constexpr u64 literals = detail::_literal_mask<types&&...>(site().arguments);
+    if constexpr (literals != 0) {
+        return detail::_pass_literals<true, literals>(site, std::index_sequence_for<types...>{}, static_cast<types&&>(msgs)...);
+    } else {
+        const callsite& site_descriptor = detail::_describe_callsite<site_type, types...>(site, static_cast<types&&>(msgs)...);
+
+        auto recorder = detail::_recorder;
+        if (recorder == nullptr) {
+            recorder = detail::_attach_recorder();
+            if (recorder == nullptr)
+                return false;
+        }
+
+        detail::_string_max = BELOG_RECORDED_STRING_MAX;
+        const size_t length = line_size<types&&...> + (size_t(0) + ... + detail::_variable_size<types&&>(msgs));
+
+        bool result = recorder->produce(sizeof(line_start_data) + length, [&site_descriptor, &msgs...](void* storage) {
+            return detail::_store_line<types...>(storage, &site_descriptor, static_cast<types&&>(msgs)...);
+        });
+        detail::_string_max = BELOG_STRING_MAX;
+        return result;
+    }
 }
 
 #define BELOG_SEGMENT_FORWARD(fromType, toType) \
@@ -129,8 +712,11 @@ static bool log(types&&... msgs) {
 
 //////////////////////////////////////////////////////////////////////////
 
-size_t log_string_literal(const struct string_literal_data*);
-struct string_literal_data : segment_data {
+size_t log_string_literal(const struct string_literal_data*, output_buffer&);
+struct string_literal_data {
+    static constexpr auto kind = segment_kind::string_pointer;
+    static constexpr auto log_func = log_string_literal;
+
     const char* address;
     size_t length;
     static constexpr const size_t UNKNOWN_LENGTH = 0;
@@ -143,79 +729,157 @@ struct string_literal_data : segment_data {
         string_literal_data(address, UNKNOWN_LENGTH) {}
 
     explicit string_literal_data(const char* address, size_t length) :
-        segment_data(log_string_literal),
         address(address),
         length(length) {}
 };
 
-template<size_t length> struct segment<const char(&)[length]> {
+// Only string literals are captured by the callsite, their contents never
+// change and they outlive the logging thread.
+template<size_t length> struct segment<string_literal<length>&&> {
     static_assert(length > 0, "invalid string length");
 
-    bool log(const char (&msg)[length], void* storage) {
-        new(storage) string_literal_data(msg);
-        return true;
+    static constexpr size_t literal_length = length - 1;
+
+    static callsite_segment describe(const string_literal<length>& msg) {
+        return callsite_segment(msg.text, literal_length);
     }
 
-    using container_type = string_literal_data;
+    using container_type = void;
 };
 
-template<> struct segment<const char*> {
-    bool log(const char* msg, void* storage) {
-        new(storage) string_literal_data(msg);
-        return true;
+//////////////////////////////////////////////////////////////////////////
+
+size_t log_inline_string(const struct inline_string_data*, output_buffer&);
+
+// The text follows this header in the line, padded to a multiple of 8 bytes.
+// Texts longer than BELOG_STRING_MAX are left out and only their length is
+// logged.
+struct inline_string_data {
+    static constexpr auto kind = segment_kind::inline_string;
+    static constexpr auto log_func = log_inline_string;
+
+    enum placement_type : u32 {
+        in_line = 0,
+        left_out
+    };
+
+    u32 length;
+    placement_type placement;
+
+    // Only short strings are checked against the limit of the thread.
+    static bool keeps(size_t length) {
+        return length <= BELOG_RECORDED_STRING_MAX || length <= detail::_string_max;
     }
 
-    using container_type = string_literal_data;
-};
+    static constexpr size_t padded_length(size_t length) {
+        return (length + 7) & ~size_t(7);
+    }
 
-BELOG_SEGMENT_FORWARD(const char*&, const char*);
-BELOG_SEGMENT_FORWARD(const char*&&, const char*);
+    // space taken up behind the header by a text of length bytes
+    static size_t payload_size(size_t length) {
+        return keeps(length) ? padded_length(length) : 0;
+    }
 
-//////////////////////////////////////////////////////////////////////////
+    static void store(const char* text, size_t length, void* storage) {
+        char* payload = static_cast<char*>(storage) + sizeof(inline_string_data);
+        if (keeps(length)) {
+            new(storage) inline_string_data{ u32(length), in_line };
+            memcpy(payload, text, length);
+            return;
+        }
 
-size_t log_std_string(const struct std_string_data*);
-struct std_string_data : segment_data {
-    std::string string;
+        new(storage) inline_string_data{ u32(length < UINT32_MAX ? length : UINT32_MAX), left_out };
+        detail::_count_left_out();
+    }
 
-    explicit std_string_data(const std::string& string) :
-        segment_data(log_std_string),
-        string(string) {}
+    // including the header
+    size_t size() const {
+        return sizeof(inline_string_data) + (placement == in_line ? padded_length(length) : 0);
+    }
 
-    explicit std_string_data(std::string&& string) :
-        segment_data(log_std_string),
-        string(std::move(string)) {}
+    const char* text() const {
+        return reinterpret_cast<const char*>(this + 1);
+    }
 };
 
-template<> struct segment<std::string&&> {
-    bool log(std::string&& msg, void* storage) {
-        new(storage) std_string_data(std::move(msg));
+template<> struct segment<std::string_view> {
+    static size_t variable_size(std::string_view msg) {
+        return inline_string_data::payload_size(msg.size());
+    }
+
+    bool log(std::string_view msg, void* storage) {
+        inline_string_data::store(msg.data(), msg.size(), storage);
         return true;
     }
 
-    using container_type = std_string_data;
+    using container_type = inline_string_data;
 };
 
-BELOG_SEGMENT_FORWARD(std::string, std::string&&);
+BELOG_SEGMENT_FORWARD(std::string_view&, std::string_view);
+BELOG_SEGMENT_FORWARD(const std::string_view&, std::string_view);
+BELOG_SEGMENT_FORWARD(std::string_view&&, std::string_view);
 
-template<> struct segment<const std::string&> {
-    bool log(const std::string& msg, void* storage) {
-        new(storage) std_string_data(msg);
-        return true;
+// The text is copied, the string may be gone by the time the line is written.
+BELOG_SEGMENT_FORWARD(std::string, std::string_view);
+BELOG_SEGMENT_FORWARD(std::string&, std::string_view);
+BELOG_SEGMENT_FORWARD(const std::string&, std::string_view);
+BELOG_SEGMENT_FORWARD(std::string&&, std::string_view);
+
+// Unlike string literals, pointers may point into buffers that are reused.
+template<> struct segment<const char*> {
+    static std::string_view view(const char* msg) {
+        return msg != nullptr ? std::string_view(msg) : std::string_view();
+    }
+
+    static size_t variable_size(const char* msg) {
+        return segment<std::string_view>::variable_size(view(msg));
+    }
+
+    bool log(const char* msg, void* storage) {
+        return segment<std::string_view>{}.log(view(msg), storage);
+    }
+
+    using container_type = inline_string_data;
+};
+
+BELOG_SEGMENT_FORWARD(const char*&, const char*);
+BELOG_SEGMENT_FORWARD(const char* const&, const char*);
+BELOG_SEGMENT_FORWARD(const char*&&, const char*);
+BELOG_SEGMENT_FORWARD(char*, const char*);
+BELOG_SEGMENT_FORWARD(char*&, const char*);
+BELOG_SEGMENT_FORWARD(char* const&, const char*);
+BELOG_SEGMENT_FORWARD(char*&&, const char*);
+
+// Arrays that are not const are buffers, their text is copied up to the
+// first NUL.
+template<size_t length> struct segment<char(&)[length]> {
+    static std::string_view view(const char (&msg)[length]) {
+        return std::string_view(msg, strnlen(msg, length));
+    }
+
+    static size_t variable_size(const char (&msg)[length]) {
+        return segment<std::string_view>::variable_size(view(msg));
     }
 
-    using container_type = std_string_data;
+    bool log(const char (&msg)[length], void* storage) {
+        return segment<std::string_view>{}.log(view(msg), storage);
+    }
+
+    using container_type = inline_string_data;
 };
 
-BELOG_SEGMENT_FORWARD(std::string&, const std::string&);
+// So are arrays of const char that the log statement does not spell out as
+// string literals, like members of a struct, which may differ between lines.
+template<size_t length> struct segment<const char(&)[length]> : segment<char(&)[length]> {};
 
 //////////////////////////////////////////////////////////////////////////
 
 template<> struct segment<bool> {
     bool log(bool msg, void* storage) {
         if (msg) {
-            segment<decltype("true")>{}.log("true", storage);
+            new(storage) string_literal_data("true");
         } else {
-            segment<decltype("false")>{}.log("false", storage);
+            new(storage) string_literal_data("false");
         }
         return true;
     }
@@ -256,14 +920,16 @@ union integer_attributes {
     }
 };
 
-size_t log_integer(const struct integer_data*);
-struct integer_data : segment_data {
+size_t log_integer(const struct integer_data*, output_buffer&);
+struct integer_data {
+    static constexpr auto kind = segment_kind::integer;
+    static constexpr auto log_func = log_integer;
+
     integer_attributes attributes;
     char msg[sizeof(long long)];
 
     template<typename ty>
     explicit integer_data(ty msg) :
-        segment_data(log_integer),
         attributes(0) {
         assign(msg);
     }
@@ -382,14 +1048,16 @@ union float_attributes {
         all_bits(initval) {}
 };
 
-size_t log_float(const struct float_data*);
-struct float_data : segment_data {
+size_t log_float(const struct float_data*, output_buffer&);
+struct float_data {
+    static constexpr auto kind = segment_kind::floating_point;
+    static constexpr auto log_func = log_float;
+
     float_attributes attributes;
     char msg[sizeof(long double)];
 
     template<typename ty>
     explicit float_data(ty msg) :
-        segment_data(log_float),
         attributes(0) {
         attributes.length_log2 = u32(ctu::log2_v<sizeof(msg)>);
         attributes.precision = attributes.precision.mask;
@@ -437,6 +1105,94 @@ BELOG_SEGMENT_FORWARD(long double&&, long double);
 
 //////////////////////////////////////////////////////////////////////////
 
+// User-defined types become loggable by specializing formatter for them:
+//
+//     template<> struct belog::formatter<vector3> {
+//         static void format(const vector3& value, belog::output_buffer& out);
+//     };
+//
+// log() copies the object into the line as it is, format() is called by the
+// logging thread, so the type has to be trivially copyable. Types that are
+// not, or that are larger than what is worth copying, can capture a part of
+// themselves instead:
+//
+//         using capture_type = ...;
+//         static capture_type capture(const type& value);
+//         static void format(const capture_type& value, belog::output_buffer& out);
+//
+// format_value() in log_format.hpp formats numbers the way log() does.
+
+namespace detail {
+
+template<typename type, typename = void>
+struct _capture_type {
+    using capture_type = type;
+
+    static const type& capture(const type& value) {
+        return value;
+    }
+};
+
+template<typename type>
+struct _capture_type<type, std::void_t<typename formatter<type>::capture_type>> {
+    using capture_type = typename formatter<type>::capture_type;
+
+    static capture_type capture(const type& value) {
+        return formatter<type>::capture(value);
+    }
+};
+
+} // namespace detail
+
+// Starts every segment of a user-defined type, so the binary writer can skip
+// them without knowing the type.
+struct user_type_header {
+    u32 size;
+    u32 _padding;
+};
+
+template<typename type> struct user_type_data;
+
+template<typename type>
+size_t log_user_type(const user_type_data<type>* msg, output_buffer& out) {
+    formatter<type>::format(msg->capture, out);
+    return sizeof(user_type_data<type>);
+}
+
+// Aligned like the ring, so its size is a multiple of 8 bytes and the
+// segments that follow it in a line stay aligned, whatever the capture.
+template<typename type>
+struct alignas(8) user_type_data {
+    using capture_type = typename detail::_capture_type<type>::capture_type;
+
+    static_assert(std::is_trivially_copyable_v<capture_type>, "captures of user-defined types have to be trivially copyable");
+    static_assert(alignof(capture_type) <= 8, "captures of user-defined types can be aligned to at most 8 bytes");
+
+    static constexpr auto kind = segment_kind::user_type;
+    static constexpr auto log_func = log_user_type<type>;
+
+    user_type_header header;
+    capture_type capture;
+
+    explicit user_type_data(const type& value) :
+        header{ u32(sizeof(user_type_data)), 0 },
+        capture(detail::_capture_type<type>::capture(value)) {}
+};
+
+template<typename type>
+struct segment<type, std::void_t<decltype(sizeof(formatter<std::decay_t<type>>))>> {
+    using value_type = std::decay_t<type>;
+
+    bool log(const value_type& msg, void* storage) {
+        new(storage) user_type_data<value_type>(msg);
+        return true;
+    }
+
+    using container_type = user_type_data<value_type>;
+};
+
+//////////////////////////////////////////////////////////////////////////
+
 struct hex {
     void operator()(integer_attributes& attrs) {
         attrs.is_hex = true;
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstring>
+#include "types.hpp"
+
+// Layout of binary belog output.
+//
+// A log file starts with a file_header, followed by blocks. Every block
+// starts with a block_header and holds whole records. Records start with a
+// record_header and are padded to multiples of RECORD_ALIGN bytes. Callsites
+// are described by a callsite record before the first line referring to
+// them, in the same block as that line.
+//
+// The side index starts with an index_header, followed by records using the
+// same framing. It repeats every callsite record of the log file and holds
+// one index_entry for every interval of at least index_interval bytes of the
+// log file. All integers are little endian.
+
+namespace belog::binary {
+
+static constexpr u32 FORMAT_VERSION = 1;
+static constexpr size_t RECORD_ALIGN = 8;
+
+// "BELOGBIN", "BELOGBLK" and "BELOGIDX" in little endian
+static constexpr u64 FILE_MAGIC = 0x4E494247'4F4C4542ull;
+static constexpr u64 BLOCK_MAGIC = 0x4B4C4247'4F4C4542ull;
+static constexpr u64 INDEX_MAGIC = 0x58444947'4F4C4542ull;
+
+struct file_header {
+    u64 magic;
+    u32 version;
+    u32 block_size;
+    u64 tsc_frequency;
+    // tsc() and wall clock time in nanoseconds since 1970-01-01 UTC, taken
+    // at the same time when output started
+    u64 start_timepoint;
+    i64 start_wall_clock;
+};
+
+struct block_header {
+    u64 magic;
+    // Offset of this header from the start of the file. Readers looking for
+    // block boundaries check this to tell real headers from payload bytes.
+    u64 offset;
+    u32 length;
+    u32 record_count;
+    u64 min_timepoint;
+    u64 max_timepoint;
+};
+
+enum class record_type : u32 {
+    callsite = 1,
+    line,
+    index_entry,
+    clock
+};
+
+struct record_header {
+    // including this header and padding
+    u32 length;
+    record_type type;
+};
+
+// Followed by the file name as a string, and segment_count segment
+// descriptions of the form { u8 kind, u8[3] padding, u32 length } plus the
+// literal text of length bytes, padded to RECORD_ALIGN.
+struct callsite_record {
+    u32 id;
+    u32 line;
+    u8 severity;
+    u8 _padding[3];
+    u32 segment_count;
+};
+
+struct segment_record {
+    u8 kind;
+    u8 _padding[3];
+    u32 length;
+};
+
+// Followed by the dynamic segments of the line, in the order the callsite
+// lists them:
+//   integer:                 u64 integer_attributes, u8[8] value
+//   floating_point:          u64 float_attributes, u8[8] value, a float in the
+//                            first four bytes or a double
+//   string_pointer,          u32 length, u32 padding, text padded to RECORD_ALIGN
+//   inline_string:
+// Values of user-defined types are formatted by the logging thread and stored
+// as inline_string.
+struct line_record {
+    u32 callsite_id;
+    u32 thread_id;
+    u64 timepoint;
+};
+
+struct index_header {
+    u64 magic;
+    u32 version;
+    u32 index_interval;
+    u64 tsc_frequency;
+    u64 start_timepoint;
+    i64 start_wall_clock;
+};
+
+// The map of tsc() values to wall clock time the logging thread used at the
+// time, see tsc_wall_clock. Every block starts with one, and another one
+// follows whenever the logging thread recalibrates, lines use the last one
+// before them. Lines in blocks without one, written by older versions, use
+// the tsc frequency and start times of the file header.
+struct clock_record {
+    u64 base_timepoint;
+    i64 base_wall_clock;
+    u64 multiplier;
+    u32 shift;
+    u32 _padding;
+};
+
+// Covers all blocks from block_offset up to the block_offset of the next
+// entry, or the end of the log file for the last one.
+struct index_entry {
+    u64 block_offset;
+    u64 min_timepoint;
+    u64 max_timepoint;
+};
+
+constexpr size_t padded(size_t length) {
+    return (length + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+}
+
+// size of a string as stored in a record
+constexpr size_t string_size(size_t length) {
+    return 2 * sizeof(u32) + padded(length);
+}
+
+template<typename type>
+type read(const char* data) {
+    type result;
+    memcpy(&result, data, sizeof(result));
+    return result;
+}
+
+} // namespace belog::binary
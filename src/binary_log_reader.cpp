@@ -0,0 +1,613 @@
+#include "binary_log_reader.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "log_format.hpp"
+#include "wall_clock.hpp"
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace belog {
+
+using namespace binary;
+
+#if defined(_WIN32)
+
+struct binary_log_reader::mapped_file {
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+    const char* data = nullptr;
+    u64 size = 0;
+
+    bool open(const char* path) {
+        // the logging process may still be writing to the file
+        file = CreateFileA(
+            path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, nullptr
+        );
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER length;
+        if (GetFileSizeEx(file, &length) == FALSE || length.QuadPart == 0)
+            return false;
+        size = u64(length.QuadPart);
+
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping == nullptr)
+            return false;
+
+        data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        return data != nullptr;
+    }
+
+    ~mapped_file() {
+        if (data != nullptr) {
+            UnmapViewOfFile(data);
+        }
+        if (mapping != nullptr) {
+            CloseHandle(mapping);
+        }
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+        }
+    }
+};
+
+#else
+
+struct binary_log_reader::mapped_file {
+    int fd = -1;
+    const char* data = nullptr;
+    u64 size = 0;
+
+    bool open(const char* path) {
+        fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0)
+            return false;
+        size = u64(info.st_size);
+
+        void* view = mmap(nullptr, size_t(size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view == MAP_FAILED)
+            return false;
+
+        // every chunk is read front to back
+        madvise(view, size_t(size), MADV_SEQUENTIAL);
+        data = static_cast<const char*>(view);
+        return true;
+    }
+
+    ~mapped_file() {
+        if (data != nullptr) {
+            munmap(const_cast<char*>(data), size_t(size));
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+};
+
+#endif
+
+// Calls work(idx) for every idx in [0, count) on thread_count threads, and
+// consume(idx) on the calling thread in order of idx, as soon as work(idx)
+// and all consume() before it are done. At most window results are waiting
+// to be consumed at any time.
+template<typename work_func, typename consume_func>
+static void run_ordered(u32 thread_count, size_t count, size_t window, work_func&& work, consume_func&& consume) {
+    if (thread_count <= 1 || count <= 1) {
+        for (size_t idx = 0; idx < count; idx += 1) {
+            work(idx);
+            consume(idx);
+        }
+        return;
+    }
+
+    std::mutex mutex;
+    std::condition_variable done_changed;
+    std::condition_variable consumed_changed;
+    std::vector<u8> done(count);
+    size_t next_task = 0;
+    size_t next_consumed = 0;
+
+    auto worker = [&] {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            consumed_changed.wait(lock, [&] {
+                return next_task >= count || next_task < next_consumed + window;
+            });
+            if (next_task >= count)
+                return;
+
+            size_t idx = next_task;
+            next_task += 1;
+
+            lock.unlock();
+            work(idx);
+            lock.lock();
+
+            done[idx] = 1;
+            done_changed.notify_one();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (u32 idx = 0; idx < std::min(size_t(thread_count), count); idx += 1) {
+        workers.emplace_back(worker);
+    }
+
+    for (size_t idx = 0; idx < count; idx += 1) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done_changed.wait(lock, [&] { return done[idx] != 0; });
+        }
+
+        consume(idx);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            next_consumed = idx + 1;
+        }
+        consumed_changed.notify_all();
+    }
+
+    for (auto& thread : workers) {
+        thread.join();
+    }
+}
+
+// Reads a string as written by the binary writer, returns the number of
+// bytes it occupies or 0 if it does not fit into length bytes.
+static size_t read_string(const char* data, size_t length, const char*& text, size_t& text_length) {
+    if (length < 2 * sizeof(u32))
+        return 0;
+
+    text_length = read<u32>(data);
+    size_t size = string_size(text_length);
+    if (size > length)
+        return 0;
+
+    text = data + 2 * sizeof(u32);
+    return size;
+}
+
+binary_log_reader::binary_log_reader() = default;
+binary_log_reader::~binary_log_reader() = default;
+
+bool binary_log_reader::open(const char* path) {
+    _has_index = false;
+    _entries.clear();
+    _callsites.clear();
+    _data = nullptr;
+    _size = 0;
+
+    _file = std::make_unique<mapped_file>();
+    if (_file->open(path) == false || _file->size < sizeof(file_header))
+        return false;
+
+    _data = _file->data;
+    _size = _file->size;
+    _header = read<file_header>(_data);
+
+    return _header.magic == FILE_MAGIC && _header.version == FORMAT_VERSION && _header.tsc_frequency != 0;
+}
+
+bool binary_log_reader::load_index(const char* path) {
+    mapped_file file;
+    if (file.open(path) == false || file.size < sizeof(index_header))
+        return false;
+
+    const char* data = file.data;
+    size_t size = size_t(file.size);
+
+    auto header = read<index_header>(data);
+    if (header.magic != INDEX_MAGIC || header.version != FORMAT_VERSION)
+        return false;
+
+    // an index belongs to exactly one log file
+    if (header.start_timepoint != _header.start_timepoint || header.start_wall_clock != _header.start_wall_clock)
+        return false;
+
+    // An index cut short by a crash is still good for the part it covers,
+    // the rest of the log file is decoded without its help.
+    size_t offset = sizeof(index_header);
+    while (offset + sizeof(record_header) <= size) {
+        auto record = read<record_header>(data + offset);
+        if (record.length < sizeof(record_header) || offset + record.length > size)
+            break;
+
+        if (record.type == record_type::callsite) {
+            if (read_callsite(data + offset, record.length) == false)
+                break;
+        } else if (record.type == record_type::index_entry && record.length >= sizeof(record_header) + sizeof(index_entry)) {
+            auto entry = read<index_entry>(data + offset + sizeof(record_header));
+            if (is_block(entry.block_offset) == false)
+                break;
+            _entries.push_back(entry);
+        }
+
+        offset += record.length;
+    }
+
+    _has_index = true;
+    return true;
+}
+
+bool binary_log_reader::read_callsite(const char* data, size_t length) {
+    size_t offset = sizeof(record_header);
+    if (offset + sizeof(callsite_record) > length)
+        return false;
+
+    auto record = read<callsite_record>(data + offset);
+    offset += sizeof(callsite_record);
+
+    callsite_description site;
+    site.is_known = true;
+    site.severity = level(record.severity);
+    site.line = record.line;
+
+    const char* text;
+    size_t text_length;
+    size_t size = read_string(data + offset, length - offset, text, text_length);
+    if (size == 0)
+        return false;
+    site.file.assign(text, text_length);
+    offset += size;
+
+    for (u32 idx = 0; idx < record.segment_count; idx += 1) {
+        if (offset + sizeof(segment_record) > length)
+            return false;
+
+        auto seg = read<segment_record>(data + offset);
+        offset += sizeof(segment_record);
+        if (offset + padded(seg.length) > length)
+            return false;
+
+        site.segments.push_back(segment_description{ segment_kind(seg.kind), std::string(data + offset, seg.length) });
+        offset += padded(seg.length);
+    }
+
+    if (record.id >= _callsites.size()) {
+        _callsites.resize(size_t(record.id) + 1);
+    }
+    _callsites[record.id] = std::move(site);
+    return true;
+}
+
+u64 binary_log_reader::timepoint_from_seconds(f64 seconds) const {
+    if (seconds <= 0.0)
+        return _header.start_timepoint;
+
+    f64 ticks = seconds * f64(_header.tsc_frequency);
+    if (ticks >= f64(~u64(0) - _header.start_timepoint))
+        return ~u64(0);
+
+    return _header.start_timepoint + u64(ticks);
+}
+
+u64 binary_log_reader::timepoint_from_wall_clock(i64 nanoseconds) const {
+    return timepoint_from_seconds(f64(nanoseconds - _header.start_wall_clock) / 1e9);
+}
+
+// Block headers store their own offset, which payload bytes that happen to
+// look like the magic number are all but certain to get wrong.
+bool binary_log_reader::is_block(u64 offset) const {
+    if (offset % RECORD_ALIGN != 0 || offset + sizeof(block_header) > _size)
+        return false;
+
+    auto header = read<block_header>(_data + offset);
+    return header.magic == BLOCK_MAGIC
+        && header.offset == offset
+        && header.length >= sizeof(block_header)
+        && header.length % RECORD_ALIGN == 0
+        && offset + header.length <= _size;
+}
+
+// Returns the offset of the first block starting in [offset, end), or end.
+u64 binary_log_reader::next_block(u64 offset, u64 end) const {
+    offset = (offset + RECORD_ALIGN - 1) & ~u64(RECORD_ALIGN - 1);
+    for (; offset < end; offset += RECORD_ALIGN) {
+        if (read<u64>(_data + offset) == BLOCK_MAGIC && is_block(offset))
+            return offset;
+    }
+    return end;
+}
+
+bool binary_log_reader::scan_callsites(const chunk& range, std::vector<const char*>& records) const {
+    bool intact = true;
+    u64 offset = range.find_start ? next_block(range.begin, range.end) : range.begin;
+
+    while (offset < range.end) {
+        if (is_block(offset) == false) {
+            intact = false;
+            offset = next_block(offset + RECORD_ALIGN, range.end);
+            continue;
+        }
+
+        auto header = read<block_header>(_data + offset);
+        const char* data = _data + offset + sizeof(block_header);
+        size_t length = header.length - sizeof(block_header);
+
+        size_t pos = 0;
+        while (pos + sizeof(record_header) <= length) {
+            auto record = read<record_header>(data + pos);
+            if (record.length < sizeof(record_header) || pos + record.length > length) {
+                intact = false;
+                break;
+            }
+
+            if (record.type == record_type::callsite) {
+                records.push_back(data + pos);
+            }
+            pos += record.length;
+        }
+
+        offset += header.length;
+    }
+
+    return intact;
+}
+
+bool binary_log_reader::decode(output_buffer& out, const filter& lines, u32 thread_count, size_t chunk_size) {
+    if (_data == nullptr)
+        return false;
+
+    thread_count = std::max(thread_count, u32(1));
+    chunk_size = std::max(chunk_size, size_t(1) << 16);
+
+    std::vector<chunk> chunks;
+
+    // Intervals closed by an index entry start at a known block boundary
+    // and have a known range of time. Whatever follows the start of the
+    // last entry may not have been indexed yet and is cut into chunks of
+    // chunk_size bytes instead.
+    u64 tail = sizeof(file_header);
+    if (_has_index && _entries.empty() == false) {
+        for (size_t idx = 0; idx + 1 < _entries.size(); idx += 1) {
+            const index_entry& entry = _entries[idx];
+            chunk range{ entry.block_offset, _entries[idx + 1].block_offset, entry.min_timepoint, entry.max_timepoint, false };
+            if (range.max_timepoint >= lines.min_timepoint && range.min_timepoint <= lines.max_timepoint) {
+                chunks.push_back(range);
+            }
+        }
+        tail = _entries.back().block_offset;
+    }
+
+    size_t first_tail_chunk = chunks.size();
+    for (u64 begin = tail; begin < _size; begin += chunk_size) {
+        chunks.push_back(chunk{ begin, std::min(begin + chunk_size, _size), 0, ~u64(0), begin != tail });
+    }
+
+    bool intact = true;
+    size_t window = 2 * size_t(thread_count);
+
+    // Lines refer to callsites by id. The index knows all callsites of the
+    // intervals it covers, the rest are collected from the tail before any
+    // line is decoded. They are rare, so this mostly skips over records.
+    {
+        std::vector<std::vector<const char*>> records(chunks.size() - first_tail_chunk);
+        std::vector<u8> results(records.size());
+        run_ordered(
+            thread_count, records.size(), records.size(),
+            [&](size_t idx) {
+                results[idx] = scan_callsites(chunks[first_tail_chunk + idx], records[idx]);
+            },
+            [&](size_t idx) {
+                for (const char* record : records[idx]) {
+                    intact = read_callsite(record, read<record_header>(record).length) && intact;
+                }
+                intact = intact && results[idx];
+            }
+        );
+    }
+
+    // Everything filtering by callsite is decided once per callsite.
+    std::vector<u8> selected(_callsites.size());
+    for (size_t id = 0; id < _callsites.size(); id += 1) {
+        const callsite_description& site = _callsites[id];
+        if (site.is_known == false || site.severity < lines.min_severity)
+            continue;
+
+        bool matches = lines.callsites.empty();
+        for (const std::string& pattern : lines.callsites) {
+            std::string file = pattern;
+            u32 line = 0;
+
+            // "C:\..." has a colon too, only a trailing number is a line
+            auto colon = pattern.find_last_of(':');
+            if (colon != std::string::npos && colon + 1 < pattern.size()
+                && pattern.find_first_not_of("0123456789", colon + 1) == std::string::npos) {
+                file = pattern.substr(0, colon);
+                line = u32(std::stoul(pattern.substr(colon + 1)));
+            }
+
+            bool file_matches = site.file.size() >= file.size()
+                && site.file.compare(site.file.size() - file.size(), file.size(), file) == 0;
+            if (file_matches && (line == 0 || line == site.line)) {
+                matches = true;
+                break;
+            }
+        }
+
+        selected[id] = matches ? 1 : 0;
+    }
+
+    std::vector<std::unique_ptr<memory_sink>> results(chunks.size());
+    std::vector<u8> decoded(chunks.size());
+    run_ordered(
+        thread_count, chunks.size(), window,
+        [&](size_t idx) {
+            results[idx] = std::make_unique<memory_sink>();
+            output_buffer chunk_out(*results[idx]);
+            decoded[idx] = decode_chunk(chunks[idx], lines, selected, chunk_out);
+        },
+        [&](size_t idx) {
+            out.write(results[idx]->data(), results[idx]->size());
+            results[idx].reset();
+            intact = intact && decoded[idx];
+        }
+    );
+
+    return intact;
+}
+
+bool binary_log_reader::decode_chunk(
+    const chunk& range,
+    const filter& lines,
+    const std::vector<u8>& selected,
+    output_buffer& out
+) const {
+    bool intact = true;
+    bool after_block = false;
+    u64 offset = range.find_start ? next_block(range.begin, range.end) : range.begin;
+
+    while (offset < range.end) {
+        // A file left behind by a crash can end in a partial block or in
+        // zero bytes, damage is skipped up to the next intact block.
+        if (is_block(offset) == false) {
+            intact = false;
+            after_block = false;
+            offset = next_block(offset + RECORD_ALIGN, range.end);
+            continue;
+        }
+
+        auto header = read<block_header>(_data + offset);
+        if (header.max_timepoint >= lines.min_timepoint && header.min_timepoint <= lines.max_timepoint) {
+            const char* data = _data + offset + sizeof(block_header);
+            intact = decode_block(data, header.length - sizeof(block_header), lines, selected, out) && intact;
+        }
+
+        offset += header.length;
+        after_block = true;
+    }
+
+    // The next chunk looks for its first block on its own and would skip a
+    // block cut short where the last block of this one ends, at the end of a
+    // truncated file for example.
+    if (after_block && offset < _size && is_block(offset) == false) {
+        intact = false;
+    }
+
+    out.flush();
+    return intact;
+}
+
+bool binary_log_reader::decode_block(
+    const char* data,
+    size_t length,
+    const filter& lines,
+    const std::vector<u8>& selected,
+    output_buffer& out
+) const {
+    f64 tsc_freq_inverse = 1.0 / f64(_header.tsc_frequency);
+    tsc_wall_clock clock(_header.start_timepoint, _header.start_wall_clock, _header.tsc_frequency);
+    timestamp_cache cached_timestamp;
+    bool intact = true;
+
+    size_t offset = 0;
+    while (offset + sizeof(record_header) <= length) {
+        auto header = read<record_header>(data + offset);
+        if (header.length < sizeof(record_header) || offset + header.length > length)
+            return false;
+
+        const char* record = data + offset;
+        offset += header.length;
+
+        if (header.type == record_type::clock && header.length >= sizeof(record_header) + sizeof(clock_record)) {
+            auto map = read<clock_record>(record + sizeof(record_header));
+            clock = tsc_wall_clock(map.base_timepoint, map.base_wall_clock, map.multiplier, map.shift);
+            continue;
+        }
+
+        if (header.type != record_type::line || header.length < sizeof(record_header) + sizeof(line_record))
+            continue;
+
+        auto line = read<line_record>(record + sizeof(record_header));
+        if (line.timepoint < lines.min_timepoint || line.timepoint > lines.max_timepoint)
+            continue;
+
+        if (line.callsite_id >= _callsites.size() || _callsites[line.callsite_id].is_known == false) {
+            intact = false;
+            continue;
+        }
+
+        if (selected[line.callsite_id] == 0)
+            continue;
+
+        if (lines.thread_ids.empty() == false
+            && std::find(lines.thread_ids.begin(), lines.thread_ids.end(), line.thread_id) == lines.thread_ids.end())
+            continue;
+
+        const callsite_description& site = _callsites[line.callsite_id];
+        if (_time_format == time_format::wall_clock) {
+            format_line_header(out, cached_timestamp, line.thread_id, clock.nanoseconds(line.timepoint), site.severity, site.file.c_str(), site.line);
+        } else {
+            f64 seconds = f64(i64(line.timepoint - _header.start_timepoint)) * tsc_freq_inverse;
+            format_line_header(out, line.thread_id, seconds, site.severity, site.file.c_str(), site.line);
+        }
+
+        const char* payload = record + sizeof(record_header) + sizeof(line_record);
+        size_t remaining = header.length - sizeof(record_header) - sizeof(line_record);
+        for (const segment_description& segment : site.segments) {
+            switch (segment.kind) {
+                case segment_kind::literal:
+                    out.write(segment.literal.data(), segment.literal.size());
+                    break;
+
+                case segment_kind::string_pointer:
+                case segment_kind::inline_string:
+                {
+                    const char* text;
+                    size_t text_length;
+                    size_t size = read_string(payload, remaining, text, text_length);
+                    if (size == 0)
+                        return false;
+
+                    out.write(text, text_length);
+                    payload += size;
+                    remaining -= size;
+                    break;
+                }
+
+                case segment_kind::integer:
+                    if (remaining < 2 * sizeof(u64))
+                        return false;
+
+                    format_integer(out, integer_attributes(read<u64>(payload)), payload + sizeof(u64));
+                    payload += 2 * sizeof(u64);
+                    remaining -= 2 * sizeof(u64);
+                    break;
+
+                case segment_kind::floating_point:
+                    if (remaining < sizeof(u64) + sizeof(f64))
+                        return false;
+
+                    format_float(out, float_attributes(read<u64>(payload)), payload + sizeof(u64));
+                    payload += sizeof(u64) + sizeof(f64);
+                    remaining -= sizeof(u64) + sizeof(f64);
+                    break;
+
+                default:
+                    return false;
+            }
+        }
+    }
+
+    return intact;
+}
+
+} // namespace belog
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "best_effort_logger.hpp"
+#include "binary_log.hpp"
+#include "log_sink.hpp"
+
+namespace belog {
+
+// Turns binary belog output back into the text the logging thread would
+// have produced. The log file is mapped into memory and cut into chunks,
+// which are decoded on a pool of threads and written out in order. Chunks
+// find the first block boundary in them on their own, so no part of the
+// file has to be read sequentially. With a side index, only the part of the
+// log file covering a range of time is looked at.
+struct binary_log_reader {
+    // Chunks of the log file not covered by the index are about this large.
+    static constexpr size_t DEFAULT_CHUNK_SIZE = size_t(1) << 22;
+
+    struct segment_description {
+        segment_kind kind;
+        std::string literal;
+    };
+
+    struct callsite_description {
+        bool is_known = false;
+        level severity = level::debug;
+        u32 line = 0;
+        std::string file;
+        std::vector<segment_description> segments;
+    };
+
+    // Lines have to pass all filters to be decoded.
+    struct filter {
+        u64 min_timepoint = 0;
+        u64 max_timepoint = ~u64(0);
+        level min_severity = level::debug;
+        // empty means all threads
+        std::vector<u32> thread_ids;
+        // "file" or "file:line", a file matches if the path recorded in the
+        // log ends with it. Empty means all callsites.
+        std::vector<std::string> callsites;
+    };
+
+    binary_log_reader();
+    ~binary_log_reader();
+
+    binary_log_reader(const binary_log_reader&) = delete;
+    binary_log_reader& operator=(const binary_log_reader&) = delete;
+
+    // Maps a log file and checks its file header.
+    bool open(const char* path);
+
+    // Loads a side index written alongside the log file opened last.
+    bool load_index(const char* path);
+
+    bool has_index() const {
+        return _has_index;
+    }
+
+    // Conversions into tsc() values as stored in the log file, from seconds
+    // since output started and from nanoseconds since 1970-01-01 UTC.
+    u64 timepoint_from_seconds(f64 seconds) const;
+    u64 timepoint_from_wall_clock(i64 nanoseconds) const;
+
+    // How line headers show the time of lines, wall clock time unless set.
+    void set_time_format(time_format format) {
+        _time_format = format;
+    }
+
+    // Writes every line passing lines to out, in the order they appear in the
+    // log file. Returns false if parts of the file could not be decoded, all
+    // intact blocks are decoded regardless.
+    bool decode(output_buffer& out, const filter& lines, u32 thread_count, size_t chunk_size = DEFAULT_CHUNK_SIZE);
+
+    struct mapped_file;
+
+private:
+    struct chunk {
+        u64 begin;
+        u64 end;
+        u64 min_timepoint;
+        u64 max_timepoint;
+        // set for chunks whose start is not known to be a block boundary
+        bool find_start;
+    };
+
+    u64 next_block(u64 offset, u64 end) const;
+    bool is_block(u64 offset) const;
+    bool scan_callsites(const chunk& range, std::vector<const char*>& records) const;
+    bool decode_chunk(const chunk& range, const filter& lines, const std::vector<u8>& selected, output_buffer& out) const;
+    bool decode_block(const char* data, size_t length, const filter& lines, const std::vector<u8>& selected, output_buffer& out) const;
+    bool read_callsite(const char* data, size_t length);
+
+    std::unique_ptr<mapped_file> _file;
+    const char* _data = nullptr;
+    u64 _size = 0;
+    binary::file_header _header{};
+
+    bool _has_index = false;
+    time_format _time_format = time_format::wall_clock;
+    std::vector<binary::index_entry> _entries;
+    std::vector<callsite_description> _callsites;
+};
+
+} // namespace belog
@@ -0,0 +1,405 @@
+#include "binary_log_writer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include "cpuid.hpp"
+#include "log_format.hpp"
+
+namespace belog {
+
+using namespace binary;
+
+binary_log_writer::binary_log_writer(
+    output_buffer& out,
+    output_buffer* index,
+    u64 start_timepoint,
+    size_t block_size,
+    size_t index_interval
+) :
+    _out(&out),
+    _index(index),
+    _block_size(std::max(block_size, size_t(1) << 12)),
+    _index_interval(index_interval),
+    _block(std::make_unique<char[]>(_block_size)),
+    _block_capacity(_block_size),
+    _block_used(sizeof(block_header)),
+    _offset(sizeof(file_header))
+{
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    i64 wall_clock = i64(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count());
+
+    file_header header{};
+    header.magic = FILE_MAGIC;
+    header.version = FORMAT_VERSION;
+    header.block_size = u32(_block_size);
+    header.tsc_frequency = tsc_frequency();
+    header.start_timepoint = start_timepoint;
+    header.start_wall_clock = wall_clock;
+    _out->write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    if (_index != nullptr) {
+        index_header idx{};
+        idx.magic = INDEX_MAGIC;
+        idx.version = FORMAT_VERSION;
+        idx.index_interval = u32(_index_interval);
+        idx.tsc_frequency = header.tsc_frequency;
+        idx.start_timepoint = start_timepoint;
+        idx.start_wall_clock = wall_clock;
+        _index->write(reinterpret_cast<const char*>(&idx), sizeof(idx));
+    }
+}
+
+binary_log_writer::~binary_log_writer() {
+    flush();
+    close_interval();
+}
+
+static constexpr size_t CLOCK_RECORD_LENGTH = sizeof(record_header) + sizeof(clock_record);
+
+// Makes sure length more bytes fit into the current block, starting a new
+// block if they do not. Records larger than a block get a block of their own.
+void binary_log_writer::make_room(size_t length) {
+    if (_block_used + length <= _block_capacity)
+        return;
+
+    flush();
+
+    size_t needed = sizeof(block_header) + CLOCK_RECORD_LENGTH + length;
+    if (needed > _block_capacity) {
+        _block = std::make_unique<char[]>(needed);
+        _block_capacity = needed;
+    } else if (_block_capacity > _block_size && needed <= _block_size) {
+        _block = std::make_unique<char[]>(_block_size);
+        _block_capacity = _block_size;
+    } else {
+        return;
+    }
+
+    // the clock record flush() started the block with is gone
+    _block_used = sizeof(block_header);
+    put_clock();
+}
+
+char* binary_log_writer::reserve(size_t length) {
+    make_room(length);
+
+    char* result = _block.get() + _block_used;
+    _block_used += length;
+    return result;
+}
+
+static char* put_string(char* dst, const char* text, size_t length) {
+    u32 header[2] = { u32(length), 0 };
+    memcpy(dst, header, sizeof(header));
+    memcpy(dst + sizeof(header), text, length);
+    memset(dst + sizeof(header) + length, 0, padded(length) - length);
+    return dst + string_size(length);
+}
+
+static void append_string(std::string& out, const char* text, size_t length) {
+    size_t offset = out.size();
+    out.resize(offset + string_size(length));
+    put_string(out.data() + offset, text, length);
+}
+
+static size_t callsite_record_size(const callsite* site) {
+    size_t length = sizeof(record_header) + sizeof(callsite_record) + string_size(strlen(site->file));
+    for (size_t idx = 0; idx < site->segment_count; idx += 1) {
+        length += sizeof(segment_record) + padded(site->segments[idx].literal_length);
+    }
+    return length;
+}
+
+void binary_log_writer::write_callsite(const callsite* site, u32 id, size_t length) {
+    size_t file_length = strlen(site->file);
+    char* record = reserve(length);
+    char* dst = record;
+
+    record_header header{ u32(length), record_type::callsite };
+    memcpy(dst, &header, sizeof(header));
+    dst += sizeof(header);
+
+    callsite_record description{};
+    description.id = id;
+    description.line = site->line;
+    description.severity = u8(site->severity);
+    description.segment_count = u32(site->segment_count);
+    memcpy(dst, &description, sizeof(description));
+    dst += sizeof(description);
+
+    dst = put_string(dst, site->file, file_length);
+
+    for (size_t idx = 0; idx < site->segment_count; idx += 1) {
+        const callsite_segment& segment = site->segments[idx];
+        segment_record seg{};
+        // user-defined types are stored as their text
+        seg.kind = u8(segment.kind == segment_kind::user_type ? segment_kind::inline_string : segment.kind);
+        seg.length = u32(segment.literal_length);
+        memcpy(dst, &seg, sizeof(seg));
+        dst += sizeof(seg);
+
+        memcpy(dst, segment.literal, segment.literal_length);
+        memset(dst + segment.literal_length, 0, padded(segment.literal_length) - segment.literal_length);
+        dst += padded(segment.literal_length);
+    }
+
+    // The index repeats every callsite, so readers of the index can decode
+    // any block without scanning everything before it.
+    if (_index != nullptr) {
+        _index->write(record, length);
+    }
+}
+
+static size_t string_pointer_length(const string_literal_data* msg) {
+    if (msg->length == msg->UNKNOWN_LENGTH)
+        return strlen(msg->address);
+
+    return msg->length - 1;
+}
+
+void binary_log_writer::write_line(u32 thread_id, const line_start_data* line, const char* elem) {
+    const callsite* site = line->site;
+
+    auto id = _callsite_ids.find(site);
+    bool new_callsite = id == _callsite_ids.end();
+    if (new_callsite) {
+        id = _callsite_ids.emplace(site, u32(_callsite_ids.size())).first;
+    }
+
+    // Strings and user-defined types, which are stored as their text, are
+    // the only segments of variable size. Their length is worked out once up
+    // front.
+    size_t length = sizeof(record_header) + sizeof(line_record);
+    _texts.clear();
+    const char* pos = elem;
+    for (size_t idx = 0; idx < site->segment_count; idx += 1) {
+        switch (site->segments[idx].kind) {
+            case segment_kind::literal:
+                break;
+            case segment_kind::string_pointer:
+                length += string_size(string_pointer_length(reinterpret_cast<const string_literal_data*>(pos)));
+                pos += sizeof(string_literal_data);
+                break;
+            case segment_kind::inline_string:
+            {
+                auto msg = reinterpret_cast<const inline_string_data*>(pos);
+                if (msg->placement == inline_string_data::in_line) {
+                    length += string_size(msg->length);
+                } else {
+                    size_t before = _texts.size();
+                    take_inline_string(msg, [this](const char* text, size_t text_length) {
+                        append_string(_texts, text, text_length);
+                    });
+                    length += _texts.size() - before;
+                }
+                pos += msg->size();
+                break;
+            }
+            case segment_kind::user_type:
+            {
+                size_t size = site->segments[idx].log_func(pos, _formatted_out);
+                _formatted_out.flush();
+                append_string(_texts, _formatted.data(), _formatted.size());
+                length += string_size(_formatted.size());
+                _formatted.clear();
+                pos += size;
+                break;
+            }
+            case segment_kind::integer:
+                length += 2 * sizeof(u64);
+                pos += sizeof(integer_data);
+                break;
+            case segment_kind::floating_point:
+                length += sizeof(u64) + sizeof(f64);
+                pos += sizeof(float_data);
+                break;
+        }
+    }
+
+    // A callsite is described in the same block as its first line, so both
+    // have to fit at once.
+    if (new_callsite) {
+        size_t callsite_length = callsite_record_size(site);
+        make_room(callsite_length + length);
+        write_callsite(site, id->second, callsite_length);
+    }
+
+    char* dst = reserve(length);
+
+    record_header header{ u32(length), record_type::line };
+    memcpy(dst, &header, sizeof(header));
+    dst += sizeof(header);
+
+    line_record record{ id->second, thread_id, line->timepoint };
+    memcpy(dst, &record, sizeof(record));
+    dst += sizeof(record);
+
+    size_t text_offset = 0;
+    auto put_text = [this, &text_offset](char* dst) {
+        size_t size = string_size(read<u32>(_texts.data() + text_offset));
+        memcpy(dst, _texts.data() + text_offset, size);
+        text_offset += size;
+        return dst + size;
+    };
+
+    for (size_t idx = 0; idx < site->segment_count; idx += 1) {
+        switch (site->segments[idx].kind) {
+            case segment_kind::literal:
+                break;
+
+            case segment_kind::string_pointer:
+            {
+                auto msg = reinterpret_cast<const string_literal_data*>(elem);
+                dst = put_string(dst, msg->address, string_pointer_length(msg));
+                msg->~string_literal_data();
+                elem += sizeof(string_literal_data);
+                break;
+            }
+
+            case segment_kind::inline_string:
+            {
+                auto msg = reinterpret_cast<const inline_string_data*>(elem);
+                if (msg->placement == inline_string_data::in_line) {
+                    dst = put_string(dst, msg->text(), msg->length);
+                } else {
+                    dst = put_text(dst);
+                }
+                elem += msg->size();
+                break;
+            }
+
+            case segment_kind::user_type:
+            {
+                dst = put_text(dst);
+                elem += reinterpret_cast<const user_type_header*>(elem)->size;
+                break;
+            }
+
+            case segment_kind::integer:
+            {
+                auto msg = reinterpret_cast<const integer_data*>(elem);
+                u64 value = 0;
+                memcpy(&value, msg->msg, size_t(1) << msg->attributes.length_log2);
+                memcpy(dst, &msg->attributes.all_bits, sizeof(u64));
+                memcpy(dst + sizeof(u64), &value, sizeof(value));
+                dst += 2 * sizeof(u64);
+                msg->~integer_data();
+                elem += sizeof(integer_data);
+                break;
+            }
+
+            case segment_kind::floating_point:
+            {
+                // long double is stored as double, the decoder has no way of
+                // knowing its layout on the logging machine. float stays
+                // float, so it is shown with the digits of float.
+                auto msg = reinterpret_cast<const float_data*>(elem);
+                float_attributes attributes = msg->attributes;
+                u64 value = 0;
+                if (attributes.length_log2 == ctu::log2(sizeof(float))) {
+                    memcpy(&value, msg->msg, sizeof(float));
+                } else if (attributes.length_log2 == ctu::log2(sizeof(double))) {
+                    memcpy(&value, msg->msg, sizeof(double));
+                } else {
+                    long double val;
+                    memcpy(&val, msg->msg, sizeof(val));
+                    f64 converted = f64(val);
+                    memcpy(&value, &converted, sizeof(converted));
+                    attributes.length_log2 = u32(ctu::log2(sizeof(f64)));
+                }
+                memcpy(dst, &attributes.all_bits, sizeof(u64));
+                memcpy(dst + sizeof(u64), &value, sizeof(value));
+                dst += sizeof(u64) + sizeof(f64);
+                msg->~float_data();
+                elem += sizeof(float_data);
+                break;
+            }
+        }
+    }
+
+    _record_count += 1;
+    _min_timepoint = std::min(_min_timepoint, line->timepoint);
+    _max_timepoint = std::max(_max_timepoint, line->timepoint);
+}
+
+void binary_log_writer::flush() {
+    if (_record_count == 0)
+        return;
+
+    block_header header{};
+    header.magic = BLOCK_MAGIC;
+    header.offset = _offset;
+    header.length = u32(_block_used);
+    header.record_count = _record_count;
+    header.min_timepoint = _min_timepoint;
+    header.max_timepoint = _max_timepoint;
+    memcpy(_block.get(), &header, sizeof(header));
+
+    if (_interval_open && _offset - _interval.block_offset >= _index_interval) {
+        close_interval();
+    }
+
+    if (_interval_open == false) {
+        _interval.block_offset = _offset;
+        _interval.min_timepoint = _min_timepoint;
+        _interval.max_timepoint = _max_timepoint;
+        _interval_open = true;
+    } else {
+        _interval.min_timepoint = std::min(_interval.min_timepoint, _min_timepoint);
+        _interval.max_timepoint = std::max(_interval.max_timepoint, _max_timepoint);
+    }
+
+    _out->write(_block.get(), _block_used);
+    _offset += _block_used;
+
+    _block_used = sizeof(block_header);
+    _record_count = 0;
+    _min_timepoint = ~u64(0);
+    _max_timepoint = 0;
+    put_clock();
+}
+
+void binary_log_writer::write_clock(const tsc_wall_clock& clock) {
+    _clock = clock_record{ clock.base_timepoint(), clock.base_wall_clock(), clock.multiplier(), clock.shift(), 0 };
+    _has_clock = true;
+
+    if (_record_count == 0) {
+        // no line uses the clock the block starts with yet, replace it
+        _block_used = sizeof(block_header);
+    } else if (_block_used + CLOCK_RECORD_LENGTH > _block_capacity) {
+        // the next block starts with the new clock
+        flush();
+        return;
+    }
+
+    put_clock();
+}
+
+// Appends the current clock to the block. Blocks always have room for it
+// right after they were started.
+void binary_log_writer::put_clock() {
+    if (_has_clock == false)
+        return;
+
+    char* dst = _block.get() + _block_used;
+    record_header header{ u32(CLOCK_RECORD_LENGTH), record_type::clock };
+    memcpy(dst, &header, sizeof(header));
+    memcpy(dst + sizeof(header), &_clock, sizeof(_clock));
+    _block_used += CLOCK_RECORD_LENGTH;
+}
+
+void binary_log_writer::close_interval() {
+    if (_interval_open == false)
+        return;
+
+    _interval_open = false;
+    if (_index == nullptr)
+        return;
+
+    record_header header{ u32(sizeof(record_header) + sizeof(index_entry)), record_type::index_entry };
+    _index->write(reinterpret_cast<const char*>(&header), sizeof(header));
+    _index->write(reinterpret_cast<const char*>(&_interval), sizeof(_interval));
+}
+
+} // namespace belog
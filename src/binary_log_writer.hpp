@@ -0,0 +1,86 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "best_effort_logger.hpp"
+#include "binary_log.hpp"
+#include "log_sink.hpp"
+#include "wall_clock.hpp"
+
+namespace belog {
+
+// Encodes lines in the binary format described in binary_log.hpp instead of
+// formatting them as text. Used by the logging thread when the output format
+// is output_format::binary.
+struct binary_log_writer {
+    static constexpr size_t DEFAULT_BLOCK_SIZE = size_t(1) << 16;
+    static constexpr size_t DEFAULT_INDEX_INTERVAL = size_t(1) << 20;
+
+    // index may be nullptr if no side index is wanted. start_timepoint is
+    // the tsc() value times in the output are relative to.
+    binary_log_writer(
+        output_buffer& out,
+        output_buffer* index,
+        u64 start_timepoint,
+        size_t block_size = DEFAULT_BLOCK_SIZE,
+        size_t index_interval = DEFAULT_INDEX_INTERVAL
+    );
+    ~binary_log_writer();
+
+    binary_log_writer(const binary_log_writer&) = delete;
+    binary_log_writer& operator=(const binary_log_writer&) = delete;
+
+    // Encodes a line taken from a thread buffer. Like the text formatters
+    // this destroys the segments of the line.
+    void write_line(u32 thread_id, const line_start_data* line, const char* elem);
+
+    // Lines written from now on are shown with the times clock maps them to.
+    void write_clock(const tsc_wall_clock& clock);
+
+    // Hands the current block to the output buffer, even if it is not full.
+    void flush();
+
+private:
+    void make_room(size_t length);
+    char* reserve(size_t length);
+    void write_callsite(const callsite* site, u32 id, size_t length);
+    void close_interval();
+    void put_clock();
+
+    output_buffer* _out;
+    output_buffer* _index;
+    size_t _block_size;
+    size_t _index_interval;
+
+    std::unique_ptr<char[]> _block;
+    size_t _block_capacity;
+    size_t _block_used;
+    u32 _record_count = 0;
+    u64 _min_timepoint = ~u64(0);
+    u64 _max_timepoint = 0;
+
+    // repeated at the start of every block once set
+    bool _has_clock = false;
+    binary::clock_record _clock{};
+
+    // bytes handed to _out so far
+    u64 _offset;
+
+    bool _interval_open = false;
+    binary::index_entry _interval{};
+
+    std::unordered_map<const callsite*, u32> _callsite_ids;
+
+    // Notes in place of strings left out of the current line and the text of
+    // user-defined types, already laid out as in the record. User-defined
+    // types are only formatted once, but the record size is needed before
+    // writing.
+    std::string _texts;
+
+    // user-defined types are formatted into this
+    memory_sink _formatted;
+    output_buffer _formatted_out{ _formatted };
+};
+
+} // namespace belog
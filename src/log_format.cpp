@@ -0,0 +1,971 @@
+#include "log_format.hpp"
+
+#include <algorithm>
+#include <cfloat>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include "bitmanip.hpp"
+#include "log_utils.hpp"
+
+namespace belog {
+
+static auto& DIGITS =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Both halves of every byte as hex digits, lowercase first.
+struct hex_pairs {
+    char digits[2][512];
+
+    constexpr hex_pairs() : digits() {
+        const char* bases[2] = { "0123456789abcdef", "0123456789ABCDEF" };
+        for (size_t uppercase = 0; uppercase < 2; uppercase += 1) {
+            for (size_t idx = 0; idx < 256; idx += 1) {
+                digits[uppercase][2 * idx] = bases[uppercase][idx >> 4];
+                digits[uppercase][2 * idx + 1] = bases[uppercase][idx & 0xF];
+            }
+        }
+    }
+};
+
+static constexpr hex_pairs HEX_PAIRS{};
+
+static constexpr u64 POWERS_OF_10[] = {
+    1ull, 10ull, 100ull, 1000ull, 10000ull,
+    100000ull, 1000000ull, 10000000ull, 100000000ull, 1000000000ull,
+    10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull, 100000000000000ull,
+    1000000000000000ull, 10000000000000000ull, 100000000000000000ull, 1000000000000000000ull, 10000000000000000000ull
+};
+
+static int decimal_digits(u64 val) {
+    // 1233 / 4096 is just above log10(2), which gets within one digit of
+    // the actual count. or-ing in 1 makes zero one digit long, it does not
+    // change the count of any other value.
+    val |= 1;
+    int approx = ((bitmanip::find_last_set(val) + 1) * 1233) >> 12;
+    return approx + (val >= POWERS_OF_10[approx] ? 1 : 0);
+}
+
+// Digits are produced eight at a time, packed into a word with the first
+// one in the lowest byte, so storing the word writes them in order. Like the
+// binary output, this assumes a little endian target.
+static u64 pack_pairs(const char* first, const char* second, const char* third, const char* fourth) {
+    u16 pairs[4];
+    memcpy(&pairs[0], first, 2);
+    memcpy(&pairs[1], second, 2);
+    memcpy(&pairs[2], third, 2);
+    memcpy(&pairs[3], fourth, 2);
+    return u64(pairs[0]) | (u64(pairs[1]) << 16) | (u64(pairs[2]) << 32) | (u64(pairs[3]) << 48);
+}
+
+// val < 10^8 as exactly 8 digits, without a table. val is split into two
+// halves of four digits, those into pairs and those into single digits, with
+// every step done on all parts at once in their own lanes of the word. The
+// multiplications stand in for division by 100 and 10, they are exact for
+// the values that can occur in a lane, which was checked for every val.
+static u64 decimal_word(u32 val) {
+    constexpr u64 PAIR_MASK = (u64(0x7F) << 32) | 0x7F;
+    constexpr u64 DIGIT_MASK = (u64(0xF) << 48) | (u64(0xF) << 32) | (u64(0xF) << 16) | 0xF;
+
+    u64 halves = u64(val / 10000) | (u64(val % 10000) << 32);
+    u64 hundreds = ((halves * 10486) >> 20) & PAIR_MASK;
+    u64 pairs = hundreds | ((halves - 100 * hundreds) << 16);
+    u64 tens = ((pairs * 103) >> 10) & DIGIT_MASK;
+    u64 digits = tens | ((pairs - 10 * tens) << 8);
+    return digits + 0x3030303030303030ull;
+}
+
+// the low 32 bits of val as exactly 8 hex digits
+static u64 hex_word(const char* table, u64 val) {
+    return pack_pairs(
+        &table[2 * ((val >> 24) & 0xFF)],
+        &table[2 * ((val >> 16) & 0xFF)],
+        &table[2 * ((val >> 8) & 0xFF)],
+        &table[2 * (val & 0xFF)]
+    );
+}
+
+// Output is formatted in place with stores of fixed size. Padding is filled
+// up to its largest possible length and digits are stored a word at a time,
+// anything stored past the end is overwritten by whatever comes next.
+static constexpr size_t INTEGER_RESERVE = 2 * integer_attributes::max_padded_length();
+static_assert(INTEGER_RESERVE <= output_buffer::MAX_RESERVE);
+
+// Writes digit_count digits from words, the first word holding the leading
+// ones, with an optional sign in front and padding on the side given by
+// attrs.
+template<typename stream>
+void write_padded(stream& out, integer_attributes attrs, char sign, const u64* words, size_t word_count, size_t digit_count) {
+    constexpr size_t MAX_PADDING = integer_attributes::max_padded_length();
+
+    size_t length = digit_count + (sign != 0 ? 1 : 0);
+    size_t padded_length = std::max(size_t(attrs.padded_length()), length);
+
+    char* dst = out.reserve(INTEGER_RESERVE);
+    if (dst == nullptr)
+        return;
+
+    char fill = char(attrs.padding_codepoint);
+    bool has_padding = padded_length > length;
+    char* pos = dst;
+    if (has_padding && attrs.is_left_aligned == false) {
+        memset(pos, fill, MAX_PADDING);
+        pos += padded_length - length;
+    }
+
+    *pos = sign;
+    pos += (sign != 0 ? 1 : 0);
+
+    size_t leading_digits = digit_count - 8 * (word_count - 1);
+    u64 leading = words[0] >> (8 * (8 - leading_digits));
+    memcpy(pos, &leading, sizeof(leading));
+    pos += leading_digits;
+    for (size_t idx = 1; idx < word_count; idx += 1) {
+        memcpy(pos, &words[idx], sizeof(words[idx]));
+        pos += sizeof(words[idx]);
+    }
+
+    if (has_padding && attrs.is_left_aligned) {
+        memset(pos, fill, MAX_PADDING);
+    }
+
+    out.advance(padded_length);
+}
+
+// The number of digits is known up front from the highest set bit, so no
+// branch depends on individual digits.
+template<typename stream, typename type>
+void log_integral_value(stream& out, integer_attributes attrs, type val) {
+    if (attrs.is_hex) {
+        // Negative values are shown in two's complement, values narrower
+        // than 32 bits as 32-bit values.
+        using hex_type = std::conditional_t<(sizeof(type) > sizeof(u32)), u64, u32>;
+        u64 bits = hex_type(val);
+        size_t digit_count = size_t(bitmanip::find_last_set(hex_type(bits)) / 4 + 1);
+
+        const char* table = HEX_PAIRS.digits[attrs.is_uppercase ? 1 : 0];
+        u64 words[2];
+        if (digit_count > 8) {
+            words[0] = hex_word(table, bits >> 32);
+            words[1] = hex_word(table, bits);
+            write_padded(out, attrs, 0, words, 2, digit_count);
+        } else {
+            words[0] = hex_word(table, bits);
+            write_padded(out, attrs, 0, words, 1, digit_count);
+        }
+    } else {
+        using unsigned_type = std::make_unsigned_t<type>;
+
+        unsigned_type abs_val;
+        if constexpr (std::is_same_v<type, unsigned_type>) {
+            abs_val = val;
+        } else if (val < 0) {
+            abs_val = unsigned_type(~val + 1);
+        } else {
+            abs_val = unsigned_type(val);
+        }
+
+        char sign = 0;
+        if (val < 0) {
+            sign = '-';
+        } else if (attrs.show_sign) {
+            sign = '+';
+        }
+
+        // up to 20 digits in blocks of 8, most significant first
+        constexpr u64 BLOCK = 100000000;
+        u64 value = abs_val;
+        u64 words[3];
+        if (value < 100) {
+            // small values are common enough to skip splitting them into
+            // lanes, the pair is moved to the end of the word like the last
+            // two of eight digits
+            u16 pair;
+            memcpy(&pair, &DIGITS[2 * value], sizeof(pair));
+            words[0] = u64(pair) << 48;
+            write_padded(out, attrs, sign, words, 1, value >= 10 ? 2 : 1);
+            return;
+        }
+
+        size_t digit_count = size_t(decimal_digits(value));
+        if (value < BLOCK) {
+            words[0] = decimal_word(u32(value));
+            write_padded(out, attrs, sign, words, 1, digit_count);
+        } else {
+            u64 high = value / BLOCK;
+            if (high < BLOCK) {
+                words[0] = decimal_word(u32(high));
+                words[1] = decimal_word(u32(value - high * BLOCK));
+                write_padded(out, attrs, sign, words, 2, digit_count);
+            } else {
+                u64 top = high / BLOCK;
+                words[0] = decimal_word(u32(top));
+                words[1] = decimal_word(u32(high - top * BLOCK));
+                words[2] = decimal_word(u32(value - high * BLOCK));
+                write_padded(out, attrs, sign, words, 3, digit_count);
+            }
+        }
+    }
+}
+
+// Floating point values with a precision, and long double where it is wider
+// than double, are left to snprintf. The precision mask means no precision
+// was given.
+template<typename type>
+void log_float_printf(output_buffer& out, float_attributes attrs, type val) {
+    size_t idx = 0;
+    char format[16];
+    format[idx++] = '%';
+
+    if (attrs.sign_handling == FLOAT_SIGN_SHOW_ALWAYS) {
+        format[idx++] = '+';
+    } else if (attrs.sign_handling == FLOAT_SIGN_PAD_IF_POSITIVE) {
+        format[idx++] = ' ';
+    }
+
+    if (attrs.always_show_decimal_point) {
+        format[idx++] = '#';
+    }
+
+    if (attrs.precision != attrs.precision.mask) {
+        format[idx++] = '.';
+        if (attrs.precision >= 10) {
+            format[idx++] = DIGITS[attrs.precision * 2];
+        }
+        format[idx++] = DIGITS[attrs.precision * 2 + 1];
+    }
+
+    if constexpr (std::is_same_v<type, long double>) {
+        format[idx++] = 'L';
+    }
+
+    static auto& display_map = "fFeEaAgG";
+    format[idx++] = display_map[attrs.display_style * 2 + attrs.is_uppercase];
+    format[idx] = 0;
+
+    char* dst = out.reserve(output_buffer::MAX_RESERVE);
+    if (dst == nullptr)
+        return;
+
+    int len = snprintf(dst, output_buffer::MAX_RESERVE, format, val);
+    if (len > 0) {
+        out.advance(std::min(size_t(len), output_buffer::MAX_RESERVE - 1));
+    }
+}
+
+// Without a precision, values are shown with the fewest digits that read
+// back as the same value. The digits are found with Grisu2, as described in
+// Loitsch, "Printing Floating-Point Numbers Quickly and Accurately with
+// Integers". Its digits always read back correctly, in rare cases there is
+// one more of them than necessary.
+
+// f * 2^e
+struct diy_fp {
+    u64 f;
+    int e;
+};
+
+// x * y, rounded to the upper 64 bits of the product
+static diy_fp multiply(diy_fp x, diy_fp y) {
+    u64 x_lo = x.f & 0xFFFFFFFF;
+    u64 x_hi = x.f >> 32;
+    u64 y_lo = y.f & 0xFFFFFFFF;
+    u64 y_hi = y.f >> 32;
+
+    u64 lo_lo = x_lo * y_lo;
+    u64 lo_hi = x_lo * y_hi;
+    u64 hi_lo = x_hi * y_lo;
+    u64 hi_hi = x_hi * y_hi;
+
+    u64 middle = (lo_lo >> 32) + (lo_hi & 0xFFFFFFFF) + (hi_lo & 0xFFFFFFFF) + (u64(1) << 31);
+    return { hi_hi + (lo_hi >> 32) + (hi_lo >> 32) + (middle >> 32), x.e + y.e + 64 };
+}
+
+static diy_fp normalize(diy_fp x) {
+    int shift = 63 - bitmanip::find_last_set(x.f);
+    return { x.f << shift, x.e - shift };
+}
+
+// A value and the points halfway to its neighbours, which bound the digits
+// reading back as the value. lower and upper share an exponent.
+struct float_boundaries {
+    diy_fp value;
+    diy_fp lower;
+    diy_fp upper;
+};
+
+// val has to be finite and larger than zero.
+template<typename type>
+static float_boundaries compute_boundaries(type val) {
+    // digits includes the implicit leading bit
+    constexpr int MANTISSA_BITS = std::numeric_limits<type>::digits;
+    constexpr int BIAS = std::numeric_limits<type>::max_exponent - 1 + (MANTISSA_BITS - 1);
+    constexpr int MIN_EXPONENT = 1 - BIAS;
+    constexpr u64 HIDDEN_BIT = u64(1) << (MANTISSA_BITS - 1);
+
+    using bits_type = std::conditional_t<sizeof(type) == sizeof(u32), u32, u64>;
+    bits_type bits;
+    memcpy(&bits, &val, sizeof(bits));
+
+    u64 biased_exponent = bits >> (MANTISSA_BITS - 1);
+    u64 fraction = bits & (HIDDEN_BIT - 1);
+
+    diy_fp value;
+    if (biased_exponent == 0) {
+        value = { fraction, MIN_EXPONENT };
+    } else {
+        value = { fraction + HIDDEN_BIT, int(biased_exponent) - BIAS };
+    }
+
+    // Powers of two are closer to the next lower value than to the next
+    // higher one.
+    bool lower_is_closer = fraction == 0 && biased_exponent > 1;
+    diy_fp upper = normalize({ 2 * value.f + 1, value.e - 1 });
+    diy_fp lower = lower_is_closer ? diy_fp{ 4 * value.f - 1, value.e - 2 } : diy_fp{ 2 * value.f - 1, value.e - 1 };
+    lower = { lower.f << (lower.e - upper.e), upper.e };
+
+    return { normalize(value), lower, upper };
+}
+
+// f * 2^e, the closest approximation of 10^k
+struct cached_power {
+    u64 f;
+    int e;
+    int k;
+};
+
+// 10^k for every eighth k from -300 to 324, enough to scale any double
+// into the range digits are generated from.
+static constexpr int CACHED_POWERS_MIN_K = -300;
+static constexpr int CACHED_POWERS_STEP = 8;
+static constexpr cached_power CACHED_POWERS[] = {
+    { 0xAB70FE17C79AC6CA, -1060, -300 },
+    { 0xFF77B1FCBEBCDC4F, -1034, -292 },
+    { 0xBE5691EF416BD60C, -1007, -284 },
+    { 0x8DD01FAD907FFC3C,  -980, -276 },
+    { 0xD3515C2831559A83,  -954, -268 },
+    { 0x9D71AC8FADA6C9B5,  -927, -260 },
+    { 0xEA9C227723EE8BCB,  -901, -252 },
+    { 0xAECC49914078536D,  -874, -244 },
+    { 0x823C12795DB6CE57,  -847, -236 },
+    { 0xC21094364DFB5637,  -821, -228 },
+    { 0x9096EA6F3848984F,  -794, -220 },
+    { 0xD77485CB25823AC7,  -768, -212 },
+    { 0xA086CFCD97BF97F4,  -741, -204 },
+    { 0xEF340A98172AACE5,  -715, -196 },
+    { 0xB23867FB2A35B28E,  -688, -188 },
+    { 0x84C8D4DFD2C63F3B,  -661, -180 },
+    { 0xC5DD44271AD3CDBA,  -635, -172 },
+    { 0x936B9FCEBB25C996,  -608, -164 },
+    { 0xDBAC6C247D62A584,  -582, -156 },
+    { 0xA3AB66580D5FDAF6,  -555, -148 },
+    { 0xF3E2F893DEC3F126,  -529, -140 },
+    { 0xB5B5ADA8AAFF80B8,  -502, -132 },
+    { 0x87625F056C7C4A8B,  -475, -124 },
+    { 0xC9BCFF6034C13053,  -449, -116 },
+    { 0x964E858C91BA2655,  -422, -108 },
+    { 0xDFF9772470297EBD,  -396, -100 },
+    { 0xA6DFBD9FB8E5B88F,  -369,  -92 },
+    { 0xF8A95FCF88747D94,  -343,  -84 },
+    { 0xB94470938FA89BCF,  -316,  -76 },
+    { 0x8A08F0F8BF0F156B,  -289,  -68 },
+    { 0xCDB02555653131B6,  -263,  -60 },
+    { 0x993FE2C6D07B7FAC,  -236,  -52 },
+    { 0xE45C10C42A2B3B06,  -210,  -44 },
+    { 0xAA242499697392D3,  -183,  -36 },
+    { 0xFD87B5F28300CA0E,  -157,  -28 },
+    { 0xBCE5086492111AEB,  -130,  -20 },
+    { 0x8CBCCC096F5088CC,  -103,  -12 },
+    { 0xD1B71758E219652C,   -77,   -4 },
+    { 0x9C40000000000000,   -50,    4 },
+    { 0xE8D4A51000000000,   -24,   12 },
+    { 0xAD78EBC5AC620000,     3,   20 },
+    { 0x813F3978F8940984,    30,   28 },
+    { 0xC097CE7BC90715B3,    56,   36 },
+    { 0x8F7E32CE7BEA5C70,    83,   44 },
+    { 0xD5D238A4ABE98068,   109,   52 },
+    { 0x9F4F2726179A2245,   136,   60 },
+    { 0xED63A231D4C4FB27,   162,   68 },
+    { 0xB0DE65388CC8ADA8,   189,   76 },
+    { 0x83C7088E1AAB65DB,   216,   84 },
+    { 0xC45D1DF942711D9A,   242,   92 },
+    { 0x924D692CA61BE758,   269,  100 },
+    { 0xDA01EE641A708DEA,   295,  108 },
+    { 0xA26DA3999AEF774A,   322,  116 },
+    { 0xF209787BB47D6B85,   348,  124 },
+    { 0xB454E4A179DD1877,   375,  132 },
+    { 0x865B86925B9BC5C2,   402,  140 },
+    { 0xC83553C5C8965D3D,   428,  148 },
+    { 0x952AB45CFA97A0B3,   455,  156 },
+    { 0xDE469FBD99A05FE3,   481,  164 },
+    { 0xA59BC234DB398C25,   508,  172 },
+    { 0xF6C69A72A3989F5C,   534,  180 },
+    { 0xB7DCBF5354E9BECE,   561,  188 },
+    { 0x88FCF317F22241E2,   588,  196 },
+    { 0xCC20CE9BD35C78A5,   614,  204 },
+    { 0x98165AF37B2153DF,   641,  212 },
+    { 0xE2A0B5DC971F303A,   667,  220 },
+    { 0xA8D9D1535CE3B396,   694,  228 },
+    { 0xFB9B7CD9A4A7443C,   720,  236 },
+    { 0xBB764C4CA7A44410,   747,  244 },
+    { 0x8BAB8EEFB6409C1A,   774,  252 },
+    { 0xD01FEF10A657842C,   800,  260 },
+    { 0x9B10A4E5E9913129,   827,  268 },
+    { 0xE7109BFBA19C0C9D,   853,  276 },
+    { 0xAC2820D9623BF429,   880,  284 },
+    { 0x80444B5E7AA7CF85,   907,  292 },
+    { 0xBF21E44003ACDD2D,   933,  300 },
+    { 0x8E679C2F5E44FF8F,   960,  308 },
+    { 0xD433179D9C8CB841,   986,  316 },
+    { 0x9E19DB92B4E31BA9,  1013,  324 },
+};
+
+// Scaled values have a binary exponent in [ALPHA, GAMMA], so their integral
+// part fits into 32 bits and their fraction into 60.
+static constexpr int ALPHA = -60;
+static constexpr int GAMMA = -32;
+
+// The cached power 10^-k scaling values with binary exponent e into range.
+static cached_power cached_power_for(int e) {
+    // 78913 / 2^18 is just below log10(2)
+    int f = ALPHA - e - 1;
+    int k = (f * 78913) / (1 << 18) + (f > 0 ? 1 : 0);
+    size_t idx = size_t((k - CACHED_POWERS_MIN_K + (CACHED_POWERS_STEP - 1)) / CACHED_POWERS_STEP);
+    return CACHED_POWERS[idx];
+}
+
+// Moves the last digit closer to the exact value while the result stays
+// within the bounds.
+static void round_last_digit(char* digits, int count, u64 distance, u64 delta, u64 rest, u64 ten_k) {
+    while (rest < distance
+        && delta - rest >= ten_k
+        && (rest + ten_k < distance || distance - rest > rest + ten_k - distance)) {
+        digits[count - 1] -= 1;
+        rest += ten_k;
+    }
+}
+
+// Digits between lower and upper, as close to value as Grisu2 gets. All
+// three have the same exponent in [ALPHA, GAMMA]. Returns the number of
+// digits, exponent is adjusted by the position of the last one.
+static int generate_digits(char* digits, int& exponent, diy_fp lower, diy_fp value, diy_fp upper) {
+    u64 delta = upper.f - lower.f;
+    u64 distance = upper.f - value.f;
+
+    // one as a diy_fp with the exponent of upper
+    u64 one = u64(1) << -upper.e;
+    u32 integral = u32(upper.f >> -upper.e);
+    u64 fraction = upper.f & (one - 1);
+
+    int count = 0;
+    int remaining = decimal_digits(integral);
+    while (remaining > 0) {
+        u32 power = u32(POWERS_OF_10[remaining - 1]);
+        u32 digit = integral / power;
+        integral -= digit * power;
+        digits[count++] = char('0' + digit);
+        remaining -= 1;
+
+        u64 rest = (u64(integral) << -upper.e) + fraction;
+        if (rest <= delta) {
+            exponent += remaining;
+            round_last_digit(digits, count, distance, delta, rest, u64(power) << -upper.e);
+            return count;
+        }
+    }
+
+    // the integral part alone is not close enough, go on with the fraction
+    int fraction_digits = 0;
+    for (;;) {
+        fraction *= 10;
+        digits[count++] = char('0' + (fraction >> -upper.e));
+        fraction &= one - 1;
+        fraction_digits += 1;
+        delta *= 10;
+        distance *= 10;
+        if (fraction <= delta)
+            break;
+    }
+
+    exponent -= fraction_digits;
+    round_last_digit(digits, count, distance, delta, fraction, one);
+    return count;
+}
+
+// The fewest digits of val > 0, val is about digits * 10^exponent. Writes
+// at most 17 digits and returns their count.
+template<typename type>
+static int shortest_digits(type val, char* digits, int& exponent) {
+    float_boundaries bounds = compute_boundaries(val);
+    cached_power power = cached_power_for(bounds.upper.e);
+    diy_fp scale{ power.f, power.e };
+
+    diy_fp value = multiply(bounds.value, scale);
+    diy_fp lower = multiply(bounds.lower, scale);
+    diy_fp upper = multiply(bounds.upper, scale);
+
+    // the products may be off by one, which could move them out of bounds
+    lower.f += 1;
+    upper.f -= 1;
+
+    exponent = -power.k;
+    return generate_digits(digits, exponent, lower, value, upper);
+}
+
+// The longest output is that of the smallest subnormal double in plain
+// style, a sign, "0.", 323 zeros and one digit.
+static constexpr size_t FLOAT_RESERVE = 330;
+static_assert(FLOAT_RESERVE <= output_buffer::MAX_RESERVE);
+
+// Decimal exponent of scientific style, a sign and at least two digits.
+static char* write_exponent(char* pos, int exponent) {
+    *pos++ = exponent < 0 ? '-' : '+';
+    u32 abs_exponent = u32(exponent < 0 ? -exponent : exponent);
+    if (abs_exponent >= 100) {
+        *pos++ = char('0' + abs_exponent / 100);
+        abs_exponent %= 100;
+    }
+    memcpy(pos, &DIGITS[2 * abs_exponent], 2);
+    return pos + 2;
+}
+
+// digits * 10^exponent without an exponent.
+static char* write_plain(char* pos, const char* digits, int count, int exponent, bool show_point) {
+    int point = count + exponent;
+    if (exponent >= 0) {
+        memcpy(pos, digits, size_t(count));
+        pos += count;
+        memset(pos, '0', size_t(exponent));
+        pos += exponent;
+        if (show_point) {
+            *pos++ = '.';
+        }
+    } else if (point > 0) {
+        memcpy(pos, digits, size_t(point));
+        pos += point;
+        *pos++ = '.';
+        memcpy(pos, digits + point, size_t(count - point));
+        pos += count - point;
+    } else {
+        *pos++ = '0';
+        *pos++ = '.';
+        memset(pos, '0', size_t(-point));
+        pos += -point;
+        memcpy(pos, digits, size_t(count));
+        pos += count;
+    }
+    return pos;
+}
+
+// digits * 10^exponent with one digit before the point.
+static char* write_scientific(char* pos, const char* digits, int count, int exponent, bool show_point, bool uppercase) {
+    *pos++ = digits[0];
+    if (count > 1 || show_point) {
+        *pos++ = '.';
+    }
+    memcpy(pos, digits + 1, size_t(count - 1));
+    pos += count - 1;
+    *pos++ = uppercase ? 'E' : 'e';
+    return write_exponent(pos, exponent + count - 1);
+}
+
+// The exact value as a hex fraction and a binary exponent, like %a. Leading
+// digits are 1, or 0 for zero and subnormal values.
+static char* write_hex(char* pos, f64 val, bool show_point, bool uppercase) {
+    constexpr int FRACTION_BITS = DBL_MANT_DIG - 1;
+    constexpr int BIAS = DBL_MAX_EXP - 1;
+
+    u64 bits;
+    memcpy(&bits, &val, sizeof(bits));
+    int biased_exponent = int((bits >> FRACTION_BITS) & 0x7FF);
+    u64 fraction = bits & ((u64(1) << FRACTION_BITS) - 1);
+
+    int exponent = 0;
+    if (biased_exponent != 0) {
+        exponent = biased_exponent - BIAS;
+    } else if (fraction != 0) {
+        exponent = 1 - BIAS;
+    }
+
+    *pos++ = '0';
+    *pos++ = uppercase ? 'X' : 'x';
+    *pos++ = biased_exponent != 0 ? '1' : '0';
+
+    if (fraction != 0 || show_point) {
+        *pos++ = '.';
+    }
+    if (fraction != 0) {
+        // 52 bits make 13 digits, trailing zeros are left out
+        int count = 13;
+        while (((fraction >> (4 * (13 - count))) & 0xF) == 0) {
+            count -= 1;
+        }
+        const char* base = uppercase ? "0123456789ABCDEF" : "0123456789abcdef";
+        for (int idx = 0; idx < count; idx += 1) {
+            *pos++ = base[(fraction >> (FRACTION_BITS - 4 * (idx + 1))) & 0xF];
+        }
+    }
+
+    *pos++ = uppercase ? 'P' : 'p';
+    *pos++ = exponent < 0 ? '-' : '+';
+    u32 abs_exponent = u32(exponent < 0 ? -exponent : exponent);
+    int exponent_digits = decimal_digits(abs_exponent);
+    for (int idx = exponent_digits - 1; idx >= 0; idx -= 1) {
+        pos[idx] = char('0' + abs_exponent % 10);
+        abs_exponent /= 10;
+    }
+    return pos + exponent_digits;
+}
+
+template<typename type>
+void log_float_value(output_buffer& out, float_attributes attrs, type val) {
+    if constexpr (std::numeric_limits<type>::digits > DBL_MANT_DIG) {
+        log_float_printf(out, attrs, val);
+        return;
+    } else {
+        if (attrs.precision != attrs.precision.mask) {
+            log_float_printf(out, attrs, val);
+            return;
+        }
+
+        // long double with the layout of double is formatted as double
+        using format_type = std::conditional_t<std::is_same_v<type, float>, float, f64>;
+        format_type value = format_type(val);
+
+        char* dst = out.reserve(FLOAT_RESERVE);
+        if (dst == nullptr)
+            return;
+
+        char* pos = dst;
+        bool is_negative = std::signbit(value);
+        if (is_negative) {
+            *pos++ = '-';
+            value = -value;
+        } else if (attrs.sign_handling == FLOAT_SIGN_SHOW_ALWAYS) {
+            *pos++ = '+';
+        } else if (attrs.sign_handling == FLOAT_SIGN_PAD_IF_POSITIVE) {
+            *pos++ = ' ';
+        }
+
+        bool uppercase = attrs.is_uppercase;
+        bool show_point = attrs.always_show_decimal_point;
+        if (std::isnan(value) || std::isinf(value)) {
+            const char* text = std::isnan(value) ? (uppercase ? "NAN" : "nan") : (uppercase ? "INF" : "inf");
+            memcpy(pos, text, 3);
+            out.advance(size_t(pos - dst) + 3);
+            return;
+        }
+
+        if (attrs.display_style == FLOAT_DISPLAY_HEXADECIMAL) {
+            pos = write_hex(pos, f64(value), show_point, uppercase);
+            out.advance(size_t(pos - dst));
+            return;
+        }
+
+        char digits[20];
+        int count = 1;
+        int exponent = 0;
+        if (value == 0) {
+            digits[0] = '0';
+        } else {
+            count = shortest_digits(value, digits, exponent);
+        }
+
+        bool is_plain = attrs.display_style == FLOAT_DISPLAY_PLAIN;
+        if (attrs.display_style == FLOAT_DISPLAY_ADAPTIVE) {
+            // whichever style is shorter, plain if both are the same length
+            int point = count + exponent;
+            int plain_length = std::max(point, count) + (point < count || show_point ? 1 : 0) + (point <= 0 ? 1 - point : 0);
+            int scientific_exponent = point - 1;
+            int exponent_length = scientific_exponent >= 100 || scientific_exponent <= -100 ? 3 : 2;
+            int scientific_length = count + (count > 1 || show_point ? 1 : 0) + 2 + exponent_length;
+            is_plain = plain_length <= scientific_length;
+        }
+
+        if (is_plain) {
+            pos = write_plain(pos, digits, count, exponent, show_point);
+        } else {
+            pos = write_scientific(pos, digits, count, exponent, show_point, uppercase);
+        }
+        out.advance(size_t(pos - dst));
+    }
+}
+
+void format_integer(output_buffer& out, integer_attributes attributes, const char* value) {
+    switch (attributes.length_log2) {
+#if CHAR_MAX < SHRT_MAX
+        case ctu::log2(sizeof(char)):
+            if (attributes.is_unsigned) {
+                unsigned char val;
+                memcpy(&val, value, sizeof(val));
+                log_integral_value(out, attributes, val);
+            } else {
+                signed char val;
+                memcpy(&val, value, sizeof(val));
+                log_integral_value(out, attributes, val);
+            }
+            break;
+#endif
+
+#if SHRT_MAX < INT_MAX
+        case ctu::log2(sizeof(short)):
+            if (attributes.is_unsigned) {
+                unsigned short val;
+                memcpy(&val, value, sizeof(val));
+                log_integral_value(out, attributes, val);
+            } else {
+                signed short val;
+                memcpy(&val, value, sizeof(val));
+                log_integral_value(out, attributes, val);
+            }
+            break;
+#endif
+
+#if INT_MAX < LONG_MAX
+        case ctu::log2(sizeof(int)):
+            if (attributes.is_unsigned) {
+                unsigned int val;
+                memcpy(&val, value, sizeof(val));
+                log_integral_value(out, attributes, val);
+            } else {
+                signed int val;
+                memcpy(&val, value, sizeof(val));
+                log_integral_value(out, attributes, val);
+            }
+            break;
+#endif
+
+#if LONG_MAX < LLONG_MAX
+        case ctu::log2(sizeof(long)):
+            if (attributes.is_unsigned) {
+                unsigned long val;
+                memcpy(&val, value, sizeof(val));
+                log_integral_value(out, attributes, val);
+            } else {
+                signed long val;
+                memcpy(&val, value, sizeof(val));
+                log_integral_value(out, attributes, val);
+            }
+            break;
+#endif
+
+        case ctu::log2(sizeof(long long)):
+            if (attributes.is_unsigned) {
+                unsigned long long val;
+                memcpy(&val, value, sizeof(val));
+                log_integral_value(out, attributes, val);
+            } else {
+                signed long long val;
+                memcpy(&val, value, sizeof(val));
+                log_integral_value(out, attributes, val);
+            }
+            break;
+    }
+}
+
+void format_float(output_buffer& out, float_attributes attributes, const char* value) {
+    switch (attributes.length_log2) {
+#if FLT_MANT_DIG < DBL_MANT_DIG
+        case ctu::log2(sizeof(float)):
+        {
+            float val;
+            memcpy(&val, value, sizeof(val));
+            log_float_value(out, attributes, val);
+            break;
+        }
+#endif
+
+#if DBL_MANT_DIG < LDBL_MANT_DIG
+        case ctu::log2(sizeof(double)):
+        {
+            double val;
+            memcpy(&val, value, sizeof(val));
+            log_float_value(out, attributes, val);
+            break;
+        }
+#endif
+
+        case ctu::log2(sizeof(long double)):
+        {
+            long double val;
+            memcpy(&val, value, sizeof(val));
+            log_float_value(out, attributes, val);
+            break;
+        }
+    }
+}
+
+size_t log_integer(const integer_data* msg, output_buffer& out) {
+    format_integer(out, msg->attributes, msg->msg);
+    msg->~integer_data();
+    return sizeof(integer_data);
+}
+
+size_t log_float(const float_data* msg, output_buffer& out) {
+    format_float(out, msg->attributes, msg->msg);
+    msg->~float_data();
+    return sizeof(float_data);
+}
+
+size_t log_inline_string(const inline_string_data* msg, output_buffer& out) {
+    take_inline_string(msg, [&out](const char* text, size_t length) {
+        out.write(text, length);
+    });
+    return msg->size();
+}
+
+void formatter<detail::suppressed_lines>::format(const detail::suppressed_lines& value, output_buffer& out) {
+    if (value.count == 0)
+        return;
+
+    static constexpr char prefix[] = " (";
+    static constexpr char suffix[] = " lines suppressed)";
+    out.write(prefix, sizeof(prefix) - 1);
+    format_value(out, value.count);
+    out.write(suffix, sizeof(suffix) - 1);
+}
+
+size_t log_string_literal(const string_literal_data* msg, output_buffer& out) {
+    if (msg->length == msg->UNKNOWN_LENGTH) {
+        out.write(msg->address, std::strlen(msg->address));
+    } else {
+        out.write(msg->address, msg->length - 1);
+    }
+    msg->~string_literal_data();
+    return sizeof(string_literal_data);
+}
+
+static const char LEVEL_TAGS[] = { 'D', 'I', 'W', 'E' };
+
+void format_line_header(output_buffer& out, u32 thread_id, f64 seconds, level severity, const char* file, u32 line) {
+    char* header = out.reserve(output_buffer::MAX_RESERVE);
+    if (header == nullptr)
+        return;
+
+    int len = snprintf(
+        header, output_buffer::MAX_RESERVE, "\n[%u] %13.6f: [%c] (%s:%u) ",
+        thread_id, seconds, LEVEL_TAGS[u8(severity)], file, line
+    );
+    if (len > 0) {
+        out.advance(std::min(size_t(len), output_buffer::MAX_RESERVE - 1));
+    }
+}
+
+// Writes val at pos and returns the end of its digits. Up to eight bytes
+// past the end are overwritten.
+static char* write_decimal(char* pos, u32 val) {
+    constexpr u32 BLOCK = 100000000;
+
+    size_t count = size_t(decimal_digits(val));
+    if (count > 8) {
+        u32 high = val / BLOCK;
+        memcpy(pos, &DIGITS[2 * high + (high < 10 ? 1 : 0)], count - 8);
+        u64 word = decimal_word(val - high * BLOCK);
+        memcpy(pos + count - 8, &word, sizeof(word));
+    } else {
+        u64 word = decimal_word(val) >> (8 * (8 - count));
+        memcpy(pos, &word, sizeof(word));
+    }
+    return pos + count;
+}
+
+// "YYYY-MM-DDTHH:MM:SS." for second since 1970-01-01 UTC, with the date
+// found as in Hinnant, "chrono-Compatible Low-Level Date Algorithms".
+static void format_date_time(timestamp_cache& cache, i64 second) {
+    constexpr i64 SECONDS_PER_DAY = 86400;
+
+    i64 days = second / SECONDS_PER_DAY;
+    i64 second_of_day = second % SECONDS_PER_DAY;
+    if (second_of_day < 0) {
+        days -= 1;
+        second_of_day += SECONDS_PER_DAY;
+    }
+
+    // days since 0000-03-01, in eras of 400 years
+    days += 719468;
+    i64 era = (days >= 0 ? days : days - 146096) / 146097;
+    i64 day_of_era = days - era * 146097;
+    i64 year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    i64 day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    // months starting in March
+    i64 shifted_month = (5 * day_of_year + 2) / 153;
+    i64 day = day_of_year - (153 * shifted_month + 2) / 5 + 1;
+    i64 month = shifted_month < 10 ? shifted_month + 3 : shifted_month - 9;
+    i64 year = std::clamp(year_of_era + era * 400 + (month <= 2 ? 1 : 0), i64(0), i64(9999));
+
+    char* pos = cache.prefix;
+    memcpy(pos, &DIGITS[2 * (year / 100)], 2);
+    memcpy(pos + 2, &DIGITS[2 * (year % 100)], 2);
+    pos[4] = '-';
+    memcpy(pos + 5, &DIGITS[2 * month], 2);
+    pos[7] = '-';
+    memcpy(pos + 8, &DIGITS[2 * day], 2);
+    pos[10] = 'T';
+    memcpy(pos + 11, &DIGITS[2 * (second_of_day / 3600)], 2);
+    pos[13] = ':';
+    memcpy(pos + 14, &DIGITS[2 * (second_of_day / 60 % 60)], 2);
+    pos[16] = ':';
+    memcpy(pos + 17, &DIGITS[2 * (second_of_day % 60)], 2);
+    pos[19] = '.';
+
+    cache.second = second;
+}
+
+// Room for everything but the file name, including the bytes stored past
+// the end of the line number.
+static constexpr size_t WALL_CLOCK_HEADER_RESERVE = 80;
+
+void format_line_header(output_buffer& out, timestamp_cache& cache, u32 thread_id, i64 wall_clock, level severity, const char* file, u32 line) {
+    constexpr i64 NANOSECONDS_PER_SECOND = 1000000000;
+
+    char* header = out.reserve(output_buffer::MAX_RESERVE);
+    if (header == nullptr)
+        return;
+
+    i64 second = wall_clock / NANOSECONDS_PER_SECOND;
+    i64 nanoseconds = wall_clock % NANOSECONDS_PER_SECOND;
+    if (nanoseconds < 0) {
+        second -= 1;
+        nanoseconds += NANOSECONDS_PER_SECOND;
+    }
+    if (second != cache.second) {
+        format_date_time(cache, second);
+    }
+
+    char* pos = header;
+    memcpy(pos, "\n[", 2);
+    pos = write_decimal(pos + 2, thread_id);
+    memcpy(pos, "] ", 2);
+    pos += 2;
+
+    memcpy(pos, cache.prefix, sizeof(cache.prefix));
+    pos += sizeof(cache.prefix);
+    *pos = char('0' + nanoseconds / 100000000);
+    u64 fraction = decimal_word(u32(nanoseconds % 100000000));
+    memcpy(pos + 1, &fraction, sizeof(fraction));
+    pos += 9;
+
+    memcpy(pos, "Z [", 3);
+    pos[3] = LEVEL_TAGS[u8(severity)];
+    memcpy(pos + 4, "] (", 3);
+    pos += 7;
+
+    size_t file_length = std::min(std::strlen(file), output_buffer::MAX_RESERVE - WALL_CLOCK_HEADER_RESERVE);
+    memcpy(pos, file, file_length);
+    pos += file_length;
+    *pos++ = ':';
+    pos = write_decimal(pos, line);
+    memcpy(pos, ") ", 2);
+    pos += 2;
+
+    out.advance(size_t(pos - header));
+}
+
+} // namespace belog
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include "best_effort_logger.hpp"
+#include "log_sink.hpp"
+
+namespace belog {
+
+// Text formatting shared by the logging thread and offline tools. Values are
+// passed as the raw bytes stored by integer_data and float_data.
+
+void format_integer(output_buffer& out, integer_attributes attributes, const char* value);
+void format_float(output_buffer& out, float_attributes attributes, const char* value);
+
+// Format numbers the way log() does, for formatter<type>::format(). Numbers
+// passed through fmt() keep their attributes.
+inline void format_value(output_buffer& out, const integer_data& value) {
+    format_integer(out, value.attributes, value.msg);
+}
+
+inline void format_value(output_buffer& out, const float_data& value) {
+    format_float(out, value.attributes, value.msg);
+}
+
+template<typename type>
+std::enable_if_t<std::is_arithmetic_v<type> && !std::is_same_v<type, bool>>
+format_value(output_buffer& out, type value) {
+    if constexpr (std::is_floating_point_v<type>) {
+        format_value(out, float_data(value));
+    } else {
+        format_value(out, integer_data(value));
+    }
+}
+
+// Passes the text of a string segment to write(const char*, size_t), or a
+// note in its place if it was left out.
+template<typename write_type>
+void take_inline_string(const inline_string_data* msg, write_type&& write) {
+    switch (msg->placement) {
+        case inline_string_data::in_line:
+            write(msg->text(), size_t(msg->length));
+            break;
+
+        case inline_string_data::left_out:
+        {
+            char text[48];
+            int length = snprintf(text, sizeof(text), "<%u bytes left out>", unsigned(msg->length));
+            write(text, size_t(length));
+            break;
+        }
+    }
+}
+
+// "\n[thread_id] seconds: [L] (file:line) "
+void format_line_header(output_buffer& out, u32 thread_id, f64 seconds, level severity, const char* file, u32 line);
+
+// The date and time of day of the last wall clock time formatted, lines
+// within the same second only have their fraction of a second formatted.
+struct timestamp_cache {
+    i64 second = INT64_MIN;
+    // "YYYY-MM-DDTHH:MM:SS."
+    char prefix[20] = {};
+};
+
+// "\n[thread_id] YYYY-MM-DDTHH:MM:SS.nnnnnnnnnZ [L] (file:line) ", with
+// wall_clock in nanoseconds since 1970-01-01 UTC.
+void format_line_header(output_buffer& out, timestamp_cache& cache, u32 thread_id, i64 wall_clock, level severity, const char* file, u32 line);
+
+} // namespace belog
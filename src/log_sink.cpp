@@ -0,0 +1,114 @@
+#include "log_sink.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+
+#if defined(_MSC_VER)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace belog {
+
+bool write_fully(int fd, const char* data, size_t length) {
+    while (length > 0) {
+#if defined(_MSC_VER)
+        // _write takes an unsigned int count
+        auto chunk = unsigned(std::min(length, size_t(1) << 30));
+        auto written = _write(fd, data, chunk);
+#else
+        auto written = ::write(fd, data, length);
+#endif
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        data += written;
+        length -= size_t(written);
+    }
+
+    return true;
+}
+
+int stdout_fd() {
+#if defined(_MSC_VER)
+    return _fileno(stdout);
+#else
+    return fileno(stdout);
+#endif
+}
+
+fd_sink::fd_sink(int fd, size_t capacity) :
+    _fd(fd),
+    _capacity(capacity),
+    _buffer(static_cast<char*>(aligned_alloc(64, capacity)))
+{}
+
+char* fd_sink::acquire(size_t min_capacity, size_t& capacity) {
+    if (_buffer == nullptr || min_capacity > _capacity)
+        return nullptr;
+
+    capacity = _capacity;
+    return _buffer.get();
+}
+
+bool fd_sink::commit(char* region, size_t length) {
+    return write_fully(_fd, region, length);
+}
+
+memory_sink::memory_sink(size_t capacity) :
+    _data(new char[capacity]),
+    _capacity(capacity)
+{}
+
+char* memory_sink::acquire(size_t min_capacity, size_t& capacity) {
+    // always hand out at least half of the current capacity to keep the
+    // number of regions per batch low
+    if (_capacity - _size < std::max(min_capacity, _capacity / 2)) {
+        size_t new_capacity = std::max(2 * _capacity, _size + min_capacity);
+        std::unique_ptr<char[]> data(new char[new_capacity]);
+        memcpy(data.get(), _data.get(), _size);
+        _data = std::move(data);
+        _capacity = new_capacity;
+    }
+
+    capacity = _capacity - _size;
+    return _data.get() + _size;
+}
+
+bool memory_sink::commit(char* region, size_t length) {
+    if (region != _data.get() + _size)
+        return false;
+
+    _size += length;
+    return true;
+}
+
+bool output_buffer::next_region(size_t min_capacity) {
+    bool result = true;
+    if (_begin != nullptr) {
+        result = _sink->commit(_begin, pending());
+    }
+
+    size_t capacity = 0;
+    _begin = _pos = _sink->acquire(min_capacity, capacity);
+    _end = (_begin != nullptr) ? _begin + capacity : nullptr;
+
+    return result && (_begin != nullptr);
+}
+
+bool output_buffer::flush() {
+    bool result = true;
+    if (_begin != nullptr && _pos != _begin) {
+        result = _sink->commit(_begin, pending());
+        _begin = _pos = _end = nullptr;
+    }
+
+    return _sink->flush() && result;
+}
+
+} // namespace belog
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cstring>
+#include <memory>
+#include "aligned_alloc.hpp"
+#include "types.hpp"
+
+namespace belog {
+
+// A sink owns the memory the logging thread formats into. The consumer asks
+// for a region, fills it, and hands it back with commit(). Sinks are only
+// ever used by a single consumer thread.
+struct log_sink {
+    virtual ~log_sink() = default;
+
+    // Returns a region of at least min_capacity bytes, or nullptr if the sink
+    // cannot provide one. capacity receives the actual size of the region.
+    virtual char* acquire(size_t min_capacity, size_t& capacity) = 0;
+
+    // Passes the first length bytes of the region returned by the last call
+    // to acquire() on to the sink. The region must not be touched afterwards.
+    virtual bool commit(char* region, size_t length) = 0;
+
+    // Blocks until everything committed so far has been handed to the
+    // operating system.
+    virtual bool flush() {
+        return true;
+    }
+};
+
+// Writes to a file descriptor with one write() per committed region. The
+// descriptor can refer to a console, a file or a pipe and is not closed.
+struct fd_sink : log_sink {
+    static constexpr size_t DEFAULT_CAPACITY = size_t(1) << 18;
+
+    explicit fd_sink(int fd, size_t capacity = DEFAULT_CAPACITY);
+
+    char* acquire(size_t min_capacity, size_t& capacity) override;
+    bool commit(char* region, size_t length) override;
+
+private:
+    int _fd;
+    size_t _capacity;
+    std::unique_ptr<char, aligned_free_deleter> _buffer;
+};
+
+// Collects output in a growing block of memory, for formatting on one thread
+// and writing it out somewhere else later.
+struct memory_sink : log_sink {
+    static constexpr size_t DEFAULT_CAPACITY = size_t(1) << 16;
+
+    explicit memory_sink(size_t capacity = DEFAULT_CAPACITY);
+
+    char* acquire(size_t min_capacity, size_t& capacity) override;
+    bool commit(char* region, size_t length) override;
+
+    const char* data() const {
+        return _data.get();
+    }
+
+    size_t size() const {
+        return _size;
+    }
+
+    void clear() {
+        _size = 0;
+    }
+
+private:
+    std::unique_ptr<char[]> _data;
+    size_t _capacity;
+    size_t _size = 0;
+};
+
+// Writes all of data to fd, retrying on partial writes and interruptions.
+bool write_fully(int fd, const char* data, size_t length);
+
+// Returns the descriptor currently backing stdout.
+int stdout_fd();
+
+// The stream the consumer formats lines into. Accumulates output in regions
+// obtained from a sink and commits them when they fill up or on flush().
+struct output_buffer {
+    // Upper bound for reserve(), sinks are expected to hand out regions that
+    // are a lot larger than this.
+    static constexpr size_t MAX_RESERVE = 512;
+
+    explicit output_buffer(log_sink& sink) :
+        _sink(&sink) {}
+
+    ~output_buffer() {
+        flush();
+    }
+
+    output_buffer(const output_buffer&) = delete;
+    output_buffer& operator=(const output_buffer&) = delete;
+
+    void write(const char* data, size_t length) {
+        while (length > size_t(_end - _pos)) {
+            size_t chunk = size_t(_end - _pos);
+            if (chunk > 0) {
+                memcpy(_pos, data, chunk);
+                _pos += chunk;
+                data += chunk;
+                length -= chunk;
+            }
+
+            if (next_region(1) == false)
+                return;
+        }
+
+        memcpy(_pos, data, length);
+        _pos += length;
+    }
+
+    void put(char c) {
+        if (_pos == _end && next_region(1) == false)
+            return;
+
+        *(_pos++) = c;
+    }
+
+    // Returns an address at which up to length bytes can be formatted
+    // directly, call advance() with the number of bytes actually used.
+    char* reserve(size_t length) {
+        if (length > size_t(_end - _pos) && next_region(length) == false)
+            return nullptr;
+
+        return _pos;
+    }
+
+    void advance(size_t length) {
+        _pos += length;
+    }
+
+    size_t pending() const {
+        return size_t(_pos - _begin);
+    }
+
+    // Commits everything formatted so far and asks the sink to push it out.
+    bool flush();
+
+private:
+    bool next_region(size_t min_capacity);
+
+    log_sink* _sink;
+    char* _begin = nullptr;
+    char* _pos = nullptr;
+    char* _end = nullptr;
+};
+
+} // namespace belog
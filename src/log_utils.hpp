@@ -2,14 +2,225 @@
 #include "best_effort_logger.hpp"
 #include "compile_time_utilities.hpp"
 
-#define LOG_ERR(...) ::belog::log("[E] (" __FILE__ ":" STRINGIFY(__LINE__) ") ", __VA_ARGS__)
-#define LOG_WARN(...) ::belog::log("[W] (" __FILE__ ":" STRINGIFY(__LINE__) ") ", __VA_ARGS__)
-#define LOG_INFO(...) ::belog::log("[I] (" __FILE__ ":" STRINGIFY(__LINE__) ") ", __VA_ARGS__)
+// Log statements below BELOG_MIN_LEVEL are removed at compile time, their
+// arguments are not even compiled. 0 is debug, 1 info, 2 warning, 3 error
+// and 4 removes everything. Release builds remove debug lines by default,
+// so they can't be recorded either: to record debug lines with
+// set_recorder_level(level::debug) in a release build, define
+// BELOG_MIN_LEVEL=0 and raise the runtime level with set_level() instead.
+#if !defined(BELOG_MIN_LEVEL)
 #if defined(_DEBUG)
-#define LOG_DEBUG(...) ::belog::log("[D] (" __FILE__ ":" STRINGIFY(__LINE__) ") ", __VA_ARGS__)
+#define BELOG_MIN_LEVEL 0
 #else
-#define LOG_DEBUG(...)
+#define BELOG_MIN_LEVEL 1
 #endif
+#endif
+
+// Defining BELOG_MODULE to a string before including this header puts the
+// log statements of a translation unit into a module, whose level can be
+// changed at runtime independently of the global level.
+#if defined(BELOG_MODULE)
+static ::belog::module belog_module_{ BELOG_MODULE };
+#define BELOG_THRESHOLD belog_module_.threshold
+#else
+#define BELOG_THRESHOLD ::belog::global_threshold
+#endif
+
+namespace belog::detail {
+
+// stands in for log statements removed at compile time
+constexpr bool _stripped() {
+    return true;
+}
+
+} // namespace belog::detail
+
+// Lines filtered at runtime count as logged, so ON_FAIL_* does not break
+// into the debugger for them. Filtered lines at or above the level of the
+// flight recorder are recorded, see set_recorder_level().
+#define BELOG_LOG(severity, ...)                                                           \
+    (u8(severity) >= BELOG_THRESHOLD.load(std::memory_order_relaxed)                       \
+        ? ::belog::log(BELOG_CALLSITE(severity, #__VA_ARGS__), __VA_ARGS__)                \
+        : u8(severity) >= ::belog::recorder_threshold.load(std::memory_order_relaxed)      \
+            ? (::belog::record(BELOG_CALLSITE(severity, #__VA_ARGS__), __VA_ARGS__), true) \
+            : true)
+
+#if BELOG_MIN_LEVEL <= 3
+#define LOG_ERR(...) BELOG_LOG(::belog::level::error, __VA_ARGS__)
+#else
+#define LOG_ERR(...) ::belog::detail::_stripped()
+#endif
+
+#if BELOG_MIN_LEVEL <= 2
+#define LOG_WARN(...) BELOG_LOG(::belog::level::warning, __VA_ARGS__)
+#else
+#define LOG_WARN(...) ::belog::detail::_stripped()
+#endif
+
+#if BELOG_MIN_LEVEL <= 1
+#define LOG_INFO(...) BELOG_LOG(::belog::level::info, __VA_ARGS__)
+#else
+#define LOG_INFO(...) ::belog::detail::_stripped()
+#endif
+
+#if BELOG_MIN_LEVEL <= 0
+#define LOG_DEBUG(...) BELOG_LOG(::belog::level::debug, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ::belog::detail::_stripped()
+#endif
+
+// Sampled log statements, for lines that can fire far more often than anyone
+// wants to read them. severity is the name of a level, like error, and the
+// counts are constants:
+//
+//     LOG_EVERY_N(error, 1000, "queue full, size = ", size);
+//     LOG_FIRST_N(warning, 10, "falling back to ", name);
+//     LOG_RATE_LIMITED(error, 5, "read failed, error = ", code);
+//
+// Every statement keeps its own state, which is checked after the level, see
+// BELOG_LOG_SAMPLED_IF, and before any argument is evaluated. Lines
+// following suppressed ones end with the number of lines suppressed in
+// between, LOG_FIRST_N never resumes and has no such note. Suppressed lines
+// count as logged.
+
+namespace belog::detail {
+
+// Passes every n-th line, starting with the first one.
+struct every_n_state {
+    u64 n;
+    std::atomic<u64> count = 0;
+
+    explicit every_n_state(u64 n) :
+        n(n > 0 ? n : 1) {}
+
+    bool admit(u64& suppressed) {
+        u64 seen = count.fetch_add(1, std::memory_order_relaxed);
+        if (seen % n != 0)
+            return false;
+
+        suppressed = (seen == 0) ? 0 : n - 1;
+        return true;
+    }
+};
+
+struct first_n_state {
+    u64 n;
+    std::atomic<u64> count = 0;
+
+    explicit first_n_state(u64 n) :
+        n(n) {}
+
+    // count is only read once the limit is reached, so later calls do not
+    // contend for its cache line
+    bool admit() {
+        if (count.load(std::memory_order_relaxed) >= n)
+            return false;
+
+        return count.fetch_add(1, std::memory_order_relaxed) < n;
+    }
+};
+
+// A token bucket holding a second worth of lines, refilled at per_second
+// lines per second of tsc() time. The bucket is kept as the time it will be
+// full again, which fits into a single atomic.
+struct rate_limit_state {
+    u64 per_second;
+    // ticks per line, 0 until tsc_frequency() is known
+    std::atomic<u64> interval = 0;
+    std::atomic<u64> full_at = 0;
+    std::atomic<u64> suppressed = 0;
+
+    explicit rate_limit_state(u64 per_second) :
+        per_second(std::max(per_second, u64(1))) {}
+
+    bool admit(u64& suppressed_lines) {
+        // Lines logged before measure_tsc_frequency() has run all pass, there
+        // is no telling how fast tsc() time goes yet.
+        u64 ticks = interval.load(std::memory_order_relaxed);
+        if (ticks == 0) {
+            u64 frequency = tsc_frequency();
+            if (frequency == 0) {
+                suppressed_lines = 0;
+                return true;
+            }
+            ticks = std::max(frequency / per_second, u64(1));
+            interval.store(ticks, std::memory_order_relaxed);
+        }
+        // ticks covering a full bucket
+        const u64 capacity = ticks * per_second;
+
+        u64 now = tsc();
+        u64 full = full_at.load(std::memory_order_relaxed);
+        for (;;) {
+            u64 taken = std::max(full, now) + ticks;
+            if (taken - now > capacity) {
+                suppressed.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            if (full_at.compare_exchange_weak(full, taken, std::memory_order_relaxed))
+                break;
+        }
+
+        suppressed_lines = suppressed.exchange(0, std::memory_order_relaxed);
+        return true;
+    }
+};
+
+// Ends sampled lines, shows nothing if no lines were suppressed.
+struct suppressed_lines {
+    u64 count;
+};
+
+} // namespace belog::detail
+
+template<> struct belog::formatter<belog::detail::suppressed_lines> {
+    static void format(const detail::suppressed_lines& value, output_buffer& out);
+};
+
+// A reference to a static constructed from init, distinct for every
+// expansion.
+#define BELOG_CALLSITE_STATE(init) \
+    ([]() -> auto& { static auto state_ = init; return state_; }())
+
+// Like BELOG_LOG, a sampled line is logged at or above the threshold and
+// recorded below it, at or above the level of the flight recorder. Recorded
+// lines are sampled just the same, so a flood of one statement does not push
+// everything else out of the recorder. admit may set suppressed_.
+#define BELOG_LOG_SAMPLED_IF(severity, admit, ...)                                                  \
+    ([&] {                                                                                          \
+        if (u8(severity) < BELOG_MIN_LEVEL)                                                         \
+            return true;                                                                            \
+        const bool logged_ = u8(severity) >= BELOG_THRESHOLD.load(std::memory_order_relaxed);       \
+        if (!logged_ && u8(severity) < ::belog::recorder_threshold.load(std::memory_order_relaxed)) \
+            return true;                                                                            \
+        [[maybe_unused]] u64 suppressed_ = 0;                                                       \
+        if (!(admit))                                                                               \
+            return true;                                                                            \
+        if (logged_)                                                                                \
+            return ::belog::log(BELOG_CALLSITE(severity, #__VA_ARGS__), __VA_ARGS__);               \
+        ::belog::record(BELOG_CALLSITE(severity, #__VA_ARGS__), __VA_ARGS__);                       \
+        return true;                                                                                \
+    }())
+
+#define BELOG_LOG_SAMPLED(severity, state, ...)            \
+    BELOG_LOG_SAMPLED_IF(                                  \
+        severity,                                          \
+        BELOG_CALLSITE_STATE(state).admit(suppressed_),    \
+        __VA_ARGS__,                                       \
+        ::belog::detail::suppressed_lines{ suppressed_ })
+
+#define LOG_EVERY_N(severity, n, ...) \
+    BELOG_LOG_SAMPLED(::belog::level::severity, ::belog::detail::every_n_state{ u64(n) }, __VA_ARGS__)
+
+#define LOG_RATE_LIMITED(severity, per_second, ...) \
+    BELOG_LOG_SAMPLED(::belog::level::severity, ::belog::detail::rate_limit_state{ u64(per_second) }, __VA_ARGS__)
+
+#define LOG_FIRST_N(severity, n, ...)                                            \
+    BELOG_LOG_SAMPLED_IF(                                                        \
+        ::belog::level::severity,                                                \
+        BELOG_CALLSITE_STATE(::belog::detail::first_n_state{ u64(n) }).admit(), \
+        __VA_ARGS__)
 
 #define DEBUG_BREAK DebugBreak()
 
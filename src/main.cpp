@@ -205,7 +205,7 @@ LRESULT CALLBACK input_wndproc(HWND window, UINT message, WPARAM wparam, LPARAM
 
             auto input_queue = (spsc_queue<input, 8>*) GetWindowLongPtr(window, 0);
             if (input_queue == nullptr) {
-                LOG_ERR("input_queue attached to window is null, last error = ", GetLastError());
+                LOG_RATE_LIMITED(error, 1, "input_queue attached to window is null, last error = ", GetLastError());
                 break;
             }
 
@@ -0,0 +1,239 @@
+#include "mapped_file_sink.hpp"
+
+#include <algorithm>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace belog {
+
+#if defined(_WIN32)
+
+struct mapped_file_sink::file_context {
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+    size_t granularity;
+
+    file_context() {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        granularity = info.dwAllocationGranularity;
+    }
+
+    bool open(const char* path) {
+        file = CreateFileA(
+            path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL, nullptr
+        );
+        return file != INVALID_HANDLE_VALUE;
+    }
+
+    bool is_open() const {
+        return file != INVALID_HANDLE_VALUE;
+    }
+
+    // Mapping beyond the end of the file grows the file to the size of the
+    // mapping object.
+    char* map(u64 offset, size_t size) {
+        u64 end = offset + size;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, DWORD(end >> 32), DWORD(end), nullptr);
+        if (mapping == nullptr)
+            return nullptr;
+
+        void* view = MapViewOfFile(mapping, FILE_MAP_WRITE, DWORD(offset >> 32), DWORD(offset), size);
+        if (view == nullptr) {
+            CloseHandle(mapping);
+            mapping = nullptr;
+        }
+        return static_cast<char*>(view);
+    }
+
+    void unmap(char* window, size_t) {
+        UnmapViewOfFile(window);
+        CloseHandle(mapping);
+        mapping = nullptr;
+    }
+
+    bool sync(char* begin, size_t length, bool wait) {
+        if (FlushViewOfFile(begin, length) == FALSE)
+            return false;
+
+        return wait == false || FlushFileBuffers(file) != FALSE;
+    }
+
+    bool close(u64 length) {
+        LARGE_INTEGER end;
+        end.QuadPart = LONGLONG(length);
+        bool result = SetFilePointerEx(file, end, nullptr, FILE_BEGIN) && SetEndOfFile(file);
+        result = CloseHandle(file) && result;
+        file = INVALID_HANDLE_VALUE;
+        return result;
+    }
+};
+
+#else
+
+struct mapped_file_sink::file_context {
+    int fd = -1;
+    size_t granularity = size_t(sysconf(_SC_PAGESIZE));
+
+    bool open(const char* path) {
+        fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        return fd >= 0;
+    }
+
+    bool is_open() const {
+        return fd >= 0;
+    }
+
+    char* map(u64 offset, size_t size) {
+        // Allocate the blocks up front where possible. A store into a hole of
+        // a sparse file that cannot be backed because the disk is full raises
+        // SIGBUS instead of returning an error.
+#if defined(__linux__)
+        if (posix_fallocate(fd, off_t(offset), off_t(size)) != 0)
+            return nullptr;
+#else
+        if (ftruncate(fd, off_t(offset + size)) != 0)
+            return nullptr;
+#endif
+
+        void* window = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, off_t(offset));
+        if (window == MAP_FAILED)
+            return nullptr;
+
+        madvise(window, size, MADV_SEQUENTIAL);
+        return static_cast<char*>(window);
+    }
+
+    void unmap(char* window, size_t size) {
+        munmap(window, size);
+    }
+
+    bool sync(char* begin, size_t length, bool wait) {
+        return msync(begin, length, wait ? MS_SYNC : MS_ASYNC) == 0;
+    }
+
+    bool close(u64 length) {
+        bool result = ftruncate(fd, off_t(length)) == 0;
+        result = (::close(fd) == 0) && result;
+        fd = -1;
+        return result;
+    }
+};
+
+#endif
+
+mapped_file_sink::mapped_file_sink(const char* path, u64 rotate_size, size_t window_size, durability policy) :
+    _path(path),
+    _rotate_size(rotate_size),
+    _durability(policy),
+    _file(std::make_unique<file_context>())
+{
+    // windows have to start at multiples of the allocation granularity
+    auto granularity = _file->granularity;
+    _window_size = std::max(window_size + granularity - 1, 2 * granularity) / granularity * granularity;
+    _rotate_size = std::max(_rotate_size, u64(_window_size));
+
+    open_file();
+}
+
+mapped_file_sink::~mapped_file_sink() {
+    close_file();
+}
+
+bool mapped_file_sink::is_open() const {
+    return _window != nullptr;
+}
+
+char* mapped_file_sink::acquire(size_t min_capacity, size_t& capacity) {
+    // After moving the window its start is rounded down to the granularity,
+    // so only this much is guaranteed to be available.
+    if (_window == nullptr || min_capacity > _window_size - _file->granularity)
+        return nullptr;
+
+    if (_write_offset + min_capacity > _rotate_size) {
+        close_file();
+        _file_index += 1;
+        if (open_file() == false)
+            return nullptr;
+    } else if (_write_offset + min_capacity > _window_offset + _window_size) {
+        if (map_window(_write_offset) == false)
+            return nullptr;
+    }
+
+    u64 end = std::min(_window_offset + _window_size, _rotate_size);
+    capacity = size_t(end - _write_offset);
+    return _window + (_write_offset - _window_offset);
+}
+
+bool mapped_file_sink::commit(char* region, size_t length) {
+    if (_window == nullptr || region != _window + (_write_offset - _window_offset))
+        return false;
+
+    // The data already is in the page cache, nothing left to do.
+    _write_offset += length;
+    return true;
+}
+
+bool mapped_file_sink::flush() {
+    if (_window == nullptr || _durability == durability::page_cache || _synced_offset == _write_offset)
+        return true;
+
+    // msync wants page aligned addresses
+    u64 begin = std::max(_synced_offset, _window_offset) & ~u64(_file->granularity - 1);
+    begin = std::max(begin, _window_offset);
+    _synced_offset = _write_offset;
+
+    return _file->sync(
+        _window + (begin - _window_offset),
+        size_t(_write_offset - begin),
+        _durability == durability::synchronous
+    );
+}
+
+bool mapped_file_sink::open_file() {
+    auto path = _path + "." + std::to_string(_file_index);
+    if (_file->open(path.c_str()) == false)
+        return false;
+
+    _write_offset = 0;
+    _synced_offset = 0;
+    return map_window(0);
+}
+
+bool mapped_file_sink::close_file() {
+    if (_window != nullptr) {
+        flush();
+        unmap_window();
+    }
+
+    if (_file->is_open() == false)
+        return false;
+
+    return _file->close(_write_offset);
+}
+
+bool mapped_file_sink::map_window(u64 offset) {
+    if (_window != nullptr) {
+        flush();
+        unmap_window();
+    }
+
+    _window_offset = offset & ~u64(_file->granularity - 1);
+    _window = _file->map(_window_offset, _window_size);
+    return _window != nullptr;
+}
+
+void mapped_file_sink::unmap_window() {
+    _file->unmap(_window, _window_size);
+    _window = nullptr;
+}
+
+} // namespace belog
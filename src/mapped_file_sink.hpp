@@ -0,0 +1,77 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include "log_sink.hpp"
+#include "types.hpp"
+
+namespace belog {
+
+// Formats straight into a shared, writable mapping of the log file. The
+// file is grown one window at a time and the mapping moved along with it, so
+// committing output is a plain store into the page cache and costs no
+// system call. Lines that made it into the mapping survive a crash of the
+// process, only a crash of the machine can lose them, subject to the
+// configured durability.
+//
+// Output goes to <path>.0, <path>.1, ... and a new file is started before
+// the current one would grow beyond rotate_size. Files are trimmed to their
+// actual length when they are closed. A file left behind by a crash may have
+// trailing zero bytes up to the end of the last window.
+struct mapped_file_sink : log_sink {
+    enum class durability : u8 {
+        // leave write back entirely to the operating system
+        page_cache = 0,
+        // start write back of everything committed on every flush
+        background,
+        // wait for everything committed to reach the disk on every flush
+        synchronous
+    };
+
+    static constexpr size_t DEFAULT_WINDOW_SIZE = size_t(1) << 24;
+    static constexpr u64 DEFAULT_ROTATE_SIZE = u64(1) << 30;
+
+    explicit mapped_file_sink(
+        const char* path,
+        u64 rotate_size = DEFAULT_ROTATE_SIZE,
+        size_t window_size = DEFAULT_WINDOW_SIZE,
+        durability policy = durability::page_cache
+    );
+    ~mapped_file_sink() override;
+
+    mapped_file_sink(const mapped_file_sink&) = delete;
+    mapped_file_sink& operator=(const mapped_file_sink&) = delete;
+
+    bool is_open() const;
+
+    // index of the file currently written to
+    u32 file_index() const {
+        return _file_index;
+    }
+
+    char* acquire(size_t min_capacity, size_t& capacity) override;
+    bool commit(char* region, size_t length) override;
+    bool flush() override;
+
+    struct file_context;
+
+private:
+    bool open_file();
+    bool close_file();
+    bool map_window(u64 offset);
+    void unmap_window();
+
+    std::string _path;
+    u64 _rotate_size;
+    size_t _window_size;
+    durability _durability;
+
+    std::unique_ptr<file_context> _file;
+    char* _window = nullptr;
+    u64 _window_offset = 0;
+    u64 _write_offset = 0;
+    u64 _synced_offset = 0;
+    u32 _file_index = 0;
+};
+
+} // namespace belog
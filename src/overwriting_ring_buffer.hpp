@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include "compile_time_utilities.hpp"
+
+// A ring of variable sized elements that never runs full, new elements
+// overwrite the oldest ones instead. There is a single producer, which never
+// waits for readers. Readers take snapshots, which only contain the elements
+// that were not overwritten while the snapshot was taken.
+template<
+    int _buffer_size_log2,
+    int _content_align_log2 = ctu::log2_v<sizeof(void*)>,
+    int _align_log2 = 6,
+    typename _difference_type = ptrdiff_t
+>
+struct alignas(size_t(1) << _align_log2) overwriting_ring_buffer {
+    using difference_type = _difference_type;
+    static const auto size = size_t(1) << _buffer_size_log2;
+    static const auto mask = ctu::bit_mask_v<size_t, _buffer_size_log2>;
+    static const auto align = size_t(1) << _align_log2;
+    static const auto content_align_log2 = _content_align_log2;
+
+    static_assert(_buffer_size_log2 < ctu::bits_of<difference_type>);
+    static_assert(std::is_signed_v<difference_type>);
+    static_assert(content_align_log2 >= ctu::log2(sizeof(difference_type)));
+
+    // Elements have to be smaller than half the ring, so a new element never
+    // overwrites the end of the ring it is written to.
+    template<typename cbtype>
+    bool produce(size_t length, cbtype callback) noexcept(noexcept(callback(static_cast<void*>(nullptr)))) {
+        auto rounded_length = ctu::round_up_bits(length + sizeof(difference_type), content_align_log2);
+        if (length <= 0 || rounded_length > size / 2)
+            return false;
+
+        auto produce_pos = _produce_pos.load(std::memory_order_relaxed);
+        auto oldest_pos = _oldest_pos.load(std::memory_order_relaxed);
+
+        auto wrap_distance = size - (produce_pos & mask);
+        auto end_pos = produce_pos + rounded_length + (wrap_distance < rounded_length ? wrap_distance : 0);
+
+        if (end_pos - oldest_pos > size) {
+            while (end_pos - oldest_pos > size) {
+                difference_type oldest_length;
+                memcpy(&oldest_length, _buffer + (oldest_pos & mask), sizeof(oldest_length));
+                if (oldest_length < 0) {
+                    oldest_pos += -oldest_length;
+                } else {
+                    oldest_pos += ctu::round_up_bits(oldest_length + sizeof(difference_type), content_align_log2);
+                }
+            }
+
+            // Readers that see any of the overwritten bytes see the new
+            // position as well, see snapshot().
+            _oldest_pos.store(oldest_pos, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+
+        if (wrap_distance < rounded_length) {
+            new (_buffer + (produce_pos & mask)) difference_type(-difference_type(wrap_distance));
+            produce_pos += wrap_distance;
+        }
+
+        new (_buffer + (produce_pos & mask)) difference_type(length);
+        if (callback(static_cast<void*>(_buffer + (produce_pos & mask) + sizeof(difference_type)))) {
+            _produce_pos.store(produce_pos + rounded_length, std::memory_order_release);
+            return true;
+        }
+
+        return false;
+    }
+
+    // Drops every element, only called by the producer.
+    void clear() noexcept {
+        _oldest_pos.store(_produce_pos.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    // Copies the ring into scratch, which has to hold size bytes, and passes
+    // the elements produced at or after from_pos to callback, oldest first.
+    // Elements that were overwritten while the ring was copied are left out.
+    // Returns the position to pass as from_pos to the next snapshot.
+    template<typename cbtype>
+    size_t snapshot(std::byte* scratch, size_t from_pos, cbtype callback) const noexcept(noexcept(callback(static_cast<const void*>(nullptr), difference_type(0)))) {
+        auto produce_pos = _produce_pos.load(std::memory_order_acquire);
+        memcpy(scratch, _buffer, size);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        auto oldest_pos = _oldest_pos.load(std::memory_order_relaxed);
+
+        // everything before oldest_pos may have been overwritten
+        auto consume_pos = oldest_pos;
+        while (difference_type(produce_pos - consume_pos) > 0) {
+            difference_type length;
+            memcpy(&length, scratch + (consume_pos & mask), sizeof(length));
+
+            if (length < 0) {
+                consume_pos += -length;
+                continue;
+            }
+
+            if (difference_type(consume_pos - from_pos) >= 0) {
+                callback(static_cast<const void*>(scratch + (consume_pos & mask) + sizeof(difference_type)), length);
+            }
+            consume_pos += ctu::round_up_bits(length + sizeof(difference_type), content_align_log2);
+        }
+
+        return produce_pos;
+    }
+
+private:
+    alignas(align) std::byte _buffer[size];
+    alignas(align) std::atomic<size_t> _produce_pos = 0;
+    // start of the oldest element not overwritten yet, only written by the
+    // producer as well
+    std::atomic<size_t> _oldest_pos = 0;
+};
@@ -81,6 +81,61 @@ struct alignas(size_t(1) << _align_log2) spsc_ring_buffer {
         return false;
     }
 
+    // Consumes up to max_count elements, but loads the position of the
+    // producer and publishes the new position of the consumer only once.
+    // Returns the number of elements consumed.
+    template<typename cbtype>
+    size_t consume_n(size_t max_count, cbtype callback) noexcept(noexcept(callback(static_cast<const void*>(nullptr), difference_type(0)))) {
+        auto consume_pos = _consume_pos.load(std::memory_order_acquire);
+        auto produce_pos = _produce_pos.load(std::memory_order_acquire);
+        auto committed_pos = consume_pos;
+
+        size_t count = 0;
+        while (count < max_count && consume_pos != produce_pos) {
+            difference_type length;
+            memcpy(&length, _buffer + (consume_pos & mask), sizeof(length));
+
+            if (length < 0) {
+                consume_pos += -length;
+                memcpy(&length, _buffer + (consume_pos & mask), sizeof(length));
+            }
+
+            if (callback(static_cast<const void*>(_buffer + (consume_pos & mask) + sizeof(difference_type)), length) == false)
+                break;
+
+            consume_pos += ctu::round_up_bits(length + sizeof(difference_type), content_align_log2);
+            committed_pos = consume_pos;
+            count += 1;
+        }
+
+        if (count > 0) {
+            _consume_pos.store(committed_pos, std::memory_order_release);
+        }
+        return count;
+    }
+
+    // Passes the oldest element to callback without removing it, returns
+    // false if the buffer is empty.
+    template<typename cbtype>
+    bool peek(cbtype callback) const noexcept(noexcept(callback(static_cast<const void*>(nullptr), difference_type(0)))) {
+        auto consume_pos = _consume_pos.load(std::memory_order_acquire);
+        auto produce_pos = _produce_pos.load(std::memory_order_acquire);
+
+        if (produce_pos == consume_pos)
+            return false;
+
+        difference_type length;
+        memcpy(&length, _buffer + (consume_pos & mask), sizeof(length));
+
+        if (length < 0) {
+            consume_pos += -length;
+            memcpy(&length, _buffer + (consume_pos & mask), sizeof(length));
+        }
+
+        callback(static_cast<const void*>(_buffer + (consume_pos & mask) + sizeof(difference_type)), length);
+        return true;
+    }
+
     // returns true if buffer is empty after this call
     template<typename cbtype>
     bool consume_all(cbtype callback) noexcept(noexcept(callback(static_cast<const void*>(nullptr), difference_type(0)))) {
@@ -125,6 +180,15 @@ struct alignas(size_t(1) << _align_log2) spsc_ring_buffer {
         return produce_pos == consume_pos;
     }
 
+    // bytes taken up by elements not consumed yet, including their headers
+    // and padding
+    size_t used() const noexcept {
+        auto consume_pos = _consume_pos.load(std::memory_order_acquire);
+        auto produce_pos = _produce_pos.load(std::memory_order_acquire);
+
+        return produce_pos - consume_pos;
+    }
+
 private:
     alignas(align) std::byte _buffer[size];
     alignas(align) std::atomic<size_t> _produce_pos = 0;
@@ -408,3 +472,234 @@ private:
     alignas(align) std::atomic<size_t> _consume_pos = 0;
     mutable size_t _produce_pos_cache = 0;
 };
+
+// Like spsc_ring_buffer, with the size chosen at runtime. The elements are
+// stored right behind the ring, so rings are only made by create().
+//
+// A producer can move on to another ring by linking it as the successor of
+// this one, the consumer drains this ring before it follows the link. The
+// consumer can seal an empty ring to make produce() fail, which tells the
+// producer to move on. Consuming from a sealed ring unseals it.
+template<
+    int _content_align_log2 = ctu::log2_v<sizeof(void*)>,
+    int _align_log2 = 6,
+    typename _difference_type = ptrdiff_t
+>
+struct alignas(size_t(1) << _align_log2) dynamic_spsc_ring_buffer {
+    using difference_type = _difference_type;
+    static const auto align = size_t(1) << _align_log2;
+    static const auto content_align_log2 = _content_align_log2;
+
+    static_assert(std::is_signed_v<difference_type>);
+    static_assert(content_align_log2 >= ctu::log2(sizeof(difference_type)));
+
+    // size has to be a power of two, returns nullptr if out of memory
+    static dynamic_spsc_ring_buffer* create(size_t size) noexcept {
+        void* space = aligned_alloc(align, sizeof(dynamic_spsc_ring_buffer) + size);
+        if (space == nullptr)
+            return nullptr;
+
+        return new(space) dynamic_spsc_ring_buffer(size);
+    }
+
+    static void destroy(dynamic_spsc_ring_buffer* ring) noexcept {
+        ring->~dynamic_spsc_ring_buffer();
+        aligned_free(ring);
+    }
+
+    size_t size() const noexcept {
+        return _mask + 1;
+    }
+
+    // was_empty, if given, tells whether the ring held no element before this
+    // one, as far as the producer could see.
+    template<typename cbtype>
+    bool produce(size_t length, cbtype callback, bool* was_empty = nullptr) noexcept(noexcept(callback(static_cast<void*>(nullptr)))) {
+        const auto size = _mask + 1;
+        if (length <= 0 || length >= size)
+            return false;
+
+        // the position of a sealed ring leaves no room
+        auto consume_pos = _consume_pos.load(std::memory_order_acquire);
+        auto produce_pos = _produce_pos.load(std::memory_order_acquire);
+
+        auto rounded_length = ctu::round_up_bits(length + sizeof(difference_type), content_align_log2);
+
+        if ((produce_pos - consume_pos) > (size - rounded_length))
+            return false;
+
+        bool empty = produce_pos == consume_pos;
+
+        auto wrap_distance = size - (produce_pos & _mask);
+        if (wrap_distance < rounded_length) {
+            if ((produce_pos + wrap_distance - consume_pos) > (size - rounded_length))
+                return false;
+
+            new (data() + (produce_pos & _mask)) difference_type(-difference_type(wrap_distance));
+            produce_pos += wrap_distance;
+        }
+
+        new (data() + (produce_pos & _mask)) difference_type(length);
+        if (callback(static_cast<void*>(data() + (produce_pos & _mask) + sizeof(difference_type)))) {
+            _produce_pos.store(produce_pos + rounded_length, std::memory_order_release);
+            if (was_empty != nullptr) {
+                *was_empty = empty;
+            }
+            return true;
+        }
+
+        return false;
+    }
+
+    template<typename cbtype>
+    bool consume(cbtype callback) noexcept(noexcept(callback(static_cast<const void*>(nullptr), difference_type(0)))) {
+        auto consume_pos = _consume_pos.load(std::memory_order_acquire) & ~sealed_bit;
+        auto produce_pos = _produce_pos.load(std::memory_order_acquire);
+
+        if (produce_pos == consume_pos)
+            return false;
+
+        difference_type length;
+        memcpy(&length, data() + (consume_pos & _mask), sizeof(length));
+
+        if (length < 0) {
+            consume_pos += -length;
+            memcpy(&length, data() + (consume_pos & _mask), sizeof(length));
+        }
+
+        if (callback(static_cast<const void*>(data() + (consume_pos & _mask) + sizeof(difference_type)), length)) {
+            auto rounded_length = ctu::round_up_bits(length + sizeof(difference_type), content_align_log2);
+            _consume_pos.store(consume_pos + rounded_length, std::memory_order_release);
+            return true;
+        }
+
+        return false;
+    }
+
+    // Consumes up to max_count elements, but loads the position of the
+    // producer and publishes the new position of the consumer only once.
+    // Returns the number of elements consumed.
+    template<typename cbtype>
+    size_t consume_n(size_t max_count, cbtype callback) noexcept(noexcept(callback(static_cast<const void*>(nullptr), difference_type(0)))) {
+        auto consume_pos = _consume_pos.load(std::memory_order_acquire) & ~sealed_bit;
+        auto produce_pos = _produce_pos.load(std::memory_order_acquire);
+        auto committed_pos = consume_pos;
+
+        size_t count = 0;
+        while (count < max_count && consume_pos != produce_pos) {
+            difference_type length;
+            memcpy(&length, data() + (consume_pos & _mask), sizeof(length));
+
+            if (length < 0) {
+                consume_pos += -length;
+                memcpy(&length, data() + (consume_pos & _mask), sizeof(length));
+            }
+
+            if (callback(static_cast<const void*>(data() + (consume_pos & _mask) + sizeof(difference_type)), length) == false)
+                break;
+
+            consume_pos += ctu::round_up_bits(length + sizeof(difference_type), content_align_log2);
+            committed_pos = consume_pos;
+            count += 1;
+        }
+
+        if (count > 0) {
+            _consume_pos.store(committed_pos, std::memory_order_release);
+        }
+        return count;
+    }
+
+    // Passes the oldest element to callback without removing it, returns
+    // false if the buffer is empty.
+    template<typename cbtype>
+    bool peek(cbtype callback) const noexcept(noexcept(callback(static_cast<const void*>(nullptr), difference_type(0)))) {
+        auto consume_pos = _consume_pos.load(std::memory_order_acquire) & ~sealed_bit;
+        auto produce_pos = _produce_pos.load(std::memory_order_acquire);
+
+        if (produce_pos == consume_pos)
+            return false;
+
+        difference_type length;
+        memcpy(&length, data() + (consume_pos & _mask), sizeof(length));
+
+        if (length < 0) {
+            consume_pos += -length;
+            memcpy(&length, data() + (consume_pos & _mask), sizeof(length));
+        }
+
+        callback(static_cast<const void*>(data() + (consume_pos & _mask) + sizeof(difference_type)), length);
+        return true;
+    }
+
+    bool is_empty() const noexcept {
+        auto produce_pos = _produce_pos.load(std::memory_order_acquire);
+        auto consume_pos = _consume_pos.load(std::memory_order_acquire) & ~sealed_bit;
+
+        return produce_pos == consume_pos;
+    }
+
+    // bytes taken up by elements not consumed yet, including their headers
+    // and padding
+    size_t used() const noexcept {
+        auto consume_pos = _consume_pos.load(std::memory_order_acquire) & ~sealed_bit;
+        auto produce_pos = _produce_pos.load(std::memory_order_acquire);
+
+        return produce_pos - consume_pos;
+    }
+
+    // Only called by the consumer. A producer that saw the ring empty just
+    // before can still add an element after the ring is sealed, the consumer
+    // has to drain the ring until the producer moved on.
+    bool seal() noexcept {
+        auto consume_pos = _consume_pos.load(std::memory_order_relaxed);
+        if ((consume_pos & sealed_bit) != 0 || _produce_pos.load(std::memory_order_acquire) != consume_pos)
+            return false;
+
+        _consume_pos.store(consume_pos | sealed_bit, std::memory_order_release);
+        return true;
+    }
+
+    // Only called by the consumer.
+    void unseal() noexcept {
+        _consume_pos.store(_consume_pos.load(std::memory_order_relaxed) & ~sealed_bit, std::memory_order_release);
+    }
+
+    bool is_sealed() const noexcept {
+        return (_consume_pos.load(std::memory_order_acquire) & sealed_bit) != 0;
+    }
+
+    // Only called by the producer, which must not produce into this ring
+    // afterwards.
+    void link(dynamic_spsc_ring_buffer* successor) noexcept {
+        _successor.store(successor, std::memory_order_release);
+    }
+
+    // Once this returns a ring, everything produced into this one is visible.
+    dynamic_spsc_ring_buffer* successor() const noexcept {
+        return _successor.load(std::memory_order_acquire);
+    }
+
+private:
+    explicit dynamic_spsc_ring_buffer(size_t size) noexcept :
+        _mask(size - 1) {}
+
+    std::byte* data() noexcept {
+        return reinterpret_cast<std::byte*>(this + 1);
+    }
+
+    const std::byte* data() const noexcept {
+        return reinterpret_cast<const std::byte*>(this + 1);
+    }
+
+    // Set in the position of the consumer while the ring is sealed. Positions
+    // never get anywhere near it, and it makes the ring look full to the
+    // producer.
+    static const auto sealed_bit = size_t(1) << (ctu::bits_of<size_t> - 1);
+
+    // neither changes much, they share a cache line
+    size_t _mask;
+    std::atomic<dynamic_spsc_ring_buffer*> _successor = nullptr;
+
+    alignas(align) std::atomic<size_t> _produce_pos = 0;
+    alignas(align) std::atomic<size_t> _consume_pos = 0;
+};
@@ -0,0 +1,76 @@
+#include "wall_clock.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include "cpuid.hpp"
+
+namespace belog {
+
+// Errors larger than this are taken as the system clock having been set,
+// the map jumps to the new time instead of slowly catching up.
+static constexpr i64 STEP_THRESHOLD_NS = 50'000'000;
+
+// Measured rates further than this from the slope of the map, as a
+// fraction of it, are taken as the system clock having been set as well.
+static constexpr f64 MAX_RATE_CHANGE = 0.01;
+
+// Most the slope is changed to make up for an error, as a fraction of the
+// measured rate. Keeps the map from racing ahead or nearly stopping after a
+// bad sample.
+static constexpr f64 MAX_SLEW = 500e-6;
+
+// A tsc() value and the system clock read as close together as possible.
+// The system clock is read between two tsc() values, the pair taking the
+// least time to read is used, with the midpoint of the two.
+static void sample(u64& timepoint, i64& wall_clock) {
+    u64 best_span = ~u64(0);
+    for (int attempt = 0; attempt < 3; attempt += 1) {
+        u64 before = tsc();
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        u64 after = tsc();
+
+        if (after - before < best_span) {
+            best_span = after - before;
+            timepoint = before + best_span / 2;
+            wall_clock = i64(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count());
+        }
+    }
+}
+
+tsc_wall_clock::tsc_wall_clock() {
+    sample(_sample_timepoint, _sample_wall_clock);
+    anchor(_sample_timepoint, _sample_wall_clock, 1e9 / f64(tsc_frequency()));
+}
+
+void tsc_wall_clock::calibrate() {
+    u64 timepoint = 0;
+    i64 wall_clock = 0;
+    sample(timepoint, wall_clock);
+
+    u64 ticks = timepoint - _sample_timepoint;
+    if (ticks == 0)
+        return;
+
+    i64 predicted = nanoseconds(timepoint);
+    i64 error = wall_clock - predicted;
+    f64 rate = f64(wall_clock - _sample_wall_clock) / f64(ticks);
+
+    _sample_timepoint = timepoint;
+    _sample_wall_clock = wall_clock;
+
+    // The rate measured across a step of the system clock is meaningless,
+    // the slope is kept as it is.
+    f64 slope = f64(_multiplier) / f64(u64(1) << _shift);
+    if (error > STEP_THRESHOLD_NS || error < -STEP_THRESHOLD_NS || rate < slope * (1.0 - MAX_RATE_CHANGE) || rate > slope * (1.0 + MAX_RATE_CHANGE)) {
+        anchor(timepoint, wall_clock, slope);
+        return;
+    }
+
+    // The map continues from where it is now and takes about as long as
+    // the last interval to make up the error, at the rate the tsc was
+    // actually found to run at.
+    f64 slew = std::clamp(f64(error) / f64(ticks), -rate * MAX_SLEW, rate * MAX_SLEW);
+    anchor(timepoint, predicted, rate + slew);
+}
+
+} // namespace belog
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include "types.hpp"
+
+namespace belog {
+
+// Maps tsc() values to nanoseconds since 1970-01-01 UTC. The map is a line
+// through an anchor, with a slope in nanoseconds per tick as a fixed point
+// number, so a conversion is a multiplication and a shift. calibrate()
+// compares the map to the system clock and moves the anchor, without making
+// the map jump unless the system clock was set.
+struct tsc_wall_clock {
+    // Samples the system clock and starts out with the nominal tsc frequency.
+    tsc_wall_clock();
+
+    // A map that is never calibrated, as used when decoding binary logs.
+    tsc_wall_clock(u64 timepoint, i64 wall_clock, u64 frequency) :
+        _sample_timepoint(timepoint),
+        _sample_wall_clock(wall_clock) {
+        anchor(timepoint, wall_clock, 1e9 / f64(frequency));
+    }
+
+    // A map as described by the accessors below, binary logs store those.
+    tsc_wall_clock(u64 base_timepoint, i64 base_wall_clock, u64 multiplier, u32 shift) :
+        _base_timepoint(base_timepoint),
+        _base_wall_clock(base_wall_clock),
+        _multiplier(multiplier),
+        _shift(std::min(shift, u32(32))) {}
+
+    // Corrects the map for the drift of the tsc against the system clock
+    // since the last call. Meant to be called about once a second.
+    void calibrate();
+
+    i64 nanoseconds(u64 timepoint) const {
+        i64 delta = i64(timepoint - _base_timepoint);
+        u64 magnitude = delta < 0 ? u64(0) - u64(delta) : u64(delta);
+
+        // Only the low half of magnitude is set within a few seconds of the
+        // anchor. The halves are scaled separately so neither product can
+        // overflow, as _multiplier is kept below 2^32.
+        u64 scaled = ((magnitude & 0xFFFFFFFF) * _multiplier) >> _shift;
+        if ((magnitude >> 32) != 0) {
+            scaled += ((magnitude >> 32) * _multiplier) << (32 - _shift);
+        }
+
+        return delta < 0 ? _base_wall_clock - i64(scaled) : _base_wall_clock + i64(scaled);
+    }
+
+    u64 base_timepoint() const {
+        return _base_timepoint;
+    }
+
+    i64 base_wall_clock() const {
+        return _base_wall_clock;
+    }
+
+    u64 multiplier() const {
+        return _multiplier;
+    }
+
+    u32 shift() const {
+        return _shift;
+    }
+
+private:
+    void anchor(u64 timepoint, i64 wall_clock, f64 nanoseconds_per_tick) {
+        _shift = 32;
+        while (_shift > 0 && nanoseconds_per_tick * f64(u64(1) << _shift) >= f64(u64(1) << 32)) {
+            _shift -= 1;
+        }
+
+        _base_timepoint = timepoint;
+        _base_wall_clock = wall_clock;
+        _multiplier = u64(nanoseconds_per_tick * f64(u64(1) << _shift) + 0.5);
+    }
+
+    u64 _base_timepoint = 0;
+    i64 _base_wall_clock = 0;
+    // nanoseconds per tick * 2^_shift
+    u64 _multiplier = 0;
+    u32 _shift = 0;
+
+    // system clock as seen by the last calibration
+    u64 _sample_timepoint = 0;
+    i64 _sample_wall_clock = 0;
+};
+
+} // namespace belog
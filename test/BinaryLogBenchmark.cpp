@@ -0,0 +1,324 @@
+#include <benchmark/benchmark.h>
+#include <best_effort_logger.hpp>
+#include <binary_log_reader.hpp>
+#include <cpuid.hpp>
+#include <log_format.hpp>
+#include <log_sink.hpp>
+#include <log_utils.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Logs the same lines twice before running any benchmark, once as text and
+// once in the binary format, and compares the text with what
+// binary_log_reader decodes from the binary log. The binary log is also
+// decoded from a point in time through its side index, and after cutting it
+// short, which has to keep the lines of the intact blocks.
+
+static const char* LOG_PATH = "BinaryLogBenchmark.log";
+static const char* INDEX_PATH = "BinaryLogBenchmark.idx";
+static const char* TRUNCATED_PATH = "BinaryLogBenchmark.truncated.log";
+
+struct vector3 {
+    f32 x, y, z;
+};
+
+template<> struct belog::formatter<vector3> {
+    static void format(const vector3& value, belog::output_buffer& out) {
+        out.put('(');
+        belog::format_value(out, value.x);
+        out.write(", ", 2);
+        belog::format_value(out, value.y);
+        out.write(", ", 2);
+        belog::format_value(out, value.z);
+        out.put(')');
+    }
+};
+
+// 12 bytes of capture, the segments after it still have to be aligned
+static_assert(sizeof(belog::user_type_data<vector3>) % 8 == 0);
+
+struct named {
+    std::string name;
+    u32 id;
+};
+
+struct named_capture {
+    u32 id;
+    u32 length;
+};
+
+template<> struct belog::formatter<named> {
+    using capture_type = named_capture;
+
+    static capture_type capture(const named& value) {
+        return { value.id, u32(value.name.size()) };
+    }
+
+    static void format(const capture_type& value, belog::output_buffer& out) {
+        out.write("named #", 7);
+        belog::format_value(out, belog::fmt(value.id, belog::hex{}));
+        out.put('/');
+        belog::format_value(out, value.length);
+    }
+};
+
+// Arrays of const char that are no literals of the log statement change
+// from line to line.
+struct tagged {
+    const char tag[6];
+};
+
+static const tagged TAGS[] = { { "alpha" }, { "bravo" } };
+
+static constexpr int LINES_PER_PHASE = 5000;
+
+// Every line is written by the calling thread, so thread ids are the same in
+// both runs. Strings come in lengths up to BELOG_STRING_MAX, one is longer
+// and left out of its line.
+static void log_lines(int phase) {
+    std::string text(BELOG_STRING_MAX, 'x');
+    for (int line = 0; line < LINES_PER_PHASE; line += 1) {
+        int idx = phase * LINES_PER_PHASE + line;
+        std::string_view str(text.data(), size_t(idx * 7919) % (idx % 100 == 0 ? BELOG_STRING_MAX : 64));
+        switch (idx % 4) {
+        case 0:
+            LOG_INFO("line ", idx, " ", -idx, " ", u64(idx) << 40, " ", true, " [", str, "]");
+            break;
+        case 1:
+            LOG_WARN("line ", idx, " ", f32(idx) / 3, " ", f64(idx) * 1e-9, " ", belog::fmt(idx, belog::hex{}));
+            break;
+        case 2:
+            LOG_ERR("line ", idx, " ", vector3{ f32(idx), -0.5f, 1e6f }, idx, " ", named{ std::string(str), u32(idx) });
+            break;
+        default:
+            LOG_INFO("line ", idx, " [", belog::fmt(idx, belog::padding(9, '0')), "] ", "literal ", TAGS[idx / 4 % 2].tag);
+            break;
+        }
+    }
+    if (phase == 0) {
+        std::string too_long(BELOG_STRING_MAX + 1, 'y');
+        LOG_INFO("left out ", too_long);
+    }
+}
+
+// Times differ between the two runs, the rest of every line has to match.
+static std::vector<std::string> lines_without_time(const char* data, size_t size) {
+    std::vector<std::string> lines;
+    std::string_view text(data, size);
+    while (text.empty() == false) {
+        size_t end = std::min(text.find('\n'), text.size());
+        std::string_view line = text.substr(0, end);
+        text.remove_prefix(std::min(end + 1, text.size()));
+        if (line.empty())
+            continue;
+
+        size_t time = line.find("] ");
+        size_t time_end = line.find(": [", time);
+        if (time == std::string_view::npos || time_end == std::string_view::npos) {
+            lines.emplace_back(line);
+        } else {
+            lines.push_back(std::string(line.substr(0, time + 2)) + std::string(line.substr(time_end)));
+        }
+    }
+    return lines;
+}
+
+static bool write_file(const char* path, const char* data, size_t size) {
+    std::FILE* file = std::fopen(path, "wb");
+    if (file == nullptr)
+        return false;
+
+    bool result = std::fwrite(data, 1, size, file) == size;
+    return (std::fclose(file) == 0) && result;
+}
+
+// Decodes the lines of the log at path logged at or after min_timepoint, on
+// a few threads and in small chunks. intact is set to what decode() returns.
+static bool decode(const char* path, const char* index_path, u64 min_timepoint, belog::memory_sink& out_sink, bool& intact) {
+    belog::binary_log_reader reader;
+    if (reader.open(path) == false)
+        return false;
+
+    if (index_path != nullptr && reader.load_index(index_path) == false)
+        return false;
+
+    reader.set_time_format(belog::time_format::seconds);
+    belog::binary_log_reader::filter lines;
+    lines.min_timepoint = min_timepoint;
+
+    belog::output_buffer out(out_sink);
+    intact = reader.decode(out, lines, 4, size_t(1) << 16);
+    return true;
+}
+
+// Lines only wait for room in their buffer while a logging thread runs, see
+// set_blocking_level(). The logging thread flushed to its sink once it runs.
+struct flushed_sink : belog::memory_sink {
+    std::atomic_bool flushed = false;
+
+    bool commit(char* region, size_t length) override {
+        bool result = belog::memory_sink::commit(region, length);
+        flushed.store(true, std::memory_order_release);
+        return result;
+    }
+};
+
+static std::thread start_logging(flushed_sink& sink) {
+    belog::set_sink(&sink);
+    std::thread logging_thread{ belog::do_logging };
+    LOG_INFO("logging thread started");
+    while (sink.flushed.load(std::memory_order_acquire) == false) {
+        std::this_thread::yield();
+    }
+    return logging_thread;
+}
+
+// Shuts down from a thread of its own, whose buffer has room for it.
+static void stop_logging(std::thread& logging_thread) {
+    std::thread([] {
+        belog::enable_logging();
+        belog::shutdown();
+    }).join();
+    logging_thread.join();
+}
+
+static bool compare_with_text() {
+    belog::set_time_format(belog::time_format::seconds);
+    belog::set_blocking_level(belog::level::debug, 1000000);
+    belog::enable_logging();
+
+    flushed_sink text_sink;
+    {
+        std::thread logging_thread = start_logging(text_sink);
+        log_lines(0);
+        log_lines(1);
+        stop_logging(logging_thread);
+    }
+
+    flushed_sink binary_sink;
+    belog::memory_sink index_sink;
+    belog::set_format(belog::output_format::binary);
+    belog::set_index_sink(&index_sink);
+    u64 cut;
+    {
+        std::thread logging_thread = start_logging(binary_sink);
+        log_lines(0);
+        cut = tsc();
+        log_lines(1);
+        stop_logging(logging_thread);
+    }
+
+    belog::set_sink(nullptr);
+    belog::set_format(belog::output_format::text);
+    belog::set_index_sink(nullptr);
+    belog::set_blocking_level(belog::level::off);
+
+    belog::drop_statistics drops = belog::get_drop_statistics();
+    if (drops.lines != 0 || drops.strings_left_out != 2) {
+        std::fprintf(stderr, "lines were dropped or strings left out unexpectedly\n");
+        return false;
+    }
+
+    if (write_file(LOG_PATH, binary_sink.data(), binary_sink.size()) == false
+        || write_file(INDEX_PATH, index_sink.data(), index_sink.size()) == false
+        || write_file(TRUNCATED_PATH, binary_sink.data(), binary_sink.size() / 2 + 4) == false) {
+        std::fprintf(stderr, "could not write %s\n", LOG_PATH);
+        return false;
+    }
+
+    auto expected = lines_without_time(text_sink.data(), text_sink.size());
+    bool result = true;
+    bool intact = false;
+
+    auto tagged_lines = std::count_if(expected.begin(), expected.end(), [](const std::string& line) {
+        return line.size() >= 13 && line.compare(line.size() - 13, 13, "literal bravo") == 0;
+    });
+    if (tagged_lines != LINES_PER_PHASE / 4) {
+        std::fprintf(stderr, "array of const char was taken for a string literal\n");
+        result = false;
+    }
+
+    belog::memory_sink decoded;
+    if (decode(LOG_PATH, nullptr, 0, decoded, intact) == false || intact == false
+        || lines_without_time(decoded.data(), decoded.size()) != expected) {
+        std::fprintf(stderr, "decoded binary log differs from text output\n");
+        result = false;
+    }
+
+    // everything logged after the cut, found through the index
+    auto expected_after_cut = std::vector<std::string>(expected.end() - LINES_PER_PHASE, expected.end());
+    decoded.clear();
+    if (decode(LOG_PATH, INDEX_PATH, cut, decoded, intact) == false || intact == false
+        || lines_without_time(decoded.data(), decoded.size()) != expected_after_cut) {
+        std::fprintf(stderr, "binary log decoded from the middle differs from text output\n");
+        result = false;
+    }
+
+    // the intact blocks before the cut, with the damage reported
+    decoded.clear();
+    bool opened = decode(TRUNCATED_PATH, nullptr, 0, decoded, intact);
+    auto truncated = lines_without_time(decoded.data(), decoded.size());
+    if (opened == false || intact || truncated.empty() || truncated.size() >= expected.size()
+        || std::equal(truncated.begin(), truncated.end(), expected.begin()) == false) {
+        std::fprintf(stderr, "truncated binary log does not decode to a part of the text output\n");
+        result = false;
+    }
+
+    std::remove(TRUNCATED_PATH);
+    return result;
+}
+
+// Hands out the same memory over and over, so only decoding is measured.
+struct null_sink : belog::log_sink {
+    char* acquire(size_t min_capacity, size_t& capacity) override {
+        if (min_capacity > sizeof(buffer))
+            return nullptr;
+
+        capacity = sizeof(buffer);
+        return buffer;
+    }
+
+    bool commit(char*, size_t) override {
+        return true;
+    }
+
+private:
+    char buffer[1 << 18];
+};
+
+static null_sink sink;
+
+// Decodes the log written by compare_with_text() in chunks of 64 KiB.
+static void DecodeBinaryLog(benchmark::State& state) {
+    belog::binary_log_reader reader;
+    if (reader.open(LOG_PATH) == false) {
+        state.SkipWithError("no binary log");
+        return;
+    }
+
+    belog::binary_log_reader::filter all;
+    belog::output_buffer out(sink);
+    for (auto _ : state) {
+        reader.decode(out, all, u32(state.range(0)), size_t(1) << 16);
+    }
+}
+
+BENCHMARK(DecodeBinaryLog)->ArgName("Threads")->Arg(1)->Arg(2)->Arg(4)->Arg(8)->UseRealTime();
+
+int main(int argc, char** argv) {
+    measure_tsc_frequency();
+    bool result = compare_with_text();
+    if (result) {
+        benchmark::Initialize(&argc, argv);
+        benchmark::RunSpecifiedBenchmarks();
+    }
+
+    std::remove(LOG_PATH);
+    std::remove(INDEX_PATH);
+    return result ? 0 : 1;
+}
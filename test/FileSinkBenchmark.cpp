@@ -0,0 +1,202 @@
+#include <benchmark/benchmark.h>
+#include <async_file_sink.hpp>
+#include <log_sink.hpp>
+#include <mapped_file_sink.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+// Writes through the file sinks before running any benchmark and compares
+// what ends up in the files with what went in. mapped_file_sink rotates
+// through several files, which have to add up to its input.
+
+static const char* ASYNC_PATH = "FileSinkBenchmark.async.log";
+static const char* MAPPED_PATH = "FileSinkBenchmark.mapped.log";
+
+static constexpr size_t REGION_SIZE = size_t(1) << 14;
+static constexpr size_t WINDOW_SIZE = size_t(1) << 16;
+static constexpr u64 ROTATE_SIZE = u64(1) << 20;
+
+// Text that differs from region to region, so misplaced or repeated output
+// shows up.
+static std::string make_input(size_t size) {
+    std::string input;
+    input.reserve(size + 32);
+    for (u64 line = 0; input.size() < size; line += 1) {
+        input += "line ";
+        input += std::to_string(line * 2654435761u);
+        input += '\n';
+    }
+    input.resize(size);
+    return input;
+}
+
+static bool read_file(const char* path, std::string& contents) {
+    std::FILE* file = std::fopen(path, "rb");
+    if (file == nullptr)
+        return false;
+
+    contents.clear();
+    char buffer[1 << 16];
+    for (size_t read; (read = std::fread(buffer, 1, sizeof(buffer), file)) > 0;) {
+        contents.append(buffer, read);
+    }
+    return std::fclose(file) == 0;
+}
+
+// Commits input in pieces of up to max_length bytes, like the logging thread
+// does with lines of varying length, and flushes every now and then.
+static bool write_through(belog::log_sink& sink, std::string_view input, size_t max_length) {
+    for (size_t step = 0; input.empty() == false; step += 1) {
+        if (step % 16 == 15 && sink.flush() == false)
+            return false;
+
+        size_t length = std::min(input.size(), 1 + step * 7919 % max_length);
+        size_t capacity = 0;
+        char* region = sink.acquire(length, capacity);
+        if (region == nullptr || capacity < length)
+            return false;
+
+        std::memcpy(region, input.data(), length);
+        if (sink.commit(region, length) == false)
+            return false;
+
+        input.remove_prefix(length);
+    }
+    return sink.flush();
+}
+
+// The second sink appends to the file the first one left behind. Regions are
+// reused several times, with io_uring while the others are still written.
+static bool check_async_sink(bool allow_async) {
+    std::remove(ASYNC_PATH);
+    std::string input = make_input(64 * REGION_SIZE + 123);
+    std::string_view first = std::string_view(input).substr(0, input.size() / 3);
+    std::string_view second = std::string_view(input).substr(first.size());
+
+    bool result = true;
+    for (std::string_view part : { first, second }) {
+        belog::async_file_sink sink(ASYNC_PATH, REGION_SIZE, 4, allow_async);
+        if (allow_async && sink.is_async() == false) {
+            std::fprintf(stderr, "asynchronous I/O is not available, writing synchronously\n");
+        }
+        result = sink.is_open() && (allow_async || sink.is_async() == false)
+            && write_through(sink, part, REGION_SIZE) && result;
+    }
+
+    std::string contents;
+    if (result == false || read_file(ASYNC_PATH, contents) == false || contents != input) {
+        std::fprintf(stderr, "async_file_sink wrote something else than it was given, async = %d\n", int(allow_async));
+        result = false;
+    }
+
+    std::remove(ASYNC_PATH);
+    return result;
+}
+
+static std::string mapped_file_path(u32 index) {
+    return std::string(MAPPED_PATH) + "." + std::to_string(index);
+}
+
+static void remove_mapped_files() {
+    for (u32 index = 0; std::remove(mapped_file_path(index).c_str()) == 0; index += 1) {}
+}
+
+// Writes enough for the window to move many times and for the sink to
+// rotate into a third file. The files have to add up to the input, without
+// zero bytes left over from the last window of a file.
+static bool check_mapped_sink(belog::mapped_file_sink::durability policy) {
+    remove_mapped_files();
+    std::string input = make_input(size_t(ROTATE_SIZE) * 5 / 2);
+
+    bool result;
+    {
+        belog::mapped_file_sink sink(MAPPED_PATH, ROTATE_SIZE, WINDOW_SIZE, policy);
+        result = sink.is_open() && write_through(sink, input, WINDOW_SIZE / 4) && sink.file_index() == 2;
+    }
+
+    std::string contents;
+    std::string file;
+    for (u32 index = 0; result && read_file(mapped_file_path(index).c_str(), file); index += 1) {
+        result = file.size() <= ROTATE_SIZE && file.empty() == false;
+        contents += file;
+    }
+
+    if (result == false || contents != input) {
+        std::fprintf(stderr, "mapped_file_sink wrote something else than it was given, durability = %d\n", int(policy));
+        result = false;
+    }
+
+    remove_mapped_files();
+    return result;
+}
+
+// Commits whole regions, range(0) tells whether to use asynchronous I/O.
+static void AsyncFileSink(benchmark::State& state) {
+    std::remove(ASYNC_PATH);
+    {
+        belog::async_file_sink sink(ASYNC_PATH, REGION_SIZE, 4, state.range(0) != 0);
+        if (sink.is_open() == false) {
+            state.SkipWithError("could not open file");
+            return;
+        }
+
+        for (auto _ : state) {
+            size_t capacity = 0;
+            char* region = sink.acquire(REGION_SIZE, capacity);
+            std::memset(region, 'x', REGION_SIZE);
+            sink.commit(region, REGION_SIZE);
+        }
+        sink.flush();
+    }
+    std::remove(ASYNC_PATH);
+    state.SetBytesProcessed(i64(state.iterations()) * i64(REGION_SIZE));
+}
+
+BENCHMARK(AsyncFileSink)->ArgName("Async")->Arg(1)->Arg(0)->Iterations(1 << 13);
+
+// Commits regions the size of async_file_sink's and flushes after every 16
+// of them, range(0) is the durability.
+static void MappedFileSink(benchmark::State& state) {
+    remove_mapped_files();
+    {
+        auto policy = belog::mapped_file_sink::durability(state.range(0));
+        belog::mapped_file_sink sink(MAPPED_PATH, belog::mapped_file_sink::DEFAULT_ROTATE_SIZE,
+            belog::mapped_file_sink::DEFAULT_WINDOW_SIZE, policy);
+        if (sink.is_open() == false) {
+            state.SkipWithError("could not open file");
+            return;
+        }
+
+        u64 count = 0;
+        for (auto _ : state) {
+            size_t capacity = 0;
+            char* region = sink.acquire(REGION_SIZE, capacity);
+            std::memset(region, 'x', REGION_SIZE);
+            sink.commit(region, REGION_SIZE);
+            if (++count % 16 == 0) {
+                sink.flush();
+            }
+        }
+    }
+    remove_mapped_files();
+    state.SetBytesProcessed(i64(state.iterations()) * i64(REGION_SIZE));
+}
+
+BENCHMARK(MappedFileSink)->ArgName("Durability")->Arg(0)->Arg(1)->Arg(2)->Iterations(1 << 13);
+
+int main(int argc, char** argv) {
+    bool result = check_async_sink(true);
+    result = check_async_sink(false) && result;
+    result = check_mapped_sink(belog::mapped_file_sink::durability::page_cache) && result;
+    result = check_mapped_sink(belog::mapped_file_sink::durability::background) && result;
+    result = check_mapped_sink(belog::mapped_file_sink::durability::synchronous) && result;
+    if (result) {
+        benchmark::Initialize(&argc, argv);
+        benchmark::RunSpecifiedBenchmarks();
+    }
+
+    return result ? 0 : 1;
+}
@@ -0,0 +1,273 @@
+#include <benchmark/benchmark.h>
+#include <best_effort_logger.hpp>
+#include <log_format.hpp>
+#include <log_sink.hpp>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+// Checks format_float before running any benchmark. Without a precision,
+// every style has to read back as the same value with strtod. Digits are
+// compared to the shortest output found by trying snprintf with increasing
+// precision, Grisu2 needs more of them when the shortest output lies exactly
+// halfway to a neighbouring value, those cases are counted. A few values are
+// compared to known output.
+
+static belog::float_attributes attributes_for(u32 length_log2, u32 style) {
+    belog::float_attributes attrs{ 0 };
+    attrs.length_log2 = length_log2;
+    attrs.display_style = style;
+    attrs.precision = attrs.precision.mask;
+    return attrs;
+}
+
+template<typename type>
+static std::string format(belog::float_attributes attrs, type val) {
+    belog::memory_sink sink;
+    {
+        belog::output_buffer out(sink);
+        belog::format_float(out, attrs, reinterpret_cast<const char*>(&val));
+    }
+    return std::string(sink.data(), sink.size());
+}
+
+static int digit_count(const std::string& text) {
+    // digits of the mantissa, without leading zeros
+    int count = 0;
+    bool leading = true;
+    for (char c : text) {
+        if (c == 'e' || c == 'E')
+            break;
+        if (c >= '1' && c <= '9')
+            leading = false;
+        if (c >= '0' && c <= '9' && leading == false)
+            count += 1;
+    }
+    return count;
+}
+
+template<typename type>
+static type parse(const char* text) {
+    if constexpr (std::is_same_v<type, float>) {
+        return std::strtof(text, nullptr);
+    } else {
+        return std::strtod(text, nullptr);
+    }
+}
+
+template<typename type>
+static int shortest_length(type val) {
+    char buffer[64];
+    for (int precision = 0; precision < std::numeric_limits<type>::max_digits10; precision += 1) {
+        std::snprintf(buffer, sizeof(buffer), "%.*e", precision, double(val));
+        if (parse<type>(buffer) == val)
+            return precision + 1;
+    }
+    return std::numeric_limits<type>::max_digits10;
+}
+
+template<typename type, typename bits_type>
+static bool check_type(const char* name, int value_count) {
+    static_assert(sizeof(type) == sizeof(bits_type));
+    u32 length_log2 = sizeof(type) == 4 ? 2 : 3;
+    int failures = 0;
+    int longer = 0;
+
+    u64 state = 0x9E3779B97F4A7C15ull;
+    for (int idx = 0; idx < value_count && failures < 10; idx += 1) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+
+        bits_type bits = bits_type(state);
+        type val;
+        std::memcpy(&val, &bits, sizeof(val));
+        if (std::isfinite(val) == false)
+            continue;
+
+        for (u32 style : { belog::FLOAT_DISPLAY_PLAIN, belog::FLOAT_DISPLAY_SCIENTIFIC, belog::FLOAT_DISPLAY_HEXADECIMAL, belog::FLOAT_DISPLAY_ADAPTIVE }) {
+            std::string text = format(attributes_for(length_log2, style), val);
+            type parsed = parse<type>(text.c_str());
+            if (std::memcmp(&parsed, &val, sizeof(val)) != 0) {
+                std::fprintf(stderr, "%s: %s does not read back as %a\n", name, text.c_str(), double(val));
+                failures += 1;
+            }
+        }
+
+        std::string text = format(attributes_for(length_log2, belog::FLOAT_DISPLAY_SCIENTIFIC), val);
+        int shortest = shortest_length(val);
+        int count = digit_count(text);
+        if (count > std::numeric_limits<type>::max_digits10) {
+            std::fprintf(stderr, "%s: %s has more than %d digits\n", name, text.c_str(), std::numeric_limits<type>::max_digits10);
+            failures += 1;
+        } else if (count > shortest) {
+            longer += 1;
+        }
+    }
+
+    std::fprintf(stderr, "%s: %d of %d values longer than necessary\n", name, longer, value_count);
+    return failures == 0;
+}
+
+static bool check_known_output() {
+    struct known_output {
+        double val;
+        u32 style;
+        u32 sign_handling;
+        bool show_point;
+        bool uppercase;
+        const char* expected;
+    };
+
+    static const known_output cases[] = {
+        { 0.0, belog::FLOAT_DISPLAY_PLAIN, 0, false, false, "0" },
+        { -0.0, belog::FLOAT_DISPLAY_PLAIN, 0, false, false, "-0" },
+        { 0.1, belog::FLOAT_DISPLAY_PLAIN, 0, false, false, "0.1" },
+        { 1.5, belog::FLOAT_DISPLAY_PLAIN, belog::FLOAT_SIGN_SHOW_ALWAYS, false, false, "+1.5" },
+        { 1.5, belog::FLOAT_DISPLAY_PLAIN, belog::FLOAT_SIGN_PAD_IF_POSITIVE, false, false, " 1.5" },
+        { -1.5, belog::FLOAT_DISPLAY_PLAIN, belog::FLOAT_SIGN_PAD_IF_POSITIVE, false, false, "-1.5" },
+        { 3.0, belog::FLOAT_DISPLAY_PLAIN, 0, true, false, "3." },
+        { 1e21, belog::FLOAT_DISPLAY_PLAIN, 0, false, false, "1000000000000000000000" },
+        { 1.25e-5, belog::FLOAT_DISPLAY_PLAIN, 0, false, false, "0.0000125" },
+        { 123.456, belog::FLOAT_DISPLAY_SCIENTIFIC, 0, false, false, "1.23456e+02" },
+        { 3.0, belog::FLOAT_DISPLAY_SCIENTIFIC, 0, true, true, "3.E+00" },
+        { 5e-324, belog::FLOAT_DISPLAY_SCIENTIFIC, 0, false, false, "5e-324" },
+        { 1.7976931348623157e308, belog::FLOAT_DISPLAY_SCIENTIFIC, 0, false, false, "1.7976931348623157e+308" },
+        { 123456.0, belog::FLOAT_DISPLAY_ADAPTIVE, 0, false, false, "123456" },
+        { 1e20, belog::FLOAT_DISPLAY_ADAPTIVE, 0, false, false, "1e+20" },
+        { 0.001, belog::FLOAT_DISPLAY_ADAPTIVE, 0, false, false, "0.001" },
+        { 0.00001, belog::FLOAT_DISPLAY_ADAPTIVE, 0, false, false, "1e-05" },
+        { 1.0, belog::FLOAT_DISPLAY_HEXADECIMAL, 0, false, false, "0x1p+0" },
+        { -3.0, belog::FLOAT_DISPLAY_HEXADECIMAL, 0, false, true, "-0X1.8P+1" },
+        { 1.0, belog::FLOAT_DISPLAY_HEXADECIMAL, 0, true, false, "0x1.p+0" },
+        { 5e-324, belog::FLOAT_DISPLAY_HEXADECIMAL, 0, false, false, "0x0.0000000000001p-1022" },
+        { std::numeric_limits<double>::infinity(), belog::FLOAT_DISPLAY_PLAIN, belog::FLOAT_SIGN_SHOW_ALWAYS, false, false, "+inf" },
+        { -std::numeric_limits<double>::infinity(), belog::FLOAT_DISPLAY_SCIENTIFIC, 0, false, true, "-INF" },
+        { std::numeric_limits<double>::quiet_NaN(), belog::FLOAT_DISPLAY_ADAPTIVE, 0, false, false, "nan" },
+    };
+
+    bool result = true;
+    for (const known_output& entry : cases) {
+        belog::float_attributes attrs = attributes_for(3, entry.style);
+        attrs.sign_handling = entry.sign_handling;
+        attrs.always_show_decimal_point = entry.show_point;
+        attrs.is_uppercase = entry.uppercase;
+        std::string text = format(attrs, entry.val);
+        if (text != entry.expected) {
+            std::fprintf(stderr, "expected %s, got %s\n", entry.expected, text.c_str());
+            result = false;
+        }
+    }
+
+    // float is shown with the digits of float, not those of its double
+    if (format(attributes_for(2, belog::FLOAT_DISPLAY_PLAIN), 0.1f) != "0.1") {
+        std::fprintf(stderr, "0.1f is not shown as 0.1\n");
+        result = false;
+    }
+
+    return result;
+}
+
+static bool check_output() {
+    bool result = check_known_output();
+    result = check_type<double, u64>("double", 1000000) && result;
+    result = check_type<float, u32>("float", 1000000) && result;
+    return result;
+}
+
+// Hands out the same memory over and over, so only formatting is measured.
+struct null_sink : belog::log_sink {
+    char* acquire(size_t min_capacity, size_t& capacity) override {
+        if (min_capacity > sizeof(buffer))
+            return nullptr;
+
+        capacity = sizeof(buffer);
+        return buffer;
+    }
+
+    bool commit(char*, size_t) override {
+        return true;
+    }
+
+private:
+    char buffer[1 << 18];
+};
+
+static null_sink sink;
+
+// Values from 10^-magnitude to 10^magnitude with random digits.
+static std::vector<double> values_of_magnitude(int magnitude) {
+    std::vector<double> values;
+    u64 state = 0x2545F4914F6CDD1Dull;
+    for (int idx = 0; idx < 1024; idx += 1) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        double mantissa = double(state >> 11) / double(u64(1) << 53);
+        int exponent = magnitude == 0 ? 0 : int(state % u64(2 * magnitude + 1)) - magnitude;
+        values.push_back(mantissa * std::pow(10.0, exponent));
+    }
+    return values;
+}
+
+void configure_benchmark(benchmark::internal::Benchmark* bench) {
+    bench->ArgNames({"Magnitude", "Style"});
+
+    for (int magnitude : { 0, 10, 300 }) {
+        for (int style : { belog::FLOAT_DISPLAY_PLAIN, belog::FLOAT_DISPLAY_SCIENTIFIC, belog::FLOAT_DISPLAY_ADAPTIVE }) {
+            bench->Args({ magnitude, style });
+        }
+    }
+}
+
+static void FormatFloat(benchmark::State& state) {
+    auto values = values_of_magnitude(int(state.range(0)));
+    belog::float_attributes attrs = attributes_for(3, u32(state.range(1)));
+
+    belog::output_buffer out(sink);
+    for (auto _ : state) {
+        for (double val : values) {
+            belog::format_float(out, attrs, reinterpret_cast<const char*>(&val));
+        }
+        out.flush();
+    }
+
+    state.SetItemsProcessed(state.iterations() * values.size());
+}
+
+BENCHMARK(FormatFloat)->Apply(configure_benchmark);
+
+// The snprintf path used without a precision before, which shows six digits
+// after the point instead of the ones needed to read back the value.
+static void SnprintfFloat(benchmark::State& state) {
+    auto values = values_of_magnitude(int(state.range(0)));
+    static const char* formats[] = { "%f", "%e", "%a", "%g" };
+    const char* format = formats[state.range(1)];
+
+    belog::output_buffer out(sink);
+    for (auto _ : state) {
+        for (double val : values) {
+            char* dst = out.reserve(belog::output_buffer::MAX_RESERVE);
+            int len = std::snprintf(dst, belog::output_buffer::MAX_RESERVE, format, val);
+            out.advance(size_t(len) < belog::output_buffer::MAX_RESERVE ? size_t(len) : belog::output_buffer::MAX_RESERVE - 1);
+        }
+        out.flush();
+    }
+
+    state.SetItemsProcessed(state.iterations() * values.size());
+}
+
+BENCHMARK(SnprintfFloat)->Apply(configure_benchmark);
+
+int main(int argc, char** argv) {
+    if (check_output() == false)
+        return 1;
+
+    benchmark::Initialize(&argc, argv);
+    benchmark::RunSpecifiedBenchmarks();
+    return 0;
+}
@@ -0,0 +1,302 @@
+#include <benchmark/benchmark.h>
+#include <best_effort_logger.hpp>
+#include <bitmanip.hpp>
+#include <log_format.hpp>
+#include <log_sink.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+// Compares format_integer against the formatter it replaced before running
+// any benchmark, for every value of the 8 and 16 bit types and for edge
+// cases and random values of the wider ones, under all integer_attributes.
+
+static auto& DIGITS =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// The formatter as it was before digits were produced from tables, output
+// has to stay the same.
+template<typename type>
+void reference_format(belog::output_buffer& out, belog::integer_attributes attrs, type val) {
+    if (attrs.is_hex) {
+        const char* base = attrs.is_uppercase ? "0123456789ABCDEF" : "0123456789abcdef";
+        char buffer[attrs.max_padded_length()];
+        int digits = (bitmanip::find_last_set(val) / 4) + 1;
+
+        size_t idx = 0;
+        if (attrs.is_left_aligned == false && attrs.padded_length() > u64(digits)) {
+            while (idx < attrs.padded_length() - digits) {
+                buffer[idx] = char(attrs.padding_codepoint);
+                idx += 1;
+            }
+        }
+
+        do {
+            digits -= 1;
+            buffer[idx] = base[(val >> (digits * 4)) & 0xF];
+            idx += 1;
+        } while (digits > 0);
+
+        if (attrs.is_left_aligned) {
+            while (idx < attrs.padded_length()) {
+                buffer[idx] = char(attrs.padding_codepoint);
+                idx += 1;
+            }
+        }
+
+        out.write(buffer, idx);
+    } else {
+        char buffer[2 * attrs.max_padded_length()];
+        memset(buffer, int(attrs.padding_codepoint), sizeof(buffer));
+
+        using unsigned_type = std::make_unsigned_t<type>;
+
+        unsigned_type abs_val;
+        if constexpr (std::is_same_v<type, unsigned_type>) {
+            abs_val = val;
+        } else if (val < 0) {
+            abs_val = unsigned_type(~val + 1);
+        } else {
+            abs_val = unsigned_type(val);
+        }
+
+        auto ptr = buffer + attrs.max_padded_length();
+
+        while (abs_val >= 100) {
+            size_t idx = (abs_val % 100) * 2;
+            *(ptr--) = DIGITS[idx + 1];
+            *(ptr--) = DIGITS[idx];
+            abs_val /= 100;
+        }
+        *(ptr--) = DIGITS[abs_val * 2 + 1];
+        if (abs_val >= 10) {
+            *(ptr--) = DIGITS[abs_val * 2];
+        }
+
+        if (val < 0) {
+            *(ptr--) = '-';
+        } else if (attrs.show_sign) {
+            *(ptr--) = '+';
+        }
+
+        size_t write_len = std::max(size_t(attrs.padded_length()), size_t((buffer + attrs.max_padded_length()) - ptr));
+
+        if (attrs.is_left_aligned) {
+            out.write(ptr + 1, write_len);
+        } else {
+            out.write(buffer + attrs.max_padded_length() - write_len + 1, write_len);
+        }
+    }
+}
+
+// Every combination of the options of integer_attributes, with a selection
+// of padded lengths.
+static std::vector<belog::integer_attributes> attribute_combinations() {
+    std::vector<belog::integer_attributes> result;
+    for (u32 bits = 0; bits < 16; bits += 1) {
+        for (u32 width : { 1, 2, 5, 11, 20, 21, 32 }) {
+            for (u32 codepoint : { ' ', '0' }) {
+                belog::integer_attributes attrs{ 0 };
+                attrs.is_hex = bits & 1;
+                attrs.is_uppercase = (bits >> 1) & 1;
+                attrs.show_sign = (bits >> 2) & 1;
+                attrs.is_left_aligned = (bits >> 3) & 1;
+                attrs.padded_length(width);
+                attrs.padding_codepoint = codepoint;
+                result.push_back(attrs);
+            }
+        }
+    }
+    return result;
+}
+
+template<typename type>
+static std::vector<type> test_values() {
+    std::vector<type> values;
+    if constexpr (sizeof(type) <= 2) {
+        for (i64 val = std::numeric_limits<type>::min(); val <= std::numeric_limits<type>::max(); val += 1) {
+            values.push_back(type(val));
+        }
+    } else {
+        values.push_back(std::numeric_limits<type>::min());
+        values.push_back(std::numeric_limits<type>::max());
+        for (u64 power = 1; power != 0 && power <= u64(std::numeric_limits<type>::max()); power *= 10) {
+            for (u64 val : { power - 1, power, power + 1 }) {
+                values.push_back(type(val));
+                values.push_back(type(u64(0) - val));
+            }
+            if (power > ~u64(0) / 10)
+                break;
+        }
+        for (int bit = 0; bit < int(8 * sizeof(type)); bit += 1) {
+            u64 power = u64(1) << bit;
+            for (u64 val : { power - 1, power, power + 1 }) {
+                values.push_back(type(val));
+                values.push_back(type(u64(0) - val));
+            }
+        }
+
+        u64 state = 0x9E3779B97F4A7C15ull;
+        for (int idx = 0; idx < 200000; idx += 1) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            // spread values over all magnitudes, not just the largest ones
+            values.push_back(type(state >> (state % (8 * sizeof(type)))));
+        }
+    }
+    return values;
+}
+
+template<typename type>
+static bool compare_type(const char* name) {
+    auto values = test_values<type>();
+    belog::memory_sink actual_sink;
+    belog::memory_sink expected_sink;
+    bool result = true;
+
+    for (belog::integer_attributes attrs : attribute_combinations()) {
+        actual_sink.clear();
+        expected_sink.clear();
+        {
+            belog::output_buffer actual(actual_sink);
+            belog::output_buffer expected(expected_sink);
+            for (type val : values) {
+                belog::integer_data data(val);
+                // assigning one bitfield to another would copy all bits
+                attrs.length_log2 = u64(data.attributes.length_log2);
+                attrs.is_unsigned = u64(data.attributes.is_unsigned);
+                belog::format_integer(actual, attrs, data.msg);
+                actual.put('\n');
+                reference_format(expected, attrs, val);
+                expected.put('\n');
+            }
+        }
+
+        if (actual_sink.size() != expected_sink.size() || memcmp(actual_sink.data(), expected_sink.data(), actual_sink.size()) != 0) {
+            std::fprintf(stderr, "%s: output differs for attributes %016llx\n", name, (unsigned long long)attrs.all_bits);
+            result = false;
+        }
+    }
+
+    return result;
+}
+
+static bool compare_with_reference() {
+    bool result = true;
+    result = compare_type<char>("char") && result;
+    result = compare_type<signed char>("signed char") && result;
+    result = compare_type<unsigned char>("unsigned char") && result;
+    result = compare_type<signed short>("short") && result;
+    result = compare_type<unsigned short>("unsigned short") && result;
+    result = compare_type<signed int>("int") && result;
+    result = compare_type<unsigned int>("unsigned int") && result;
+    result = compare_type<signed long>("long") && result;
+    result = compare_type<unsigned long>("unsigned long") && result;
+    result = compare_type<signed long long>("long long") && result;
+    result = compare_type<unsigned long long>("unsigned long long") && result;
+    return result;
+}
+
+// Hands out the same memory over and over, so only formatting is measured.
+struct null_sink : belog::log_sink {
+    char* acquire(size_t min_capacity, size_t& capacity) override {
+        if (min_capacity > sizeof(buffer))
+            return nullptr;
+
+        capacity = sizeof(buffer);
+        return buffer;
+    }
+
+    bool commit(char*, size_t) override {
+        return true;
+    }
+
+private:
+    char buffer[1 << 18];
+};
+
+static null_sink sink;
+
+// Values with the given number of decimal digits.
+static std::vector<u64> values_of_length(int digits) {
+    u64 low = 1;
+    for (int idx = 1; idx < digits; idx += 1) {
+        low *= 10;
+    }
+    u64 range = digits >= 20 ? ~u64(0) - low : low * 9;
+
+    std::vector<u64> values;
+    u64 state = 0x2545F4914F6CDD1Dull;
+    for (int idx = 0; idx < 1024; idx += 1) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        values.push_back(low + state % range);
+    }
+    return values;
+}
+
+void configure_benchmark(benchmark::internal::Benchmark* bench) {
+    bench->ArgNames({"Digits", "Hex"});
+
+    for (int digits : { 1, 4, 8, 12, 16, 20 }) {
+        bench->Args({ digits, 0 });
+    }
+    for (int digits : { 1, 8, 20 }) {
+        bench->Args({ digits, 1 });
+    }
+}
+
+static void FormatInteger(benchmark::State& state) {
+    auto values = values_of_length(int(state.range(0)));
+    belog::integer_attributes attrs{ 0 };
+    attrs.length_log2 = u32(ctu::log2_v<sizeof(u64)>);
+    attrs.is_unsigned = 1;
+    attrs.is_hex = state.range(1) != 0;
+
+    belog::output_buffer out(sink);
+    for (auto _ : state) {
+        for (u64 val : values) {
+            belog::format_integer(out, attrs, reinterpret_cast<const char*>(&val));
+        }
+        out.flush();
+    }
+
+    state.SetItemsProcessed(state.iterations() * values.size());
+}
+
+BENCHMARK(FormatInteger)->Apply(configure_benchmark);
+
+static void ReferenceFormatInteger(benchmark::State& state) {
+    auto values = values_of_length(int(state.range(0)));
+    belog::integer_attributes attrs{ 0 };
+    attrs.is_hex = state.range(1) != 0;
+
+    belog::output_buffer out(sink);
+    for (auto _ : state) {
+        for (u64 val : values) {
+            reference_format(out, attrs, val);
+        }
+        out.flush();
+    }
+
+    state.SetItemsProcessed(state.iterations() * values.size());
+}
+
+BENCHMARK(ReferenceFormatInteger)->Apply(configure_benchmark);
+
+int main(int argc, char** argv) {
+    if (compare_with_reference() == false)
+        return 1;
+
+    benchmark::Initialize(&argc, argv);
+    benchmark::RunSpecifiedBenchmarks();
+    return 0;
+}
@@ -0,0 +1,145 @@
+#include <benchmark/benchmark.h>
+#include <best_effort_logger.hpp>
+#include <cpuid.hpp>
+#include <log_sink.hpp>
+#include <log_utils.hpp>
+#include <thread>
+#include <vector>
+
+// Hands out the same memory over and over, so only the logger is measured
+// and not the device behind it.
+struct null_sink : belog::log_sink {
+    char* acquire(size_t min_capacity, size_t& capacity) override {
+        if (min_capacity > sizeof(buffer))
+            return nullptr;
+
+        capacity = sizeof(buffer);
+        return buffer;
+    }
+
+    bool commit(char*, size_t) override {
+        return true;
+    }
+
+private:
+    char buffer[1 << 18];
+};
+
+static constexpr int MAX_CONSUMERS = 8;
+static null_sink shard_sinks[MAX_CONSUMERS];
+
+static constexpr int MAX_FORMATTERS = 8;
+
+// Time from starting the logging threads until they have written every line
+// of every producer. Producers retry until their line fits into their buffer.
+// Each logging thread writes to a sink of its own and leaves formatting to
+// formatter threads, if there are any.
+static void run_logger(benchmark::State& state, int producers, int lines, int consumers, int formatters) {
+    static bool initialized = [] {
+        measure_tsc_frequency();
+        for (int shard = 0; shard < MAX_CONSUMERS; shard += 1) {
+            belog::set_shard_sink(u32(shard), &shard_sinks[shard]);
+        }
+        return true;
+    }();
+    (void)initialized;
+
+    belog::set_shard_count(u32(consumers));
+    belog::set_formatter_threads(u32(formatters));
+
+    for (auto _ : state) {
+        std::vector<std::thread> logging_threads;
+        for (int shard = 0; shard < consumers; shard += 1) {
+            logging_threads.emplace_back(belog::do_logging_shard, u32(shard));
+        }
+
+        std::vector<std::thread> threads;
+        for (int producer = 0; producer < producers; producer += 1) {
+            threads.emplace_back([producer, lines] {
+                belog::enable_logging();
+                for (int line = 0; line < lines; line += 1) {
+                    while (LOG_INFO("producer ", producer, " line ", line, " value ", 1234567u) == false) {
+                        std::this_thread::yield();
+                    }
+                }
+            });
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        // stops the logging threads of all shards
+        std::thread([] {
+            belog::enable_logging();
+            belog::shutdown();
+        }).join();
+        for (auto& thread : logging_threads) {
+            thread.join();
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * producers * lines);
+}
+
+void configure_benchmark(benchmark::internal::Benchmark* bench) {
+    bench->ArgNames({"Producers", "Lines"});
+
+    bench->Args({ 1, 1000000 });
+    bench->Args({ 2, 500000 });
+    bench->Args({ 4, 250000 });
+    bench->Args({ 16, 62500 });
+    bench->Args({ 64, 15625 });
+    bench->Args({ 256, 3907 });
+
+    bench->UseRealTime();
+    bench->Unit(benchmark::kMillisecond);
+}
+
+// A single logging thread that formats lines itself.
+static void Logger(benchmark::State& state) {
+    run_logger(state, int(state.range(0)), int(state.range(1)), 1, 0);
+}
+
+BENCHMARK(Logger)->Apply(configure_benchmark);
+
+void configure_sharded_benchmark(benchmark::internal::Benchmark* bench) {
+    bench->ArgNames({"Producers", "Lines", "Consumers"});
+
+    for (int consumers = 1; consumers <= MAX_CONSUMERS; consumers *= 2) {
+        bench->Args({ 16, 62500, consumers });
+        bench->Args({ 64, 15625, consumers });
+    }
+
+    bench->UseRealTime();
+    bench->Unit(benchmark::kMillisecond);
+}
+
+// Like Logger, with the buffers spread over several logging threads.
+static void ShardedLogger(benchmark::State& state) {
+    run_logger(state, int(state.range(0)), int(state.range(1)), int(state.range(2)), 0);
+}
+
+BENCHMARK(ShardedLogger)->Apply(configure_sharded_benchmark);
+
+void configure_pipelined_benchmark(benchmark::internal::Benchmark* bench) {
+    bench->ArgNames({"Producers", "Lines", "Formatters"});
+
+    for (int formatters = 0; formatters <= MAX_FORMATTERS; formatters = formatters == 0 ? 1 : formatters * 2) {
+        bench->Args({ 16, 62500, formatters });
+        bench->Args({ 64, 15625, formatters });
+    }
+
+    bench->UseRealTime();
+    bench->Unit(benchmark::kMillisecond);
+}
+
+// Like Logger, with a single logging thread that leaves formatting to a pool
+// of formatter threads.
+static void PipelinedLogger(benchmark::State& state) {
+    run_logger(state, int(state.range(0)), int(state.range(1)), 1, int(state.range(2)));
+}
+
+BENCHMARK(PipelinedLogger)->Apply(configure_pipelined_benchmark);
+
+BENCHMARK_MAIN();
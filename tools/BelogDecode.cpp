@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include "types.hpp"
+#include "binary_log_reader.hpp"
+#include "log_sink.hpp"
+
+// Turns binary belog output into text.
+//
+// BelogDecode <log> [--index <file>] [--from <t>] [--to <t>] [--wall] [--threads <n>]
+//                   [--level <d|i|w|e>] [--thread <id>]... [--callsite <file[:line]>]...
+//                   [--seconds]
+//
+// --from and --to are seconds since output started, or nanoseconds since
+// 1970-01-01 UTC if --wall is given. --level drops lines below the given
+// severity, --thread and --callsite can be repeated and keep only lines from
+// any of the given threads or callsites. Rotated files have to be
+// concatenated in order before decoding, only the first one starts with a
+// file header. Lines show wall clock time, or seconds since output started
+// with --seconds.
+
+// in the order of belog::level
+static const char LEVELS[] = "diwe";
+
+static void usage() {
+    std::fprintf(
+        stderr,
+        "usage: BelogDecode <log> [--index <file>] [--from <t>] [--to <t>] [--wall] [--threads <n>]\n"
+        "                         [--level <d|i|w|e>] [--thread <id>]... [--callsite <file[:line]>]...\n"
+        "                         [--seconds]\n"
+    );
+}
+
+int main(int argc, char** argv) {
+    const char* log_path = nullptr;
+    const char* index_path = nullptr;
+    const char* from = nullptr;
+    const char* to = nullptr;
+    bool wall_clock = false;
+    bool seconds = false;
+    u32 thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+    belog::binary_log_reader::filter lines;
+
+    for (int idx = 1; idx < argc; idx += 1) {
+        bool has_value = idx + 1 < argc;
+        if (std::strcmp(argv[idx], "--index") == 0 && has_value) {
+            index_path = argv[++idx];
+        } else if (std::strcmp(argv[idx], "--from") == 0 && has_value) {
+            from = argv[++idx];
+        } else if (std::strcmp(argv[idx], "--to") == 0 && has_value) {
+            to = argv[++idx];
+        } else if (std::strcmp(argv[idx], "--wall") == 0) {
+            wall_clock = true;
+        } else if (std::strcmp(argv[idx], "--seconds") == 0) {
+            seconds = true;
+        } else if (std::strcmp(argv[idx], "--threads") == 0 && has_value) {
+            thread_count = u32(std::strtoul(argv[++idx], nullptr, 10));
+        } else if (std::strcmp(argv[idx], "--level") == 0 && has_value) {
+            const char* severity = std::strchr(LEVELS, argv[++idx][0]);
+            if (severity == nullptr || *severity == 0) {
+                usage();
+                return EXIT_FAILURE;
+            }
+            lines.min_severity = belog::level(severity - LEVELS);
+        } else if (std::strcmp(argv[idx], "--thread") == 0 && has_value) {
+            lines.thread_ids.push_back(u32(std::strtoul(argv[++idx], nullptr, 10)));
+        } else if (std::strcmp(argv[idx], "--callsite") == 0 && has_value) {
+            lines.callsites.push_back(argv[++idx]);
+        } else if (log_path == nullptr && argv[idx][0] != '-') {
+            log_path = argv[idx];
+        } else {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (log_path == nullptr) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    belog::binary_log_reader reader;
+    if (reader.open(log_path) == false) {
+        std::fprintf(stderr, "%s is not a binary belog file\n", log_path);
+        return EXIT_FAILURE;
+    }
+
+    if (index_path != nullptr && reader.load_index(index_path) == false) {
+        std::fprintf(stderr, "%s is not an index of %s\n", index_path, log_path);
+        return EXIT_FAILURE;
+    }
+
+    auto timepoint = [&](const char* text, u64 unbounded) {
+        if (text == nullptr)
+            return unbounded;
+
+        if (wall_clock)
+            return reader.timepoint_from_wall_clock(std::strtoll(text, nullptr, 10));
+
+        return reader.timepoint_from_seconds(std::strtod(text, nullptr));
+    };
+
+    if (seconds) {
+        reader.set_time_format(belog::time_format::seconds);
+    }
+
+    belog::fd_sink sink(belog::stdout_fd());
+    bool result;
+    {
+        belog::output_buffer out(sink);
+        lines.min_timepoint = timepoint(from, 0);
+        lines.max_timepoint = timepoint(to, ~u64(0));
+        result = reader.decode(out, lines, thread_count);
+        out.put('\n');
+    }
+
+    if (result == false) {
+        std::fprintf(stderr, "%s is damaged, output is incomplete\n", log_path);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}